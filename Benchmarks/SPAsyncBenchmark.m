@@ -0,0 +1,512 @@
+//
+//  SPAsyncBenchmark.m
+//  SPAsync
+//
+//  Command line benchmarks for the SPAsync core, for platforms without XCTest's measureBlock:
+//  and for keeping an eye on regressions from CI. See Benchmarks/README.md.
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsync.h>
+#import <SPAsync/NSObject+SPInvocationGrabbing.h>
+#import "SPAsyncClock.h"
+#include <math.h>
+
+#pragma mark Benchmarks
+
+/// Prepares whatever a run of 'operations' operations needs, outside of the timing.
+typedef id(^SPBenchmarkSetup)(NSUInteger operations);
+/// Performs 'operations' operations, given what the setup returned.
+typedef void(^SPBenchmarkBody)(id context, NSUInteger operations);
+
+@interface SPBenchmark : NSObject
+@property(nonatomic,copy) NSString *name;
+@property(nonatomic) NSUInteger operations; // per repetition, at scale 1
+@property(nonatomic,copy) SPBenchmarkSetup setup;
+@property(nonatomic,copy) SPBenchmarkBody body;
+@end
+@implementation SPBenchmark
+@end
+
+@interface SPBenchmarkAgent : NSObject <SPAgent>
+- (instancetype)initWithMailbox:(BOOL)hasMailbox;
+- (void)ping;
+- (id)pingCount;
+@end
+
+/// Resumes its async methods inline, on whichever thread completes what they await.
+@interface SPBenchmarkAwaiter : NSObject
+- (dispatch_queue_t)workQueue;
+- (SPTask *)awaitEach:(NSArray *)sources;
+@end
+
+static NSMutableArray *gBenchmarks;
+
+static void SPBenchmarkAdd(NSString *name, NSUInteger operations, SPBenchmarkSetup setup, SPBenchmarkBody body)
+{
+    SPBenchmark *benchmark = [SPBenchmark new];
+    benchmark.name = name;
+    benchmark.operations = operations;
+    benchmark.setup = setup;
+    benchmark.body = body;
+    [gBenchmarks addObject:benchmark];
+}
+
+static void SPBenchmarkWait(SPTask *task)
+{
+    NSError *error = nil;
+    [task waitWithTimeout:INFINITY error:&error];
+    NSCAssert(!error, @"Benchmark task failed: %@", error);
+}
+
+static NSArray *SPBenchmarkSources(NSUInteger count)
+{
+    NSMutableArray *sources = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count; i++)
+        [sources addObject:[SPTaskCompletionSource new]];
+    return sources;
+}
+
+/// A chain: that keeps chaining more work, each step first hopping to 'queue'.
+static SPTask *SPBenchmarkRecursiveChain(NSUInteger remaining, dispatch_queue_t queue)
+{
+    if(remaining == 0)
+        return [SPTask completedTask:@1];
+    return [[SPTask performWork:^id{ return nil; } onQueue:queue] chain:^SPTask *(id value) {
+        return SPBenchmarkRecursiveChain(remaining - 1, queue);
+    } on:[SPTask inlineQueue]];
+}
+
+/// Holds up serial 'queue' until 'gate' is signalled, and queues 'count' tasks for ~5us of CPU
+/// each behind that. Returns the tasks.
+static NSArray *SPBenchmarkQueueWork(dispatch_queue_t queue, dispatch_semaphore_t gate, NSUInteger count, BOOL cooperative)
+{
+    dispatch_async(queue, ^{
+        dispatch_semaphore_wait(gate, DISPATCH_TIME_FOREVER);
+    });
+    id(^work)(void) = ^id{
+        uint64_t end = SPAsyncMonotonicNanoseconds() + 5000;
+        while(SPAsyncMonotonicNanoseconds() < end);
+        return nil;
+    };
+    NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count; i++) {
+        if(cooperative) {
+            [tasks addObject:[SPTask performWork:work onQueue:queue]];
+        } else {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            dispatch_async(queue, ^{
+                [source completeWithValue:work()];
+            });
+            [tasks addObject:source.task];
+        }
+    }
+    return tasks;
+}
+
+static void SPBenchmarkRegisterAll(void)
+{
+    gBenchmarks = [NSMutableArray new];
+    dispatch_queue_t inlineQueue = [SPTask inlineQueue];
+    dispatch_queue_t serialQueue = dispatch_queue_create("SPAsyncBenchmark.serial", DISPATCH_QUEUE_SERIAL);
+    dispatch_queue_t concurrentQueue = dispatch_get_global_queue(0, 0);
+
+    SPBenchmarkAdd(@"task.create", 1000000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger i = 0; i < operations; i++)
+            (void)[SPTaskCompletionSource new].task;
+    });
+
+    SPBenchmarkAdd(@"task.completed", 1000000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger i = 0; i < operations; i++)
+            (void)[SPTask completedTask:@(i)];
+    });
+
+    SPBenchmarkAdd(@"callback.register", 1000000, ^id(NSUInteger operations) {
+        return SPBenchmarkSources(operations);
+    }, ^(NSArray *sources, NSUInteger operations) {
+        for(SPTaskCompletionSource *source in sources)
+            [source.task addCallback:^(id value) {} on:inlineQueue];
+    });
+
+    // One task with many callbacks: per callback delivered.
+    const NSUInteger fanOut = 1000;
+    SPBenchmarkAdd(@"completion.fanout.inline", 1000000, ^id(NSUInteger operations) {
+        NSArray *sources = SPBenchmarkSources(MAX(operations / fanOut, 1u));
+        for(SPTaskCompletionSource *source in sources)
+            for(NSUInteger i = 0; i < fanOut; i++)
+                [source.task addCallback:^(id value) {} on:inlineQueue];
+        return sources;
+    }, ^(NSArray *sources, NSUInteger operations) {
+        for(SPTaskCompletionSource *source in sources)
+            [source completeWithValue:@1];
+    });
+    SPBenchmarkAdd(@"completion.fanout.queue", 1000000, ^id(NSUInteger operations) {
+        NSArray *sources = SPBenchmarkSources(MAX(operations / fanOut, 1u));
+        for(SPTaskCompletionSource *source in sources)
+            for(NSUInteger i = 0; i < fanOut; i++)
+                [source.task addCallback:^(id value) {} on:serialQueue];
+        return sources;
+    }, ^(NSArray *sources, NSUInteger operations) {
+        for(SPTaskCompletionSource *source in sources)
+            [source completeWithValue:@1];
+        dispatch_sync(serialQueue, ^{});
+    });
+
+    // Long then: chains, built and run: per link.
+    const NSUInteger depth = 1000;
+    SPBenchmarkAdd(@"chain.then.inline", 1000000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger chain = 0; chain < MAX(operations / depth, 1u); chain++) @autoreleasepool {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            SPTask *task = source.task;
+            for(NSUInteger i = 0; i < depth; i++)
+                task = [task then:^id(id value) { return value; } on:inlineQueue];
+            [source completeWithValue:@1];
+            SPBenchmarkWait(task);
+        }
+    });
+    SPBenchmarkAdd(@"chain.then.queue", 100000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger chain = 0; chain < MAX(operations / depth, 1u); chain++) @autoreleasepool {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            SPTask *task = source.task;
+            for(NSUInteger i = 0; i < depth; i++)
+                task = [task then:^id(id value) { return value; } on:serialQueue];
+            [source completeWithValue:@1];
+            SPBenchmarkWait(task);
+        }
+    });
+
+    // Recursive chain: per step.
+    SPBenchmarkAdd(@"chain.recursive", 100000, nil, ^(id context, NSUInteger operations) {
+        SPBenchmarkWait(SPBenchmarkRecursiveChain(operations, concurrentQueue));
+    });
+
+    // awaitAll: over many tasks, which complete after it's set up: per task.
+    SPBenchmarkAdd(@"awaitAll.fanin", 1000000, ^id(NSUInteger operations) {
+        return SPBenchmarkSources(operations);
+    }, ^(NSArray *sources, NSUInteger operations) {
+        NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:sources.count];
+        for(SPTaskCompletionSource *source in sources)
+            [tasks addObject:source.task];
+        SPTask *all = [SPTask awaitAll:tasks];
+        for(SPTaskCompletionSource *source in sources)
+            [source completeWithValue:@1];
+        SPBenchmarkWait(all);
+    });
+
+    // Cancelling a root with a wide tree of pending descendants: per descendant.
+    SPBenchmarkAdd(@"cancellation.storm", 1000000, ^id(NSUInteger operations) {
+        SPTaskCompletionSource *root = [SPTaskCompletionSource new];
+        NSMutableArray *descendants = [NSMutableArray arrayWithCapacity:operations];
+        for(NSUInteger i = 0; i < operations / 2; i++) {
+            SPTask *child = [root.task then:^id(id value) { return value; } on:serialQueue];
+            [descendants addObject:child];
+            [descendants addObject:[child then:^id(id value) { return value; } on:serialQueue]];
+        }
+        return @[root, descendants];
+    }, ^(NSArray *context, NSUInteger operations) {
+        [[context[0] task] cancel];
+    });
+
+    // Cancelling work queued behind a busy queue, and draining the queue: per task. The
+    // uncooperative one does what performWork:onQueue: used to, running the work regardless.
+    dispatch_queue_t gatedQueue = dispatch_queue_create("SPAsyncBenchmark.gated", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t gate = dispatch_semaphore_create(0);
+    for(NSNumber *cooperative in @[@YES, @NO]) {
+        NSString *name = cooperative.boolValue ? @"cancellation.queued" : @"cancellation.queued.uncooperative";
+        SPBenchmarkAdd(name, 10000, ^id(NSUInteger operations) {
+            return SPBenchmarkQueueWork(gatedQueue, gate, operations, cooperative.boolValue);
+        }, ^(NSArray *tasks, NSUInteger operations) {
+            [tasks makeObjectsPerformSelector:@selector(cancel)];
+            dispatch_semaphore_signal(gate);
+            dispatch_sync(gatedQueue, ^{});
+        });
+    }
+
+    // Cancelling a scope full of pending tasks that joined it as they were created: per task.
+    SPBenchmarkAdd(@"scope.cancel", 1000000, ^id(NSUInteger operations) {
+        SPTaskScope *scope = [SPTaskScope new];
+        NSMutableArray *sources = [NSMutableArray arrayWithCapacity:operations];
+        [scope run:^id{
+            for(NSUInteger i = 0; i < operations; i++)
+                [sources addObject:[SPTaskCompletionSource new]];
+            return nil;
+        }];
+        return @[scope, sources];
+    }, ^(NSArray *context, NSUInteger operations) {
+        [context[0] cancel];
+    });
+
+    // Grabbing an invocation, with and without capturing the stack it was grabbed on: per grab.
+    NSMutableArray *grabbed = [NSMutableArray new];
+    SPBenchmarkAdd(@"invocation.grab", 100000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger i = 0; i < operations; i++) @autoreleasepool {
+            (void)[(NSMutableArray*)[grabbed grab] count];
+        }
+    });
+    SPBenchmarkAdd(@"invocation.grab.nostacktrace", 100000, nil, ^(id context, NSUInteger operations) {
+        for(NSUInteger i = 0; i < operations; i++) @autoreleasepool {
+            (void)[(NSMutableArray*)[grabbed grabWithoutStacktrace] count];
+        }
+    });
+
+    // An async method awaiting tasks that are all still pending when it gets to them, each
+    // completed from a thread other than the main one, where it resumes: per await.
+    SPBenchmarkAdd(@"await.pending", 100000, ^id(NSUInteger operations) {
+        return @[[SPBenchmarkAwaiter new], SPBenchmarkSources(operations)];
+    }, ^(NSArray *context, NSUInteger operations) {
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        dispatch_async(concurrentQueue, ^{
+            SPTask *awaiting = [context[0] awaitEach:context[1]];
+            for(SPTaskCompletionSource *source in context[1])
+                [source completeWithValue:@1];
+            SPBenchmarkWait(awaiting);
+            dispatch_semaphore_signal(done);
+        });
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    });
+
+    // Messages to an agent, through the cached IMP path and through a mailbox: per message.
+    for(NSNumber *hasMailbox in @[@NO, @YES]) {
+        NSString *name = hasMailbox.boolValue ? @"agent.messages.mailbox" : @"agent.messages";
+        SPBenchmarkAdd(name, 1000000, ^id(NSUInteger operations) {
+            return [[SPBenchmarkAgent alloc] initWithMailbox:hasMailbox.boolValue];
+        }, ^(SPBenchmarkAgent *agent, NSUInteger operations) {
+            SPBenchmarkAgent *proxy = [agent sp_agentAsync];
+            for(NSUInteger i = 1; i < operations; i++) @autoreleasepool {
+                [proxy ping];
+            }
+            SPBenchmarkWait((SPTask *)[proxy pingCount]);
+        });
+    }
+}
+
+@implementation SPBenchmarkAwaiter
+- (dispatch_queue_t)workQueue
+{
+    return [SPTask inlineQueue];
+}
+
+- (SPTask *)awaitEach:(NSArray *)sources
+{
+    __block NSUInteger i;
+    SPAsyncMethodBegin
+    for(i = 0; i < sources.count; i++)
+        SPAsyncAwait([sources[i] task]);
+    return nil;
+    SPAsyncMethodEnd
+}
+@end
+
+@implementation SPBenchmarkAgent
+{
+    dispatch_queue_t _workQueue;
+    SPAgentMailbox *_mailbox;
+    NSUInteger _count;
+}
+
+- (instancetype)initWithMailbox:(BOOL)hasMailbox
+{
+    if(!(self = [super init]))
+        return nil;
+    _workQueue = dispatch_queue_create("SPAsyncBenchmark.agent", DISPATCH_QUEUE_SERIAL);
+    if(hasMailbox)
+        _mailbox = [[SPAgentMailbox alloc] initWithQueue:_workQueue capacity:1024 overflow:SPAgentMailboxOverflowBackpressure];
+    return self;
+}
+
+- (dispatch_queue_t)workQueue
+{
+    return _workQueue;
+}
+
+- (SPAgentMailbox*)mailbox
+{
+    return _mailbox;
+}
+
+- (void)ping
+{
+    _count++;
+}
+
+- (id)pingCount
+{
+    return @(_count);
+}
+@end
+
+#pragma mark Measuring
+
+typedef struct {
+    NSUInteger warmup;
+    NSUInteger repetitions;
+    double scale;
+    NSString *filter;
+    NSString *jsonPath;
+    NSString *baselinePath;
+    double tolerance;
+} SPBenchmarkOptions;
+
+/// Nearest-rank percentile of sorted 'samples'.
+static double SPBenchmarkPercentile(NSArray *samples, double percentile)
+{
+    NSUInteger rank = (NSUInteger)ceil(percentile / 100.0 * samples.count);
+    return [samples[rank > 0 ? rank - 1 : 0] doubleValue];
+}
+
+/// Times 'benchmark' and returns its statistics, all in nanoseconds per operation.
+static NSDictionary *SPBenchmarkRun(SPBenchmark *benchmark, SPBenchmarkOptions options)
+{
+    NSUInteger operations = MAX((NSUInteger)(benchmark.operations * options.scale), 1u);
+    NSMutableArray *samples = [NSMutableArray arrayWithCapacity:options.repetitions];
+    for(NSUInteger i = 0; i < options.warmup + options.repetitions; i++) @autoreleasepool {
+        id context = benchmark.setup ? benchmark.setup(operations) : nil;
+        uint64_t start = SPAsyncMonotonicNanoseconds();
+        benchmark.body(context, operations);
+        uint64_t elapsed = SPAsyncMonotonicNanoseconds() - start;
+        if(i >= options.warmup)
+            [samples addObject:@((double)elapsed / operations)];
+        context = nil; // torn down outside of the timing, too
+    }
+
+    [samples sortUsingSelector:@selector(compare:)];
+    double sum = 0;
+    for(NSNumber *sample in samples)
+        sum += sample.doubleValue;
+    return @{
+        @"name": benchmark.name,
+        @"operations": @(operations),
+        @"repetitions": @(samples.count),
+        @"min": samples.firstObject,
+        @"mean": @(sum / samples.count),
+        @"p50": @(SPBenchmarkPercentile(samples, 50)),
+        @"p90": @(SPBenchmarkPercentile(samples, 90)),
+        @"p99": @(SPBenchmarkPercentile(samples, 99)),
+        @"max": samples.lastObject,
+    };
+}
+
+/// Compares medians with a previous run's; returns the names of the benchmarks that got slower
+/// by more than 'tolerance'.
+static NSArray *SPBenchmarkRegressions(NSArray *results, NSDictionary *baseline, double tolerance)
+{
+    NSMutableDictionary *previous = [NSMutableDictionary new];
+    for(NSDictionary *result in baseline[@"benchmarks"])
+        previous[result[@"name"]] = result;
+
+    NSMutableArray *regressions = [NSMutableArray new];
+    for(NSDictionary *result in results) {
+        NSDictionary *before = previous[result[@"name"]];
+        if(!before)
+            continue;
+        double ratio = [result[@"p50"] doubleValue] / [before[@"p50"] doubleValue];
+        if(ratio > 1 + tolerance) {
+            fprintf(stderr, "REGRESSION %s: p50 %.1f ns/op, was %.1f (%+.0f%%)\n", [result[@"name"] UTF8String], [result[@"p50"] doubleValue], [before[@"p50"] doubleValue], (ratio - 1) * 100);
+            [regressions addObject:result[@"name"]];
+        }
+    }
+    return regressions;
+}
+
+static void SPBenchmarkUsage(void)
+{
+    fprintf(stderr,
+        "usage: SPAsyncBenchmark [options]\n"
+        "  --warmup N          untimed repetitions before measuring (default 3)\n"
+        "  --repetitions N     timed repetitions (default 20)\n"
+        "  --scale X           multiply every benchmark's operation count by X (default 1)\n"
+        "  --quick             --warmup 1 --repetitions 3 --scale 0.01, for smoke testing\n"
+        "  --filter TEXT       only run benchmarks whose name contains TEXT\n"
+        "  --json PATH         write results as JSON to PATH, or to stdout for -\n"
+        "  --baseline PATH     compare with the JSON of an earlier run, and exit with 2 if any\n"
+        "                      median got slower by more than the tolerance\n"
+        "  --tolerance X       allowed slowdown for --baseline, as a fraction (default 0.1)\n");
+}
+
+static BOOL SPBenchmarkParseOptions(int argc, const char *argv[], SPBenchmarkOptions *options)
+{
+    *options = (SPBenchmarkOptions){ .warmup = 3, .repetitions = 20, .scale = 1, .tolerance = 0.1 };
+    for(int i = 1; i < argc; i++) {
+        NSString *option = @(argv[i]);
+        if([option isEqual:@"--quick"]) {
+            options->warmup = 1;
+            options->repetitions = 3;
+            options->scale = 0.01;
+            continue;
+        }
+        if(i + 1 >= argc)
+            return NO;
+        NSString *value = @(argv[++i]);
+        if([option isEqual:@"--warmup"])
+            options->warmup = (NSUInteger)value.integerValue;
+        else if([option isEqual:@"--repetitions"])
+            options->repetitions = (NSUInteger)value.integerValue;
+        else if([option isEqual:@"--scale"])
+            options->scale = value.doubleValue;
+        else if([option isEqual:@"--filter"])
+            options->filter = value;
+        else if([option isEqual:@"--json"])
+            options->jsonPath = value;
+        else if([option isEqual:@"--baseline"])
+            options->baselinePath = value;
+        else if([option isEqual:@"--tolerance"])
+            options->tolerance = value.doubleValue;
+        else
+            return NO;
+    }
+    return options->repetitions > 0 && options->scale > 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        SPBenchmarkOptions options;
+        if(!SPBenchmarkParseOptions(argc, argv, &options)) {
+            SPBenchmarkUsage();
+            return 1;
+        }
+
+        NSDictionary *baseline = nil;
+        if(options.baselinePath) {
+            NSData *data = [NSData dataWithContentsOfFile:options.baselinePath];
+            baseline = data ? [NSJSONSerialization JSONObjectWithData:data options:0 error:NULL] : nil;
+            if(![baseline isKindOfClass:[NSDictionary class]]) {
+                fprintf(stderr, "Can't read baseline %s\n", options.baselinePath.UTF8String);
+                return 1;
+            }
+        }
+
+        SPBenchmarkRegisterAll();
+        NSMutableArray *results = [NSMutableArray new];
+        FILE *report = [options.jsonPath isEqual:@"-"] ? stderr : stdout;
+        fprintf(report, "%-28s %12s %10s %10s %10s %10s %10s\n", "benchmark", "ops", "min", "p50", "p90", "p99", "max");
+        for(SPBenchmark *benchmark in gBenchmarks) {
+            if(options.filter && [benchmark.name rangeOfString:options.filter].location == NSNotFound)
+                continue;
+            NSDictionary *result = SPBenchmarkRun(benchmark, options);
+            [results addObject:result];
+            fprintf(report, "%-28s %12lu %10.1f %10.1f %10.1f %10.1f %10.1f  ns/op\n", benchmark.name.UTF8String, (unsigned long)[result[@"operations"] unsignedIntegerValue], [result[@"min"] doubleValue], [result[@"p50"] doubleValue], [result[@"p90"] doubleValue], [result[@"p99"] doubleValue], [result[@"max"] doubleValue]);
+        }
+
+        if(options.jsonPath) {
+            NSDictionary *document = @{
+                @"version": @1,
+                @"unit": @"ns/op",
+                @"warmup": @(options.warmup),
+                @"scale": @(options.scale),
+                @"benchmarks": results,
+            };
+            NSData *json = [NSJSONSerialization dataWithJSONObject:document options:NSJSONWritingPrettyPrinted error:NULL];
+            if([options.jsonPath isEqual:@"-"]) {
+                fwrite(json.bytes, 1, json.length, stdout);
+                fputc('\n', stdout);
+            } else if(![json writeToFile:options.jsonPath atomically:YES]) {
+                fprintf(stderr, "Can't write %s\n", options.jsonPath.UTF8String);
+                return 1;
+            }
+        }
+
+        if(baseline && SPBenchmarkRegressions(results, baseline, options.tolerance).count)
+            return 2;
+    }
+    return 0;
+}
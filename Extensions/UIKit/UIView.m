@@ -6,7 +6,7 @@
 {
     SPTaskCompletionSource *source = [SPTaskCompletionSource new];
     [self animateWithDuration:duration delay:delay options:options animations:animations completion:^(BOOL finished) {
-        [source completeWithValue:@(finished)];
+        [source completeWithBool:finished];
     }];
     return source.task;
 }
@@ -15,7 +15,7 @@
 {
     SPTaskCompletionSource *source = [SPTaskCompletionSource new];
     [self animateWithDuration:duration animations:animations completion:^(BOOL finished) {
-        [source completeWithValue:@(finished)];
+        [source completeWithBool:finished];
     }];
     return source.task;
 
@@ -25,7 +25,7 @@
 {
     SPTaskCompletionSource *source = [SPTaskCompletionSource new];
     [self animateWithDuration:duration delay:delay usingSpringWithDamping:dampingRatio initialSpringVelocity:velocity options:options animations:animations completion:^(BOOL finished) {
-        [source completeWithValue:@(finished)];
+        [source completeWithBool:finished];
     }];
     return source.task;
 }
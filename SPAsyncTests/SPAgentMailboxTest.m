@@ -0,0 +1,245 @@
+//
+//  SPAgentMailboxTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPAgent.h>
+#import <SPAsync/SPAgentMailbox.h>
+#import <SPAsync/SPTask.h>
+#import "SPTaskTest.h"
+
+@interface SPAgentMailboxTest : XCTestCase
+@end
+
+@interface MailboxTestAgent : NSObject <SPAgent>
+@property(nonatomic,readonly) SPAgentMailbox *mailbox;
+@property(nonatomic,readonly) int pokes;
+- (id)leet;
+- (void)poke;
+@end
+
+@implementation SPAgentMailboxTest
+{
+    dispatch_queue_t _queue;
+    dispatch_semaphore_t _gate;
+}
+
+- (void)setUp
+{
+    [super setUp];
+    _queue = dispatch_queue_create("SPAgentMailboxTest", DISPATCH_QUEUE_SERIAL);
+    _gate = dispatch_semaphore_create(0);
+}
+
+/// Keeps the mailbox's queue busy until -open, so that messages pile up.
+- (void)hold
+{
+    dispatch_semaphore_t gate = _gate;
+    dispatch_async(_queue, ^{
+        dispatch_semaphore_wait(gate, DISPATCH_TIME_FOREVER);
+    });
+}
+
+- (void)open
+{
+    dispatch_semaphore_signal(_gate);
+}
+
+- (void)testHigherPrioritiesRunFirst
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:10 overflow:SPAgentMailboxOverflowReject];
+    NSMutableArray *order = [NSMutableArray new];
+    [self hold];
+    [mailbox send:^id{ [order addObject:@"low"]; return nil; } priority:SPAgentPriorityLow selector:NULL];
+    [mailbox send:^id{ [order addObject:@"normal"]; return nil; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *last = [mailbox send:^id{ [order addObject:@"high"]; return nil; } priority:SPAgentPriorityHigh selector:NULL];
+    XCTAssertEqual(mailbox.depth, 3u);
+    XCTAssertEqual([mailbox depthForPriority:SPAgentPriorityHigh], 1u);
+    [self open];
+
+    SPTestSpinRunloopWithCondition(mailbox.processedCount == 3, 1.0);
+    XCTAssertTrue(last.completed);
+    XCTAssertEqualObjects(order, (@[@"high", @"normal", @"low"]));
+    XCTAssertEqual(mailbox.depth, 0u);
+}
+
+- (void)testRejectsWhenFull
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:2 overflow:SPAgentMailboxOverflowReject];
+    [self hold];
+    SPTask *first = [mailbox send:^id{ return @1; } priority:SPAgentPriorityNormal selector:NULL];
+    [mailbox send:^id{ return @2; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *rejected = [mailbox send:^id{ return @3; } priority:SPAgentPriorityNormal selector:NULL];
+    [self open];
+
+    SPAssertTaskFailsWithErrorAndTimeout(rejected, [NSError errorWithDomain:SPAgentErrorDomain code:SPAgentErrorMailboxFull userInfo:@{NSLocalizedDescriptionKey: @"The agent's mailbox is full."}], 0.1);
+    SPAssertTaskCompletesWithValueAndTimeout(first, @1, 1.0);
+    XCTAssertEqual(mailbox.rejectedCount, 1u);
+}
+
+- (void)testDropsOldestWhenFull
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:2 overflow:SPAgentMailboxOverflowDropOldest];
+    [self hold];
+    SPTask *first = [mailbox send:^id{ return @1; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *second = [mailbox send:^id{ return @2; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *third = [mailbox send:^id{ return @3; } priority:SPAgentPriorityNormal selector:NULL];
+    [self open];
+
+    __block NSError *dropped = nil;
+    [first addErrorCallback:^(NSError *error) { dropped = error; } on:dispatch_get_main_queue()];
+    SPTestSpinRunloopWithCondition(dropped != nil, 1.0);
+    XCTAssertEqual(dropped.code, SPAgentErrorMessageDropped);
+    SPAssertTaskCompletesWithValueAndTimeout(second, @2, 1.0);
+    SPAssertTaskCompletesWithValueAndTimeout(third, @3, 1.0);
+    XCTAssertEqual(mailbox.droppedCount, 1u);
+}
+
+- (void)testBackpressureHoldsMessagesBack
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:1 overflow:SPAgentMailboxOverflowBackpressure];
+    NSMutableArray *order = [NSMutableArray new];
+    [self hold];
+    for(int i = 0; i < 3; i++)
+        [mailbox send:^id{ [order addObject:@(i)]; return nil; } priority:SPAgentPriorityNormal selector:NULL];
+    XCTAssertEqual(mailbox.depth, 1u);
+    XCTAssertEqual(mailbox.waitingCount, 2u);
+    [self open];
+
+    SPTestSpinRunloopWithCondition(mailbox.processedCount == 3, 1.0);
+    XCTAssertEqualObjects(order, (@[@0, @1, @2]));
+    XCTAssertEqual(mailbox.waitingCount, 0u);
+}
+
+- (void)testBackpressureRejectsBeyondACapacityOfWaiting
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:1 overflow:SPAgentMailboxOverflowBackpressure];
+    [self hold];
+    [mailbox send:^id{ return @1; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *waiting = [mailbox send:^id{ return @2; } priority:SPAgentPriorityNormal selector:NULL];
+    SPTask *rejected = [mailbox send:^id{ return @3; } priority:SPAgentPriorityNormal selector:NULL];
+    XCTAssertEqual(mailbox.waitingCount, 1u);
+    [self open];
+
+    SPAssertTaskFailsWithErrorAndTimeout(rejected, [NSError errorWithDomain:SPAgentErrorDomain code:SPAgentErrorMailboxFull userInfo:@{NSLocalizedDescriptionKey: @"The agent's mailbox is full."}], 0.1);
+    SPAssertTaskCompletesWithValueAndTimeout(waiting, @2, 1.0);
+    XCTAssertEqual(mailbox.rejectedCount, 1u);
+}
+
+- (void)testCoalescesPendingMessages
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:10 overflow:SPAgentMailboxOverflowReject];
+    [mailbox coalesceSelector:@selector(leet)];
+    __block int runs = 0;
+    [self hold];
+    SPTask *first = [mailbox send:^id{ runs++; return @1; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    SPTask *second = [mailbox send:^id{ runs++; return @2; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    SPTask *other = [mailbox send:^id{ return @3; } priority:SPAgentPriorityNormal selector:@selector(description)];
+    XCTAssertNotEqual(first, second, @"Each sender should get a task of its own");
+    XCTAssertEqual(mailbox.depth, 2u);
+    [self open];
+
+    SPAssertTaskCompletesWithValueAndTimeout(first, @2, 1.0);
+    SPAssertTaskCompletesWithValueAndTimeout(second, @2, 1.0);
+    SPAssertTaskCompletesWithValueAndTimeout(other, @3, 1.0);
+    XCTAssertEqual(runs, 1);
+    XCTAssertEqual(mailbox.coalescedCount, 1u);
+}
+
+- (void)testCoalescedMessageRunsUntilAllItsSendersCancel
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:10 overflow:SPAgentMailboxOverflowReject];
+    [mailbox coalesceSelector:@selector(leet)];
+    __block int runs = 0;
+    [self hold];
+    SPTask *first = [mailbox send:^id{ runs++; return @1; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    SPTask *second = [mailbox send:^id{ runs++; return @2; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    [first cancel];
+    SPTask *third = [mailbox send:^id{ runs++; return @3; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    XCTAssertEqual(mailbox.depth, 1u, @"The third should still have joined the first two");
+    [self open];
+
+    SPAssertTaskCompletesWithValueAndTimeout(second, @3, 1.0);
+    SPAssertTaskCompletesWithValueAndTimeout(third, @3, 1.0);
+    XCTAssertTrue(first.cancelled);
+    XCTAssertEqual(runs, 1);
+
+    __block BOOL ran = NO;
+    [self hold];
+    SPTask *again = [mailbox send:^id{ ran = YES; return nil; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    SPTask *andAgain = [mailbox send:^id{ ran = YES; return nil; } priority:SPAgentPriorityNormal selector:@selector(leet)];
+    [again cancel];
+    [andAgain cancel];
+    [self open];
+
+    SPTestSpinRunloopWithCondition(mailbox.processedCount == 2, 1.0);
+    XCTAssertFalse(ran);
+}
+
+- (void)testSkipsCancelledMessages
+{
+    SPAgentMailbox *mailbox = [[SPAgentMailbox alloc] initWithQueue:_queue capacity:10 overflow:SPAgentMailboxOverflowReject];
+    __block BOOL ran = NO;
+    [self hold];
+    SPTask *cancelled = [mailbox send:^id{ ran = YES; return nil; } priority:SPAgentPriorityNormal selector:NULL];
+    [cancelled cancel];
+    [self open];
+
+    SPTestSpinRunloopWithCondition(mailbox.processedCount == 1, 1.0);
+    XCTAssertFalse(ran);
+}
+
+- (void)testAgentMessagesGoThroughMailbox
+{
+    MailboxTestAgent *agent = [MailboxTestAgent new];
+    SPAssertTaskCompletesWithValueAndTimeout([[agent sp_agentAsyncWithPriority:SPAgentPriorityHigh] leet], @1337, 1.0);
+    SPAssertTaskCompletesWithValueAndTimeout([agent sp_agentPerform:^id(MailboxTestAgent *agent) { return [agent leet]; }], @1337, 1.0);
+    // A message is counted once its task has been completed, so that may take a moment longer.
+    SPTestSpinRunloopWithCondition(agent.mailbox.processedCount == 2, 1.0);
+    XCTAssertEqual(agent.mailbox.processedCount, 2u);
+}
+
+- (void)testVoidAgentMessagesHaveATask
+{
+    MailboxTestAgent *agent = [MailboxTestAgent new];
+    MailboxTestAgent *proxy = [agent sp_agentAsync];
+    [proxy poke];
+    SPTask *sent = [proxy sp_agentLastTask];
+    XCTAssertNotNil(sent);
+    SPAssertTaskCompletesWithValueAndTimeout(sent, nil, 1.0);
+    XCTAssertEqual(agent.pokes, 1);
+    XCTAssertNil([agent sp_agentLastTask]);
+}
+
+@end
+
+@implementation MailboxTestAgent
+{
+    dispatch_queue_t _workQueue;
+}
+
+- (id)init
+{
+    if(!(self = [super init]))
+        return nil;
+    _workQueue = dispatch_queue_create("SPAsync.mailboxtestqueue", DISPATCH_QUEUE_SERIAL);
+    _mailbox = [[SPAgentMailbox alloc] initWithQueue:_workQueue capacity:16 overflow:SPAgentMailboxOverflowBackpressure];
+    return self;
+}
+
+- (dispatch_queue_t)workQueue
+{
+    return _workQueue;
+}
+
+- (id)leet
+{
+    return @1337;
+}
+
+- (void)poke
+{
+    _pokes++;
+}
+@end
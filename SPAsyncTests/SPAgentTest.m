@@ -13,6 +13,10 @@
 
 @interface TestAgent : NSObject <SPAgent>
 - (id)leet;
+- (id)join:(NSString*)a with:(NSString*)b;
+- (void)record:(id)value;
+- (id)recorded;
+- (id)scaled:(NSInteger)factor;
 @end
 
 @implementation SPAgentTest
@@ -33,11 +37,80 @@
     XCTAssertEqual(gotLeet, YES, @"Expected to have gotten leet by now");
 }
 
+- (void)testAgentAsyncWithObjectArguments
+{
+    TestAgent *agent = [TestAgent new];
+    SPTask *joined = [[agent sp_agentAsync] join:@"a" with:@"b"];
+    SPAssertTaskCompletesWithValueAndTimeout(joined, @"ab", 1.0);
+}
+
+- (void)testAgentAsyncVoidMethodsRunInOrder
+{
+    TestAgent *agent = [TestAgent new];
+    for(int i = 0; i < 10; i++)
+        [[agent sp_agentAsync] record:@(i)];
+    SPAssertTaskCompletesWithValueAndTimeout([[agent sp_agentAsync] recorded], (@[@0, @1, @2, @3, @4, @5, @6, @7, @8, @9]), 1.0);
+}
+
+- (void)testAgentAsyncScalarArgumentsGoThroughForwarding
+{
+    TestAgent *agent = [TestAgent new];
+    SPTask *scaled = [[agent sp_agentAsync] scaled:3];
+    SPAssertTaskCompletesWithValueAndTimeout(scaled, @(1337*3), 1.0);
+}
+
+- (void)testAgentPerform
+{
+    TestAgent *agent = [TestAgent new];
+    SPTask *performed = [agent sp_agentPerform:^id(TestAgent *agent) {
+        return [agent leet];
+    }];
+    SPAssertTaskCompletesWithValueAndTimeout(performed, @1337, 1.0);
+}
+
+- (void)measureAgentCalls:(SPTask*(^)(TestAgent *agent))call
+{
+    TestAgent *agent = [TestAgent new];
+    [self measureBlock:^{
+        SPTask *last;
+        for(int i = 0; i < 100000; i++) {
+            @autoreleasepool {
+                last = call(agent);
+            }
+        }
+        SPAssertTaskCompletesWithValueAndTimeout(last, @1337, 10.0);
+    }];
+}
+
+- (void)testPerformanceAgentAsync
+{
+    [self measureAgentCalls:^SPTask *(TestAgent *agent) {
+        return [[agent sp_agentAsync] leet];
+    }];
+}
+
+- (void)testPerformanceAgentAsyncThroughForwarding
+{
+    [self measureAgentCalls:^SPTask *(TestAgent *agent) {
+        return [[agent sp_agentAsync] scaled:1];
+    }];
+}
+
+- (void)testPerformanceAgentPerform
+{
+    [self measureAgentCalls:^SPTask *(TestAgent *agent) {
+        return [agent sp_agentPerform:^id(TestAgent *agent) {
+            return [agent leet];
+        }];
+    }];
+}
+
 @end
 
 @implementation TestAgent
 {
     dispatch_queue_t _workQueue;
+    NSMutableArray *_recorded;
 }
 - (id)init
 {
@@ -45,6 +118,7 @@
         return nil;
     
     _workQueue = dispatch_queue_create("SPAsync.testworkqueue", DISPATCH_QUEUE_SERIAL);
+    _recorded = [NSMutableArray new];
     
     return self;
 }
@@ -68,4 +142,24 @@
 
     return @(1337);
 }
+
+- (id)join:(NSString*)a with:(NSString*)b
+{
+    return [a stringByAppendingString:b];
+}
+
+- (void)record:(id)value
+{
+    [_recorded addObject:value];
+}
+
+- (id)recorded
+{
+    return [_recorded copy];
+}
+
+- (id)scaled:(NSInteger)factor
+{
+    return @(1337 * factor);
+}
 @end
\ No newline at end of file
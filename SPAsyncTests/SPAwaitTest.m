@@ -84,4 +84,102 @@
     SPAssertTaskCompletesWithValueAndTimeout([self voidMethod], nil, 0.1);
 }
 
+- (SPTask*)awaitCompleted
+{
+    __block NSNumber *number;
+    SPAsyncMethodBegin
+    number = SPAsyncAwait([SPTask completedTask:@21]);
+    return @([number intValue]*2);
+    SPAsyncMethodEnd
+}
+- (void)testAwaitingCompletedTaskDoesNotSuspend
+{
+    SPTask *task = [self awaitCompleted];
+    XCTAssertTrue(task.completed, @"Nothing should have needed to wait");
+    SPAssertTaskCompletesWithValueAndTimeout(task, @42, 0.1);
+}
+
+- (SPTask*)awaitFailure:(SPTask*)failing reached:(BOOL*)reached
+{
+    __block NSNumber *number;
+    SPAsyncMethodBegin
+    number = SPAsyncAwait(failing);
+    *reached = YES;
+    return number;
+    SPAsyncMethodEnd
+}
+- (void)testAwaitedFailureFailsMethod
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    BOOL reached = NO;
+    SPTask *task = [self awaitFailure:source.task reached:&reached];
+    [source failWithError:error];
+    SPAssertTaskFailsWithErrorAndTimeout(task, error, 0.1);
+    XCTAssertFalse(reached, @"The method should have stopped at the failed await");
+}
+- (void)testAwaitedFailureOfCompletedTaskFailsMethod
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    BOOL reached = NO;
+    SPTask *task = [self awaitFailure:[SPTask failedTask:error] reached:&reached];
+    XCTAssertTrue(task.completed);
+    SPAssertTaskFailsWithErrorAndTimeout(task, error, 0.1);
+    XCTAssertFalse(reached, @"The method should have stopped at the failed await");
+}
+
+- (SPTask*)resumeThread
+{
+    SPAsyncMethodBegin
+    (void)SPAsyncAwait([self awaitableNumber:@1]);
+    return @([NSThread isMainThread]);
+    SPAsyncMethodEnd
+}
+- (void)testResumesOnMainQueueWhenStartedOnMainThread
+{
+    SPAssertTaskCompletesWithValueAndTimeout([self resumeThread], @YES, 0.1);
+}
+
+- (SPTask*)sumOfCompleted:(NSArray*)tasks
+{
+    __block NSInteger sum, i;
+    __block NSNumber *value;
+    SPAsyncMethodBegin
+    sum = 0;
+    for(i = 0; i < (NSInteger)tasks.count; i++) {
+        value = SPAsyncAwait(tasks[i]);
+        sum += [value integerValue];
+    }
+    return @(sum);
+    SPAsyncMethodEnd
+}
+- (NSArray*)completedTasks
+{
+    NSMutableArray *tasks = [NSMutableArray new];
+    for(int i = 0; i < 100000; i++)
+        [tasks addObject:[SPTask completedTask:@1]];
+    return tasks;
+}
+- (void)testPerformanceAwaitCompletedTasks
+{
+    NSArray *tasks = [self completedTasks];
+    [self measureBlock:^{
+        SPAssertTaskCompletesWithValueAndTimeout([self sumOfCompleted:tasks], @100000, 10.0);
+    }];
+}
+- (void)testPerformanceStraightLineBaseline
+{
+    // What testPerformanceAwaitCompletedTasks would cost without await.
+    NSArray *tasks = [self completedTasks];
+    [self measureBlock:^{
+        NSInteger sum = 0;
+        for(SPTask *task in tasks) {
+            id value;
+            [task getCompletedValue:&value error:NULL];
+            sum += [value integerValue];
+        }
+        XCTAssertEqual(sum, 100000);
+    }];
+}
+
 @end
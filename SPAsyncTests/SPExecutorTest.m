@@ -0,0 +1,111 @@
+//
+//  SPExecutorTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPTask.h>
+#import <SPAsync/SPExecutor.h>
+#import "SPTaskTest.h"
+#include <pthread.h>
+
+@interface SPExecutorTest : XCTestCase
+@end
+
+@implementation SPExecutorTest
+
+- (void)testDispatchExecutor
+{
+    SPDispatchExecutor *executor = [SPDispatchExecutor executorWithQueue:dispatch_get_main_queue()];
+    __block BOOL onMain = NO;
+    [[SPTask completedTask:@1] addCallback:^(id value) {
+        onMain = [NSThread isMainThread];
+    } onExecutor:executor];
+    SPTestSpinRunloopWithCondition(onMain, 1.0);
+    XCTAssertTrue(onMain, @"Callback should have run on the adapted queue");
+}
+
+- (void)testThreadPoolRunsWork
+{
+    SPTask *task = [[SPTask performWork:^id{
+        return @1;
+    } onExecutor:[SPThreadPool sharedPool]] then:^id(NSNumber *value) {
+        return @([value intValue] + 1);
+    } onExecutor:[SPThreadPool sharedPool]];
+    SPAssertTaskCompletesWithValueAndTimeout(task, @2, 1.0);
+}
+
+- (void)testThreadPoolRunsCancellableWork
+{
+    SPTask *task = [SPTask fetchCancellableWork:^SPTask *(id<SPCancellationToken> token) {
+        return [SPTask performCancellableWork:^id(id<SPCancellationToken> innerToken) {
+            return @(token.cancelled || innerToken.cancelled ? 0 : 1);
+        } onExecutor:[SPThreadPool sharedPool]];
+    } onExecutor:[SPThreadPool sharedPool]];
+    SPAssertTaskCompletesWithValueAndTimeout(task, @1, 1.0);
+}
+
+- (void)testThreadPoolRunsEverything
+{
+    SPThreadPool *pool = [[SPThreadPool alloc] initWithThreadCount:4];
+    dispatch_group_t group = dispatch_group_create();
+    for(int i = 0; i < 10000; i++) {
+        dispatch_group_enter(group);
+        [pool execute:^{
+            dispatch_group_leave(group);
+        }];
+    }
+    XCTAssertEqual(dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0L, @"Every block should have run");
+}
+
+- (void)testWorkScheduledFromWorkerStaysOnWorker
+{
+    SPThreadPool *pool = [[SPThreadPool alloc] initWithThreadCount:4];
+    __block pthread_t scheduler, scheduled;
+    __block BOOL done = NO;
+    [pool execute:^{
+        scheduler = pthread_self();
+        [pool execute:^{
+            scheduled = pthread_self();
+            done = YES;
+        }];
+    }];
+    SPTestSpinRunloopWithCondition(done, 1.0);
+    XCTAssertTrue(done);
+    XCTAssertTrue(pthread_equal(scheduler, scheduled), @"Work scheduled from a worker should run next on that worker");
+}
+
+- (SPTask*)fib:(int)n on:(id<SPExecutor>)executor
+{
+    if(n < 2)
+        return [SPTask completedTask:@(n)];
+    return [SPTask fetchWork:^SPTask *{
+        return [[SPTask awaitAll:@[[self fib:n - 1 on:executor], [self fib:n - 2 on:executor]]] then:^id(NSArray *values) {
+            return @([values[0] intValue] + [values[1] intValue]);
+        } onExecutor:executor];
+    } onExecutor:executor];
+}
+
+- (void)measureForkJoinOn:(id<SPExecutor>)executor
+{
+    [self measureBlock:^{
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [[self fib:20 on:executor] addCallback:^(NSNumber *value) {
+            XCTAssertEqualObjects(value, @6765);
+            dispatch_semaphore_signal(done);
+        } on:dispatch_get_global_queue(0, 0)];
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    }];
+}
+
+- (void)testPerformanceForkJoinThreadPool
+{
+    [self measureForkJoinOn:[SPThreadPool sharedPool]];
+}
+
+- (void)testPerformanceForkJoinGlobalQueue
+{
+    [self measureForkJoinOn:[SPDispatchExecutor executorWithQueue:dispatch_get_global_queue(0, 0)]];
+}
+
+@end
@@ -0,0 +1,24 @@
+//
+//  SPInvocationGrabbingTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/NSObject+SPInvocationGrabbing.h>
+
+@interface SPInvocationGrabbingTest : XCTestCase
+@end
+
+@implementation SPInvocationGrabbingTest
+
+- (void)testGrabbedInvocationIsInvokedLater
+{
+    NSMutableArray *array = [NSMutableArray new];
+    SPInvocationGrabber *grabber = [array grab];
+    [(NSMutableArray*)grabber addObject:@1];
+    XCTAssertEqual(array.count, 0u);
+    [grabber invoke];
+    XCTAssertEqualObjects(array, @[@1]);
+}
+
+@end
@@ -0,0 +1,198 @@
+//
+//  SPStreamTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPStream.h>
+#import "SPTaskTest.h"
+
+@interface SPStreamTest : XCTestCase
+@end
+
+@interface SPStreamTestObject : NSObject
+@property(nonatomic) NSInteger progress;
+@end
+@implementation SPStreamTestObject
+@end
+
+@implementation SPStreamTest
+
+- (void)testDeliversValuesInOrderThenFinishes
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    __block BOOL finished = NO;
+    [source.stream subscribe:^(id value) {
+        [received addObject:value];
+    } finished:^(NSError *error) {
+        XCTAssertNil(error);
+        finished = YES;
+    } on:dispatch_get_main_queue()];
+
+    [source send:@1];
+    [source send:@2];
+    [source finish];
+    SPTestSpinRunloopWithCondition(finished, 1.0);
+    XCTAssertEqualObjects(received, (@[@1, @2]));
+}
+
+- (void)testMapAndFilter
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    __block BOOL finished = NO;
+    [[[source.stream filter:^BOOL(NSNumber *value) {
+        return [value intValue] % 2 == 0;
+    }] map:^id(NSNumber *value) {
+        return @([value intValue] * 10);
+    }] subscribe:^(id value) {
+        [received addObject:value];
+    } finished:^(NSError *error) {
+        finished = YES;
+    } on:dispatch_get_main_queue()];
+
+    for(int i = 1; i <= 6; i++)
+        [source send:@(i)];
+    [source finish];
+    SPTestSpinRunloopWithCondition(finished, 1.0);
+    XCTAssertEqualObjects(received, (@[@20, @40, @60]));
+}
+
+- (void)testBuffer
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    __block BOOL finished = NO;
+    [[source.stream buffer:2] subscribe:^(id value) {
+        [received addObject:value];
+    } finished:^(NSError *error) {
+        finished = YES;
+    } on:dispatch_get_main_queue()];
+
+    for(int i = 1; i <= 5; i++)
+        [source send:@(i)];
+    [source finish];
+    SPTestSpinRunloopWithCondition(finished, 1.0);
+    XCTAssertEqualObjects(received, (@[@[@1, @2], @[@3, @4], @[@5]]));
+}
+
+- (void)testManualDemandAndOverflow
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    SPStreamSubscription *subscription = [source.stream subscribe:^(id value) {
+        [received addObject:value];
+    } finished:nil on:dispatch_get_main_queue() bufferLimit:3 overflow:SPStreamOverflowDropOldest manualDemand:YES];
+
+    XCTAssertEqual(source.demand, 3u);
+    for(int i = 1; i <= 5; i++)
+        [source send:@(i)];
+    XCTAssertEqual(source.demand, 0u, @"The subscriber's buffer should be full");
+    XCTAssertEqual(subscription.droppedCount, 2u);
+
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    XCTAssertEqual(received.count, 0u, @"Nothing should be delivered before it's asked for");
+
+    [subscription request:2];
+    SPTestSpinRunloopWithCondition(received.count == 2, 1.0);
+    XCTAssertEqualObjects(received, (@[@3, @4]));
+    [subscription request:10];
+    SPTestSpinRunloopWithCondition(received.count == 3, 1.0);
+    XCTAssertEqualObjects(received, (@[@3, @4, @5]));
+}
+
+- (void)testCancelStopsDelivery
+{
+    SPStreamSource *source = [SPStreamSource new];
+    __block int received = 0;
+    SPStreamSubscription *subscription = [source.stream subscribe:^(id value) {
+        received++;
+    } on:dispatch_get_main_queue()];
+    [source send:@1];
+    [subscription cancel];
+    [source send:@2];
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    XCTAssertEqual(received, 0);
+    XCTAssertEqual(source.demand, 0u, @"Nobody should be subscribed anymore");
+}
+
+- (void)testDebounce
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    [[source.stream debounce:0.05] subscribe:^(id value) {
+        [received addObject:value];
+    } on:dispatch_get_main_queue()];
+
+    for(int i = 1; i <= 10; i++)
+        [source send:@(i)];
+    SPTestSpinRunloopWithCondition(received.count > 0, 1.0);
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssertEqualObjects(received, (@[@10]));
+}
+
+- (void)testThrottle
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    [[source.stream throttle:0.05] subscribe:^(id value) {
+        [received addObject:value];
+    } on:dispatch_get_main_queue()];
+
+    for(int i = 1; i <= 10; i++)
+        [source send:@(i)];
+    SPTestSpinRunloopWithCondition(received.count == 2, 1.0);
+    XCTAssertEqualObjects(received, (@[@1, @10]), @"The first value, and then the latest one once the interval is up");
+}
+
+- (void)testCoalesce
+{
+    SPStreamSource *source = [SPStreamSource new];
+    NSMutableArray *received = [NSMutableArray new];
+    [[source.stream coalesceOn:dispatch_get_main_queue()] subscribe:^(id value) {
+        [received addObject:value];
+    } on:dispatch_get_main_queue()];
+
+    for(int i = 1; i <= 1000; i++)
+        [source send:@(i)];
+    SPTestSpinRunloopWithCondition(received.count > 0, 1.0);
+    XCTAssertEqualObjects(received, (@[@1000]), @"A burst should come out as its latest value");
+}
+
+- (void)testKVOStreamCoalescesBursts
+{
+    SPStreamTestObject *object = [SPStreamTestObject new];
+    SPStream *stream = [SPStream streamWithKeyPath:@"progress" ofObject:object on:dispatch_get_main_queue()];
+    NSMutableArray *received = [NSMutableArray new];
+    [stream subscribe:^(id value) {
+        [received addObject:value];
+    } on:dispatch_get_main_queue()];
+
+    for(NSInteger i = 1; i <= 5000; i++)
+        object.progress = i;
+    SPTestSpinRunloopWithCondition([received.lastObject isEqual:@5000], 1.0);
+    XCTAssertEqualObjects(received, (@[@5000]), @"The initial value and the whole burst should come out as one delivery");
+}
+
+- (void)testPerformanceHighFrequencyKVO
+{
+    SPStreamTestObject *object = [SPStreamTestObject new];
+    SPStream *stream = [SPStream streamWithKeyPath:@"progress" ofObject:object on:dispatch_get_main_queue()];
+    __block NSInteger latest = -1;
+    [stream subscribe:^(NSNumber *value) {
+        latest = [value integerValue];
+    } on:dispatch_get_main_queue()];
+
+    __block NSInteger progress = 0;
+    [self measureBlock:^{
+        NSInteger target = progress + 100000;
+        dispatch_async(dispatch_get_global_queue(0, 0), ^{
+            while(progress < target)
+                object.progress = ++progress;
+        });
+        SPTestSpinRunloopWithCondition(latest == target, 10.0);
+    }];
+}
+
+@end
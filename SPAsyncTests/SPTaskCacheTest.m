@@ -0,0 +1,245 @@
+//
+//  SPTaskCacheTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPTask.h>
+#import <SPAsync/SPTaskCache.h>
+#import "SPTaskTest.h"
+#import <malloc/malloc.h>
+
+@interface SPTaskCacheTest : XCTestCase
+@end
+
+@implementation SPTaskCacheTest
+
+/// Blocks currently allocated from the default malloc zone.
+static long SPLiveAllocationCount(void)
+{
+    malloc_statistics_t statistics;
+    malloc_zone_statistics(NULL, &statistics);
+    return (long)statistics.blocks_in_use;
+}
+
+- (void)testCoalescesConcurrentRequests
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    __block int fetches = 0;
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        fetches++;
+        return source.task;
+    };
+
+    SPTask *first = [cache taskForKey:@"a" fetch:fetch];
+    SPTask *second = [cache taskForKey:@"a" fetch:fetch];
+    XCTAssertEqual(fetches, 1, @"The second request should have joined the first");
+    XCTAssertNotEqual(first, second, @"Each caller should get a task of its own");
+
+    [source completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(first, @1, 0.1);
+    SPAssertTaskCompletesWithValueAndTimeout(second, @1, 0.1);
+    XCTAssertEqual(cache.missCount, 1u);
+    XCTAssertEqual(cache.coalescedCount, 1u);
+    XCTAssertEqual(cache.hitCount, 0u);
+}
+
+- (void)testHitsAfterCompletion
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    __block int fetches = 0;
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        fetches++;
+        return [SPTask completedTask:key];
+    };
+
+    SPAssertTaskCompletesWithValueAndTimeout([cache taskForKey:@"a" fetch:fetch], @"a", 0.1);
+    SPAssertTaskCompletesWithValueAndTimeout([cache taskForKey:@"a" fetch:fetch], @"a", 0.1);
+    XCTAssertEqual(fetches, 1);
+    XCTAssertEqual(cache.hitCount, 1u);
+    XCTAssertEqual(cache.count, 1u);
+}
+
+- (void)testCancellationIsReferenceCounted
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        return source.task;
+    };
+    SPTask *first = [cache taskForKey:@"a" fetch:fetch];
+    SPTask *second = [cache taskForKey:@"a" fetch:fetch];
+
+    [first cancel];
+    XCTAssertFalse(source.task.cancelled, @"Somebody is still waiting for the fetch");
+    XCTAssertFalse(second.cancelled);
+
+    [second cancel];
+    XCTAssertTrue(source.task.cancelled, @"Nobody is waiting for the fetch anymore");
+
+    __block int fetches = 0;
+    [cache taskForKey:@"a" fetch:^SPTask *(id key) {
+        fetches++;
+        return [SPTask completedTask:@2];
+    }];
+    XCTAssertEqual(fetches, 1, @"A cancelled fetch shouldn't be cached");
+}
+
+- (void)testCountLimitEvictsLeastRecentlyUsed
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    cache.countLimit = 2;
+    NSMutableArray *fetched = [NSMutableArray new];
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        [fetched addObject:key];
+        return [SPTask completedTask:key];
+    };
+
+    [cache taskForKey:@"a" fetch:fetch];
+    [cache taskForKey:@"b" fetch:fetch];
+    [cache taskForKey:@"a" fetch:fetch]; // 'b' is now least recently used
+    [cache taskForKey:@"c" fetch:fetch];
+    XCTAssertEqual(cache.count, 2u);
+    XCTAssertEqual(cache.evictionCount, 1u);
+
+    [cache taskForKey:@"a" fetch:fetch];
+    [cache taskForKey:@"b" fetch:fetch];
+    XCTAssertEqualObjects(fetched, (@[@"a", @"b", @"c", @"b"]));
+}
+
+- (void)testCostLimit
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    cache.totalCostLimit = 10;
+    cache.costCallback = ^NSUInteger(id key, NSData *value) {
+        return value.length;
+    };
+    SPTaskCacheFetchCallback fetch = ^SPTask *(NSNumber *key) {
+        return [SPTask completedTask:[NSMutableData dataWithLength:[key unsignedIntegerValue]]];
+    };
+
+    [cache taskForKey:@4 fetch:fetch];
+    [cache taskForKey:@5 fetch:fetch];
+    XCTAssertEqual(cache.totalCost, 9u);
+    [cache taskForKey:@6 fetch:fetch];
+    XCTAssertEqual(cache.totalCost, 6u, @"Both older values should have been evicted");
+    XCTAssertEqual(cache.count, 1u);
+}
+
+- (void)testTimeToLive
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    // Generous, so that a loaded machine doesn't let the value expire before it's asked for again.
+    cache.timeToLive = 0.5;
+    __block int fetches = 0;
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        fetches++;
+        return [SPTask completedTask:@(fetches)];
+    };
+
+    SPTask *first = [cache taskForKey:@"a" fetch:fetch];
+    SPTask *again = [cache taskForKey:@"a" fetch:fetch];
+    XCTAssertEqual(fetches, 1, @"The value should still be cached");
+    SPAssertTaskCompletesWithValueAndTimeout(first, @1, 0.1);
+    SPAssertTaskCompletesWithValueAndTimeout(again, @1, 0.1);
+    [NSThread sleepForTimeInterval:0.6];
+    SPAssertTaskCompletesWithValueAndTimeout([cache taskForKey:@"a" fetch:fetch], @2, 0.1);
+}
+
+- (void)testFailuresAreOnlyCachedOnRequest
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    __block int fetches = 0;
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        fetches++;
+        return [SPTask failedTask:error];
+    };
+
+    SPTaskCache *cache = [SPTaskCache new];
+    SPAssertTaskFailsWithErrorAndTimeout([cache taskForKey:@"a" fetch:fetch], error, 0.1);
+    SPAssertTaskFailsWithErrorAndTimeout([cache taskForKey:@"a" fetch:fetch], error, 0.1);
+    XCTAssertEqual(fetches, 2, @"Failures shouldn't be cached by default");
+
+    cache.failureTimeToLive = 0.5;
+    fetches = 0;
+    SPAssertTaskFailsWithErrorAndTimeout([cache taskForKey:@"a" fetch:fetch], error, 0.1);
+    SPAssertTaskFailsWithErrorAndTimeout([cache taskForKey:@"a" fetch:fetch], error, 0.1);
+    XCTAssertEqual(fetches, 1);
+    [NSThread sleepForTimeInterval:0.6];
+    [cache taskForKey:@"a" fetch:fetch];
+    XCTAssertEqual(fetches, 2, @"The failure should have expired");
+}
+
+- (void)testRemoveLetsInFlightFetchFinish
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *task = [cache taskForKey:@"a" fetch:^SPTask *(id key) {
+        return source.task;
+    }];
+    [cache removeTaskForKey:@"a"];
+
+    __block int fetches = 0;
+    [cache taskForKey:@"a" fetch:^SPTask *(id key) {
+        fetches++;
+        return [SPTask completedTask:@2];
+    }];
+    XCTAssertEqual(fetches, 1);
+
+    [source completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(task, @1, 0.1);
+}
+
+- (void)testPerformanceConcurrentRequestsForFewKeys
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        return [SPTask delay:0.001 completeValue:key];
+    };
+    [self measureBlock:^{
+        [cache removeAllTasks];
+        dispatch_apply(100000, dispatch_get_global_queue(0, 0), ^(size_t i) {
+            [cache taskForKey:@(i % 16) fetch:fetch];
+        });
+    }];
+}
+
+- (void)testHitsAllocateAtMostTheirTask
+{
+    // A hit used to make an NSMutableArray, a completion source and a task. Now it makes just the
+    // task.
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCacheFetchCallback fetch = ^SPTask *(NSString *key) {
+        return [SPTask completedTask:key];
+    };
+    [cache taskForKey:@"key" fetch:fetch];
+
+    const long hits = 10000;
+    NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:hits];
+    long before = SPLiveAllocationCount();
+    @autoreleasepool {
+        for(long i = 0; i < hits; i++)
+            [tasks addObject:[cache taskForKey:@"key" fetch:fetch]];
+    }
+    long allocated = SPLiveAllocationCount() - before;
+
+    XCTAssertLessThan(allocated, hits * 3 / 2, @"Hits should allocate only the task they return");
+    XCTAssertEqual(cache.hitCount, (NSUInteger)hits);
+}
+
+- (void)testPerformanceHits
+{
+    SPTaskCache *cache = [SPTaskCache new];
+    SPTaskCacheFetchCallback fetch = ^SPTask *(id key) {
+        return [SPTask completedTask:key];
+    };
+    [cache taskForKey:@1 fetch:fetch];
+    [self measureBlock:^{
+        for(int i = 0; i < 1000000; i++) @autoreleasepool {
+            [cache taskForKey:@1 fetch:fetch];
+        }
+    }];
+}
+
+@end
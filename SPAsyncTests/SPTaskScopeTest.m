@@ -0,0 +1,189 @@
+//
+//  SPTaskScopeTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPTask.h>
+#import <SPAsync/SPTaskScope.h>
+#import "SPTaskTest.h"
+
+@interface SPTaskScopeTest : XCTestCase
+@end
+
+@implementation SPTaskScopeTest
+
+- (void)testTasksCreatedInScopeJoinIt
+{
+    SPTaskScope *scope = [SPTaskScope new];
+    SPTaskCompletionSource *outside = [SPTaskCompletionSource new];
+    NSArray *sources = [scope run:^id{
+        XCTAssertEqual([SPTaskScope currentScope], scope);
+        return @[[SPTaskCompletionSource new], [SPTaskCompletionSource new]];
+    }];
+    XCTAssertNil([SPTaskScope currentScope]);
+    XCTAssertEqual(scope.taskCount, 2u);
+
+    [sources[0] completeWithValue:@1];
+    XCTAssertEqual(scope.taskCount, 1u);
+    [sources[1] failWithError:[NSError errorWithDomain:@"test" code:1 userInfo:nil]];
+    XCTAssertEqual(scope.taskCount, 0u);
+
+    [scope addTask:outside.task];
+    XCTAssertEqual(scope.taskCount, 1u);
+    [outside.task cancel];
+    XCTAssertEqual(scope.taskCount, 0u);
+}
+
+- (void)testScopesNest
+{
+    SPTaskScope *outer = [SPTaskScope new];
+    SPTaskScope *inner = [SPTaskScope new];
+    [outer run:^id{
+        [inner run:^id{
+            XCTAssertEqual([SPTaskScope currentScope], inner);
+            return nil;
+        }];
+        XCTAssertEqual([SPTaskScope currentScope], outer);
+        return nil;
+    }];
+}
+
+- (void)testCancelCancelsEverything
+{
+    SPTaskScope *scope = [SPTaskScope new];
+    NSMutableArray *sources = [NSMutableArray new];
+    [scope run:^id{
+        for(int i = 0; i < 10; i++)
+            [sources addObject:[SPTaskCompletionSource new]];
+        return nil;
+    }];
+
+    [scope cancel];
+    XCTAssertTrue(scope.cancelled);
+    for(SPTaskCompletionSource *source in sources)
+        XCTAssertTrue(source.task.cancelled);
+    XCTAssertEqual(scope.taskCount, 0u);
+
+    SPTaskCompletionSource *late = [scope run:^id{ return [SPTaskCompletionSource new]; }];
+    XCTAssertTrue(late.task.cancelled, @"Tasks joining a cancelled scope should be cancelled right away");
+}
+
+- (void)testScopeFollowsWork
+{
+    SPTaskScope *scope = [SPTaskScope new];
+    dispatch_queue_t queue = dispatch_queue_create("SPTaskScopeTest", DISPATCH_QUEUE_SERIAL);
+    __block SPTaskCompletionSource *inner = nil;
+    [scope run:^id{
+        return [[SPTask performWork:^id{ return @1; } onQueue:queue] chain:^SPTask *(id value) {
+            XCTAssertEqual([SPTaskScope currentScope], scope);
+            inner = [SPTaskCompletionSource new];
+            return inner.task;
+        } on:queue];
+    }];
+
+    // The performWork: task has settled; the chained task and the one started in its callback,
+    // which it follows, are what's left.
+    SPTestSpinRunloopWithCondition(inner != nil && scope.taskCount == 2, 1.0);
+    XCTAssertEqual(scope.taskCount, 2u);
+    [scope cancel];
+    XCTAssertTrue(inner.task.cancelled);
+    XCTAssertEqual(scope.taskCount, 0u);
+}
+
+- (void)testDrain
+{
+    SPTaskScope *scope = [SPTaskScope new];
+    SPAssertTaskCompletesWithValueAndTimeout([scope drain], nil, 0.1);
+
+    SPTaskCompletionSource *source = [scope run:^id{ return [SPTaskCompletionSource new]; }];
+    SPTask *drained = [scope run:^id{ return [scope drain]; }];
+    XCTAssertFalse(drained.completed);
+    XCTAssertEqual(scope.taskCount, 1u, @"The drain task shouldn't count as one of the scope's");
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.01 * NSEC_PER_SEC)), dispatch_get_global_queue(0, 0), ^{
+        [source completeWithValue:@1];
+    });
+    NSError *error = nil;
+    [drained waitWithTimeout:1.0 error:&error];
+    XCTAssertNil(error);
+    XCTAssertTrue(drained.completed);
+}
+
+- (void)testTaskLimit
+{
+    SPTaskScope *scope = [[SPTaskScope alloc] initWithTaskLimit:2 continuationLimit:0];
+    NSArray *sources = [scope run:^id{
+        return @[[SPTaskCompletionSource new], [SPTaskCompletionSource new], [SPTaskCompletionSource new]];
+    }];
+    SPTaskCompletionSource *rejected = sources[2];
+    NSError *limitError = [NSError errorWithDomain:SPTaskErrorDomain code:SPTaskErrorScopeLimitExceeded userInfo:@{NSLocalizedDescriptionKey: @"Too many tasks or callbacks in the task's scope."}];
+    SPAssertTaskFailsWithErrorAndTimeout(rejected.task, limitError, 0.1);
+    XCTAssertEqual(scope.taskCount, 2u);
+    XCTAssertEqual(scope.rejectedCount, 1u);
+
+    XCTAssertFalse(rejected.task.cancelled, @"A rejected task has failed, not been cancelled");
+    __block BOOL finallyCalled = NO, finallyCancelled = YES;
+    [rejected.task addFinallyCallback:^(BOOL cancelled) { finallyCalled = YES; finallyCancelled = cancelled; } on:dispatch_get_main_queue()];
+    SPTestSpinRunloopWithCondition(finallyCalled, 0.1);
+    XCTAssertFalse(finallyCancelled);
+
+    // Whoever owns the rejected task may still complete it, to no effect.
+    [rejected completeWithValue:@3];
+    SPAssertTaskFailsWithErrorAndTimeout(rejected.task, limitError, 0.1);
+
+    // Settled tasks make room for new ones.
+    [sources[0] completeWithValue:@1];
+    SPTaskCompletionSource *admitted = [scope run:^id{ return [SPTaskCompletionSource new]; }];
+    XCTAssertFalse(admitted.task.completed);
+    XCTAssertEqual(scope.taskCount, 2u);
+}
+
+- (void)testContinuationLimit
+{
+    SPTaskScope *scope = [[SPTaskScope alloc] initWithTaskLimit:0 continuationLimit:2];
+    SPTaskCompletionSource *source = [scope run:^id{ return [SPTaskCompletionSource new]; }];
+    __block int values = 0;
+    [source.task addCallback:^(id value) { values++; } on:dispatch_get_main_queue()];
+    [source.task addCallback:^(id value) { values++; } on:dispatch_get_main_queue()];
+    XCTAssertEqual(scope.continuationCount, 2u);
+
+    // Callbacks past the limit are turned away on their own, with the limit error.
+    __block NSError *failure = nil;
+    __block BOOL finallyCalled = NO, finallyCancelled = YES, valueCalled = NO;
+    [source.task addErrorCallback:^(NSError *error) { failure = error; } on:dispatch_get_main_queue()];
+    [source.task addFinallyCallback:^(BOOL cancelled) { finallyCalled = YES; finallyCancelled = cancelled; } on:dispatch_get_main_queue()];
+    [source.task addCallback:^(id value) { valueCalled = YES; } on:dispatch_get_main_queue()];
+    SPTestSpinRunloopWithCondition(failure != nil && finallyCalled, 0.1);
+    XCTAssertEqual(failure.code, SPTaskErrorScopeLimitExceeded);
+    XCTAssertFalse(finallyCancelled);
+    XCTAssertEqual(scope.rejectedCount, 3u);
+
+    // The task itself carries on, for the callbacks it has.
+    XCTAssertFalse(source.task.completed);
+    XCTAssertFalse(source.task.cancelled);
+    XCTAssertEqual(scope.taskCount, 1u);
+    XCTAssertEqual(scope.continuationCount, 2u);
+    [source completeWithValue:@1];
+    SPTestSpinRunloopWithCondition(values == 2, 0.1);
+    XCTAssertEqual(values, 2);
+    XCTAssertFalse(valueCalled, @"Value callbacks past the limit should never be called");
+    XCTAssertEqual(scope.continuationCount, 0u);
+    XCTAssertEqual(scope.taskCount, 0u);
+}
+
+- (void)testPerformanceBulkCancel
+{
+    [self measureBlock:^{
+        SPTaskScope *scope = [SPTaskScope new];
+        NSMutableArray *sources = [NSMutableArray arrayWithCapacity:10000];
+        [scope run:^id{
+            for(int i = 0; i < 10000; i++)
+                [sources addObject:[SPTaskCompletionSource new]];
+            return nil;
+        }];
+        [scope cancel];
+    }];
+}
+
+@end
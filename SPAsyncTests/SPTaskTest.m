@@ -8,6 +8,25 @@
 
 #import "SPTaskTest.h"
 #import <SPAsync/SPTask.h>
+#include <stdatomic.h>
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+
+static size_t SPTestMemoryFootprint(void)
+{
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if(task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return (size_t)info.phys_footprint;
+}
+
+static long SPTestLiveAllocationCount(void)
+{
+    malloc_statistics_t statistics;
+    malloc_zone_statistics(NULL, &statistics);
+    return (long)statistics.blocks_in_use;
+}
 
 @implementation SPTaskTest
 
@@ -454,4 +473,962 @@
     SPAssertTaskCancelledWithTimeout(awaited, 0.1);
 }
 
+- (void)testConcurrentCallbackRegistration
+{
+    // Many threads attach callbacks to the same task while it completes; every
+    // callback must fire exactly once, whether it was registered before or after.
+    static const size_t kRegistrations = 20000;
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *task = source.task;
+    dispatch_queue_t callbackQueue = dispatch_queue_create("SPAsync.stresstest", DISPATCH_QUEUE_CONCURRENT);
+    dispatch_group_t group = dispatch_group_create();
+    atomic_int *hits = calloc(kRegistrations, sizeof(atomic_int));
+    
+    dispatch_apply(kRegistrations, dispatch_get_global_queue(0, 0), ^(size_t i) {
+        if(i == kRegistrations/2)
+            [source completeWithValue:@(1337)];
+        
+        dispatch_group_enter(group);
+        [task addCallback:^(id value) {
+            XCTAssertEqualObjects(value, @(1337), @"Unexpected value");
+            atomic_fetch_add(&hits[i], 1);
+            dispatch_group_leave(group);
+        } on:callbackQueue];
+    });
+    
+    long timedOut = dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, 10*NSEC_PER_SEC));
+    XCTAssertEqual(timedOut, 0L, @"Some callbacks were lost");
+    for(size_t i = 0; i < kRegistrations; i++)
+        XCTAssertEqual(atomic_load(&hits[i]), 1, @"Callback %zu fired the wrong number of times", i);
+    free(hits);
+}
+
+- (void)testConcurrentCompletion
+{
+    // Racing completers: exactly one result wins, and every callback sees that one.
+    static const size_t kCompleters = 64;
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    __block int errbacks = 0;
+    __block int finallys = 0;
+    __block NSInteger seenCode = -1;
+    
+    [[source.task addErrorCallback:^(NSError *error) {
+        errbacks++;
+        seenCode = error.code;
+    } on:dispatch_get_main_queue()] addFinallyCallback:^(BOOL cancelled) {
+        finallys++;
+    } on:dispatch_get_main_queue()];
+    
+    dispatch_apply(kCompleters, dispatch_get_global_queue(0, 0), ^(size_t i) {
+        [source failWithError:[NSError errorWithDomain:@"test" code:i userInfo:nil] ignoreIfAlreadyCompleted:YES];
+    });
+    
+    __block NSInteger lateCode = -2;
+    [source.task addErrorCallback:^(NSError *error) {
+        lateCode = error.code;
+    } on:dispatch_get_main_queue()];
+    
+    SPTestSpinRunloopWithCondition(finallys == 1 && lateCode != -2, 1.0);
+    XCTAssertEqual(errbacks, 1, @"Errback should fire exactly once");
+    XCTAssertEqual(finallys, 1, @"Finally should fire exactly once");
+    XCTAssertEqual(seenCode, lateCode, @"Early and late errbacks should see the same error");
+}
+
+- (void)testPerformanceThenPipeline
+{
+    // The common shape: every task in the pipeline has exactly one continuation.
+    // Run under the Allocations instrument to see allocations per link.
+    dispatch_queue_t queue = dispatch_queue_create("SPAsync.perftest", DISPATCH_QUEUE_SERIAL);
+    [self measureBlock:^{
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+        SPTask *task = source.task;
+        for(int i = 0; i < 10000; i++) {
+            task = [task then:^id(id value) {
+                return value;
+            } on:queue];
+        }
+        [task addCallback:^(id value) {
+            dispatch_semaphore_signal(done);
+        } on:queue];
+        [source completeWithValue:@1];
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    }];
+}
+
+- (void)testBroadcastDeliveryOrder
+{
+    // Listeners on the same queue are delivered together, in registration order,
+    // with finallys after the callbacks.
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    dispatch_queue_t otherQueue = dispatch_queue_create("SPAsync.broadcasttest", DISPATCH_QUEUE_SERIAL);
+    NSMutableArray *mainOrder = [NSMutableArray new];
+    NSMutableArray *otherOrder = [NSMutableArray new];
+    
+    [source.task addFinallyCallback:^(BOOL cancelled) {
+        [mainOrder addObject:@"finally"];
+    } on:dispatch_get_main_queue()];
+    for(int i = 0; i < 50; i++) {
+        [source.task addCallback:^(id value) {
+            [mainOrder addObject:@(i)];
+        } on:dispatch_get_main_queue()];
+        [source.task addCallback:^(id value) {
+            [otherOrder addObject:@(i)];
+        } on:otherQueue];
+    }
+    
+    [source completeWithValue:@1];
+    
+    SPTestSpinRunloopWithCondition(mainOrder.count == 51, 0.1);
+    dispatch_sync(otherQueue, ^{});
+    
+    NSMutableArray *expected = [NSMutableArray new];
+    for(int i = 0; i < 50; i++)
+        [expected addObject:@(i)];
+    XCTAssertEqualObjects(otherOrder, expected, @"Callbacks ran out of order");
+    [expected addObject:@"finally"];
+    XCTAssertEqualObjects(mainOrder, expected, @"Callbacks ran out of order, or finally ran early");
+}
+
+- (void)testInlineQueue
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    __block BOOL called = NO;
+    [[source.task then:^id(id value) {
+        return @([value intValue]*2);
+    } on:[SPTask inlineQueue]] addCallback:^(id value) {
+        XCTAssertEqualObjects(value, @(20), @"Unexpected value");
+        called = YES;
+    } on:[SPTask inlineQueue]];
+    
+    [source completeWithValue:@(10)];
+    XCTAssertTrue(called, @"Inline callbacks should have run synchronously during completion");
+}
+
+- (void)testDeepInlineChainDoesNotOverflow
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *task = source.task;
+    for(int i = 0; i < 5000; i++) {
+        task = [task then:^id(id value) {
+            return @([value intValue] + 1);
+        } on:[SPTask inlineQueue]];
+    }
+    [source completeWithValue:@0];
+    SPAssertTaskCompletesWithValueAndTimeout(task, @(5000), 5.0);
+}
+
+- (void)measureTenStageChainOn:(dispatch_queue_t)queue
+{
+    [self measureBlock:^{
+        for(int i = 0; i < 1000; i++) {
+            dispatch_semaphore_t done = dispatch_semaphore_create(0);
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            SPTask *task = source.task;
+            for(int stage = 0; stage < 10; stage++) {
+                task = [task then:^id(id value) {
+                    return @([value intValue] + 1);
+                } on:queue];
+            }
+            [task addCallback:^(id value) {
+                dispatch_semaphore_signal(done);
+            } on:queue];
+            [source completeWithValue:@0];
+            dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+        }
+    }];
+}
+
+- (void)testPerformanceTenStageChainDefault
+{
+    [self measureTenStageChainOn:dispatch_queue_create("SPAsync.perftest", DISPATCH_QUEUE_SERIAL)];
+}
+
+- (void)testPerformanceTenStageChainInline
+{
+    [self measureTenStageChainOn:[SPTask inlineQueue]];
+}
+
+- (SPTask*)countdown:(int)remaining on:(dispatch_queue_t)queue trackingTask:(SPTask * __weak *)tracked allocations:(long*)allocations
+{
+    if(remaining == 0)
+        return [SPTask completedTask:@"liftoff"];
+    
+    // Live allocations are sampled once the chain is well under way, and again near its end.
+    if(remaining == 900000)
+        allocations[0] = SPTestLiveAllocationCount();
+    else if(remaining == 100000)
+        allocations[1] = SPTestLiveAllocationCount();
+    
+    SPTask *step = [[SPTask performWork:^id{
+        return nil;
+    } onQueue:queue] chain:^SPTask*(id value) {
+        return [self countdown:remaining-1 on:queue trackingTask:tracked allocations:allocations];
+    } on:queue];
+    if(remaining == 999999)
+        *tracked = step;
+    return step;
+}
+
+- (void)testRecursiveChainRunsInConstantMemory
+{
+    // Each step of the countdown completes its chain: task with the next step. Instead of
+    // stacking a forwarder per step, every step should be linked straight to the outermost
+    // task, letting the intermediate ones (and whatever tied them to their parents) go as soon
+    // as their work is done.
+    dispatch_queue_t queue = dispatch_queue_create("SPAsync.countdown", DISPATCH_QUEUE_SERIAL);
+    __weak SPTask *intermediate = nil;
+    __block BOOL done = NO;
+    long *allocations = calloc(2, sizeof(long));
+    
+    @autoreleasepool {
+        SPTask *countdown = [self countdown:1000000 on:queue trackingTask:&intermediate allocations:allocations];
+        [countdown addCallback:^(id value) {
+            XCTAssertEqualObjects(value, @"liftoff", @"Unexpected value");
+            done = YES;
+        } on:dispatch_get_main_queue()];
+    }
+    
+    SPTestSpinRunloopWithCondition(done, 120.0);
+    SPTestSpinRunloopWithCondition(intermediate == nil, 1.0);
+    XCTAssertNil(intermediate, @"Intermediate tasks in the chain should have been released");
+    // Anything kept per step would be at least 800000 blocks between the two samples.
+    XCTAssertLessThan(allocations[1] - allocations[0], 80000L, @"The chain should not grow with its length");
+    free(allocations);
+}
+
+- (void)testCompleteWithSharedTaskKeepsConsumersApart
+{
+    SPTaskCompletionSource *shared = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *first = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *second = [SPTaskCompletionSource new];
+    [first completeWithTask:shared.task];
+    [second completeWithTask:shared.task];
+    
+    [first.task cancel];
+    XCTAssertFalse(shared.task.cancelled, @"Cancelling one consumer shouldn't cancel the task it was completed with");
+    XCTAssertFalse(second.task.cancelled, @"Cancelling one consumer shouldn't cancel another");
+    
+    [shared completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(second.task, @1, 0.1);
+    XCTAssertTrue(first.task.cancelled);
+}
+
+- (void)testCompleteWithCancelledTaskCancels
+{
+    SPTaskCompletionSource *outer = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *inner = [SPTaskCompletionSource new];
+    [outer completeWithTask:inner.task];
+    [inner.task cancel];
+    XCTAssertTrue(outer.task.cancelled);
+}
+
+- (void)testAwaitAny
+{
+    SPTaskCompletionSource *source1 = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *source2 = [SPTaskCompletionSource new];
+    
+    SPTask *any = [SPTask awaitAny:@[source1.task, source2.task]];
+    [source2 completeWithValue:@2];
+    [source1 completeWithValue:@1];
+    
+    SPAssertTaskCompletesWithValueAndTimeout(any, @2, 0.1);
+    XCTAssertFalse(source1.task.cancelled, @"awaitAny: shouldn't cancel the other tasks");
+}
+
+- (void)testAwaitFirstSuccess
+{
+    SPTaskCompletionSource *failing = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *succeeding = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *slow = [SPTaskCompletionSource new];
+    
+    SPTask *first = [SPTask awaitFirstSuccess:@[failing.task, succeeding.task, slow.task]];
+    [failing failWithError:[NSError errorWithDomain:@"test" code:1 userInfo:nil]];
+    [succeeding completeWithValue:@2];
+    
+    SPAssertTaskCompletesWithValueAndTimeout(first, @2, 0.1);
+    XCTAssertTrue(slow.task.cancelled, @"The losers should have been cancelled");
+}
+
+- (void)testAwaitFirstSuccessAllFail
+{
+    SPTaskCompletionSource *source1 = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *source2 = [SPTaskCompletionSource new];
+    NSError *error1 = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    NSError *error2 = [NSError errorWithDomain:@"test" code:2 userInfo:nil];
+    
+    SPTask *first = [SPTask awaitFirstSuccess:@[source1.task, source2.task]];
+    [source2 failWithError:error2];
+    [source1 failWithError:error1];
+    
+    SPAssertTaskFailsWithErrorAndTimeout(first, error1, 0.1);
+}
+
+- (void)testAwaitAllSettled
+{
+    SPTaskCompletionSource *source1 = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *source2 = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *nullSource = [SPTaskCompletionSource new];
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    
+    SPTask *settled = [SPTask awaitAllSettled:@[source1.task, source2.task, nullSource.task]];
+    [source2 failWithError:error];
+    [nullSource completeWithValue:nil];
+    [source1 completeWithValue:@1];
+    
+    id expected = @[@1, error, [NSNull null]];
+    SPAssertTaskCompletesWithValueAndTimeout(settled, expected, 0.1);
+}
+
+- (void)measureFanInOf:(NSUInteger)count
+{
+    [self measureBlock:^{
+        NSMutableArray *sources = [NSMutableArray arrayWithCapacity:count];
+        NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:count];
+        for(NSUInteger i = 0; i < count; i++) {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            [sources addObject:source];
+            [tasks addObject:source.task];
+        }
+        
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [[SPTask awaitAll:tasks] addCallback:^(id value) {
+            dispatch_semaphore_signal(done);
+        } on:dispatch_get_global_queue(0, 0)];
+        
+        dispatch_apply(count, dispatch_get_global_queue(0, 0), ^(size_t i) {
+            [sources[i] completeWithValue:@(i)];
+        });
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    }];
+}
+
+- (void)testPerformanceFanIn10
+{
+    [self measureFanInOf:10];
+}
+
+- (void)testPerformanceFanIn1k
+{
+    [self measureFanInOf:1000];
+}
+
+- (void)testPerformanceFanIn100k
+{
+    [self measureFanInOf:100000];
+}
+
+- (void)testMapPreservesOrder
+{
+    NSMutableArray *items = [NSMutableArray array];
+    NSMutableArray *expected = [NSMutableArray array];
+    for(int i = 0; i < 1000; i++) {
+        [items addObject:@(i)];
+        [expected addObject:@(i*2)];
+    }
+    
+    SPTask *mapped = [SPTask map:items maxConcurrency:4 on:dispatch_get_global_queue(0, 0) work:^id(NSNumber *item) {
+        return @([item intValue]*2);
+    }];
+    SPAssertTaskCompletesWithValueAndTimeout(mapped, expected, 1);
+}
+
+- (void)testMapStopsOnFirstError
+{
+    NSMutableArray *items = [NSMutableArray array];
+    for(int i = 0; i < 1000; i++)
+        [items addObject:@(i)];
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    __block int calls = 0;
+    
+    SPTask *mapped = [SPTask map:items maxConcurrency:1 on:dispatch_get_main_queue() work:^id(NSNumber *item) {
+        calls++;
+        return [item intValue] == 10 ? error : item;
+    }];
+    SPAssertTaskFailsWithErrorAndTimeout(mapped, error, 1);
+    XCTAssertEqual(calls, 11, @"No items should have been mapped after the failing one");
+}
+
+- (void)testMapTasksBoundsConcurrency
+{
+    NSMutableArray *items = [NSMutableArray array];
+    NSMutableArray *sources = [NSMutableArray array];
+    for(int i = 0; i < 5; i++)
+        [items addObject:@(i)];
+    
+    SPTask *mapped = [SPTask mapTasks:items maxConcurrency:2 work:^SPTask *(NSNumber *item) {
+        SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+        [sources addObject:source];
+        return source.task;
+    }];
+    XCTAssertEqual(sources.count, 2u, @"Only two tasks should be in flight");
+    
+    [sources[1] completeWithValue:@"b"];
+    XCTAssertEqual(sources.count, 3u, @"A completed task should make room for the next one");
+    [sources[0] completeWithValue:@"a"];
+    [sources[2] completeWithValue:@"c"];
+    [sources[3] completeWithValue:@"d"];
+    [sources[4] completeWithValue:nil];
+    XCTAssertEqual(sources.count, 5u);
+    
+    id expected = @[@"a", @"b", @"c", @"d", [NSNull null]];
+    SPAssertTaskCompletesWithValueAndTimeout(mapped, expected, 0.1);
+}
+
+- (void)testMapTasksCancelsInFlightOnError
+{
+    NSMutableArray *items = [NSMutableArray array];
+    NSMutableArray *sources = [NSMutableArray array];
+    for(int i = 0; i < 10; i++)
+        [items addObject:@(i)];
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    
+    SPTask *mapped = [SPTask mapTasks:items maxConcurrency:3 work:^SPTask *(NSNumber *item) {
+        SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+        [sources addObject:source];
+        return source.task;
+    }];
+    [sources[1] failWithError:error];
+    
+    SPAssertTaskFailsWithErrorAndTimeout(mapped, error, 0.1);
+    XCTAssertEqual(sources.count, 3u, @"No more tasks should be started after a failure");
+    XCTAssertTrue([sources[0] task].cancelled, @"Tasks in flight should be cancelled");
+    XCTAssertTrue([sources[2] task].cancelled, @"Tasks in flight should be cancelled");
+}
+
+- (void)testPerformanceMapMillionItems
+{
+    NSMutableArray *items = [NSMutableArray arrayWithCapacity:1000000];
+    for(int i = 0; i < 1000000; i++)
+        [items addObject:@(i)];
+    
+    [self measureBlock:^{
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [[SPTask map:items maxConcurrency:8 on:dispatch_get_global_queue(0, 0) work:^id(NSNumber *item) {
+            return @([item integerValue] + 1);
+        }] addFinallyCallback:^(BOOL cancelled) {
+            dispatch_semaphore_signal(done);
+        } on:dispatch_get_global_queue(0, 0)];
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    }];
+}
+
+- (void)testCompletedChildrenAreNotRetained
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *otherSource = [SPTaskCompletionSource new];
+    __weak SPTask *weakChild;
+    __weak SPTask *weakPendingChild;
+    @autoreleasepool {
+        SPTask *child = [source.task then:^id(id value) {
+            return value;
+        } on:[SPTask inlineQueue]];
+        weakChild = child;
+        
+        SPTask *pendingChild = [otherSource.task then:^id(id value) {
+            return value;
+        } on:[SPTask inlineQueue]];
+        weakPendingChild = pendingChild;
+        
+        [source completeWithValue:@1];
+    }
+    XCTAssertNil(weakChild, @"A settled child shouldn't be kept alive by its parent");
+    XCTAssertNotNil(weakPendingChild, @"An in-flight child should be kept alive by its parent");
+    
+    SPTask *pendingChild = weakPendingChild;
+    [otherSource.task cancel];
+    XCTAssertTrue(pendingChild.cancelled, @"An in-flight child should be cancelled with its parent");
+}
+
+- (void)testCancellationReachesInFlightDescendants
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    [source completeWithValue:@1];
+    SPTaskCompletionSource *inner = [SPTaskCompletionSource new];
+    
+    // Lots of settled siblings, to make sure pruning keeps the in-flight ones.
+    for(int i = 0; i < 1000; i++)
+        [source.task then:^id(id value) { return value; } on:[SPTask inlineQueue]];
+    SPTask *inFlight = [[source.task chain:^SPTask *(id value) {
+        return inner.task;
+    } on:[SPTask inlineQueue]] then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    for(int i = 0; i < 1000; i++)
+        [source.task then:^id(id value) { return value; } on:[SPTask inlineQueue]];
+    
+    [source.task cancel];
+    XCTAssertTrue(inner.task.cancelled, @"Cancellation should reach in-flight descendants");
+    XCTAssertTrue(inFlight.cancelled, @"Cancellation should reach in-flight descendants");
+}
+
+- (void)testMillionShortLivedChildrenUseConstantMemory
+{
+    SPTaskCompletionSource *configLoaded = [SPTaskCompletionSource new];
+    [configLoaded completeWithValue:@"config"];
+    SPTask *config = configLoaded.task;
+    
+    void(^attach)(int) = ^(int count) {
+        for(int i = 0; i < count; i++) {
+            @autoreleasepool {
+                NSMutableData *captured = [NSMutableData dataWithLength:64];
+                [config then:^id(id value) {
+                    return captured;
+                } on:[SPTask inlineQueue]];
+            }
+        }
+    };
+    
+    attach(100000);
+    size_t before = SPTestMemoryFootprint();
+    attach(900000);
+    size_t after = SPTestMemoryFootprint();
+    
+    // Retaining every child (task, source, block and captured data) would cost hundreds of MB.
+    XCTAssertLessThan((double)after - (double)before, 8.0*1024*1024, @"Memory use should stay flat");
+}
+
+- (void)testCancelledQueuedWorkDoesNotRun
+{
+    dispatch_queue_t queue = dispatch_queue_create("SPAsync.test", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t gate = dispatch_semaphore_create(0);
+    dispatch_async(queue, ^{
+        dispatch_semaphore_wait(gate, DISPATCH_TIME_FOREVER);
+    });
+    
+    __block BOOL ran = NO;
+    SPTask *task = [SPTask performWork:^id{
+        ran = YES;
+        return nil;
+    } onQueue:queue];
+    [task cancel];
+    dispatch_semaphore_signal(gate);
+    dispatch_sync(queue, ^{});
+    
+    XCTAssertFalse(ran, @"Work cancelled while queued shouldn't run");
+}
+
+- (void)testCancellableWorkSeesCancellation
+{
+    dispatch_semaphore_t started = dispatch_semaphore_create(0);
+    __block BOOL sawCancellation = NO;
+    SPTask *task = [SPTask performCancellableWork:^id(id<SPCancellationToken> token) {
+        dispatch_semaphore_signal(started);
+        while(!token.cancelled)
+            usleep(100);
+        sawCancellation = YES;
+        return @"ignored";
+    } onQueue:dispatch_get_global_queue(0, 0)];
+    
+    dispatch_semaphore_wait(started, DISPATCH_TIME_FOREVER);
+    [task cancel];
+    SPTestSpinRunloopWithCondition(sawCancellation, 1.0);
+    XCTAssertTrue(sawCancellation, @"The work block should have seen the cancellation");
+    XCTAssertFalse(task.completed, @"A cancelled task shouldn't complete");
+}
+
+- (void)testCancelledDelayDoesNotFire
+{
+    __block BOOL fired = NO;
+    SPTask *delayed = [[SPTask delay:0.05] addCallback:^(id value) {
+        fired = YES;
+    }];
+    [delayed cancel];
+    SPTestSpinRunloopWithCondition(fired, 0.1);
+    XCTAssertFalse(fired, @"A cancelled delay shouldn't fire");
+}
+
+/// Queues 'count' tasks of ~50us of CPU each behind a gate, cancels them all, and returns how
+/// many of them still burnt their CPU time.
+- (int)wastedWorkAfterMassCancelOf:(int)count
+{
+    dispatch_queue_t queue = dispatch_queue_create("SPAsync.perftest", DISPATCH_QUEUE_SERIAL);
+    dispatch_semaphore_t gate = dispatch_semaphore_create(0);
+    dispatch_async(queue, ^{
+        dispatch_semaphore_wait(gate, DISPATCH_TIME_FOREVER);
+    });
+    
+    __block int ran = 0; // only touched on the serial queue
+    NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:count];
+    for(int i = 0; i < count; i++) {
+        id(^work)(void) = ^id{
+            ran++;
+            CFAbsoluteTime end = CFAbsoluteTimeGetCurrent() + 0.00005;
+            while(CFAbsoluteTimeGetCurrent() < end);
+            return nil;
+        };
+        [tasks addObject:[SPTask performWork:work onQueue:queue]];
+    }
+    [tasks makeObjectsPerformSelector:@selector(cancel)];
+    dispatch_semaphore_signal(gate);
+    dispatch_sync(queue, ^{});
+    return ran;
+}
+
+- (void)testPerformanceMassCancel
+{
+    // For the cost of the same without skipping cancelled work, see cancellation.queued in
+    // Benchmarks/README.md.
+    __block int waste = 0;
+    [self measureBlock:^{
+        waste = [self wastedWorkAfterMassCancelOf:10000];
+    }];
+    XCTAssertEqual(waste, 0, @"No cancelled work should have run");
+}
+
+- (void)testDelayDoesNotFireEarly
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    __block CFAbsoluteTime fired = 0;
+    [[SPTask delay:0.05 completeValue:@1] addCallback:^(id value) {
+        fired = CFAbsoluteTimeGetCurrent();
+    }];
+    SPTestSpinRunloopWithCondition(fired != 0, 1.0);
+    XCTAssertGreaterThanOrEqual(fired - start, 0.05, @"The delay shouldn't fire early");
+}
+
+- (void)testDelaysFireInOrder
+{
+    NSMutableArray *order = [NSMutableArray array];
+    NSArray *delays = @[@0.08, @0.01, @0.2, @0.04, @0.07];
+    for(NSNumber *delay in delays) {
+        [[SPTask delay:[delay doubleValue] completeValue:delay] addCallback:^(id value) {
+            [order addObject:value];
+        }];
+    }
+    SPTestSpinRunloopWithCondition(order.count == delays.count, 1.0);
+    XCTAssertEqualObjects(order, [delays sortedArrayUsingSelector:@selector(compare:)]);
+}
+
+- (void)testTimeoutFires
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    __block BOOL sourceCancelled = NO;
+    [source addCancellationCallback:^{
+        sourceCancelled = YES;
+    }];
+    
+    SPTask *timed = [source.task timeout:0.02];
+    NSError *expected = [NSError errorWithDomain:SPTaskErrorDomain code:SPTaskErrorTimedOut userInfo:@{
+        NSLocalizedDescriptionKey: @"The operation timed out.",
+    }];
+    SPAssertTaskFailsWithErrorAndTimeout(timed, expected, 1.0);
+    XCTAssertTrue(sourceCancelled, @"Timing out should cancel the task that timed out");
+}
+
+- (void)testTimeoutDoesNotFireWhenCompletedInTime
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *timed = [source.task timeout:0.05];
+    [source completeWithValue:@1];
+    
+    SPAssertTaskCompletesWithValueAndTimeout(timed, @1, 0.1);
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssertFalse(source.task.cancelled, @"A task that completed in time shouldn't be cancelled");
+}
+
+- (void)testDeadline
+{
+    SPTask *slow = [SPTask delay:1.0 completeValue:@1];
+    SPTask *timed = [slow deadline:[NSDate dateWithTimeIntervalSinceNow:0.02]];
+    __block NSError *error;
+    [timed addErrorCallback:^(NSError *e) {
+        error = e;
+    }];
+    SPTestSpinRunloopWithCondition(error != nil, 1.0);
+    XCTAssertEqual(error.code, SPTaskErrorTimedOut);
+    XCTAssertTrue(slow.cancelled, @"The deadline should have cancelled the slow task");
+}
+
+- (void)testPerformanceArmAndDisarmTimeouts
+{
+    // Tens of thousands of in-flight requests with a timeout each, that all complete in time.
+    [self measureBlock:^{
+        NSMutableArray *sources = [NSMutableArray arrayWithCapacity:50000];
+        NSMutableArray *timed = [NSMutableArray arrayWithCapacity:50000];
+        for(int i = 0; i < 50000; i++) {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            [sources addObject:source];
+            [timed addObject:[source.task timeout:30 + (i % 1000)]];
+        }
+        for(SPTaskCompletionSource *source in sources)
+            [source completeWithValue:nil];
+    }];
+}
+
+- (void)testRetrySucceedsEventually
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    __block int attempts = 0;
+    SPTask *retried = [SPTask retry:^SPTask *{
+        return ++attempts < 3 ? [SPTask failedTask:error] : [SPTask completedTask:@(attempts)];
+    } attempts:5 backoff:0.01 jitter:0.5];
+    SPAssertTaskCompletesWithValueAndTimeout(retried, @3, 1.0);
+    XCTAssertEqual(attempts, 3);
+}
+
+- (void)testRetryGivesUpWithLastError
+{
+    __block int attempts = 0;
+    SPTask *retried = [SPTask retry:^SPTask *{
+        attempts++;
+        return [SPTask failedTask:[NSError errorWithDomain:@"test" code:attempts userInfo:nil]];
+    } attempts:3 backoff:0.01 jitter:0];
+    SPAssertTaskFailsWithErrorAndTimeout(retried, [NSError errorWithDomain:@"test" code:3 userInfo:nil], 1.0);
+    XCTAssertEqual(attempts, 3);
+}
+
+- (void)testCancellingRetryStopsIt
+{
+    __block int attempts = 0;
+    __block SPTask *attempt;
+    SPTask *retried = [SPTask retry:^SPTask *{
+        attempts++;
+        attempt = [SPTask delay:1.0];
+        return attempt;
+    } attempts:3 backoff:0.01 jitter:0];
+    [retried cancel];
+    XCTAssertTrue(attempt.cancelled, @"Cancelling should cancel the attempt in progress");
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssertEqual(attempts, 1);
+}
+
+- (void)testHedgeTakesFirstSuccessAndCancelsTheRest
+{
+    NSMutableArray *copies = [NSMutableArray new];
+    SPTask *hedged = [SPTask hedge:^SPTask *{
+        SPTask *copy;
+        @synchronized(copies) {
+            // The first copy is stuck; the second one is quick.
+            copy = copies.count == 0 ? [SPTask delay:10.0 completeValue:@1] : [SPTask delay:0.01 completeValue:@2];
+            [copies addObject:copy];
+        }
+        return copy;
+    } after:0.02 maxCopies:3];
+    SPAssertTaskCompletesWithValueAndTimeout(hedged, @2, 1.0);
+    @synchronized(copies) {
+        XCTAssertTrue([copies[0] isCancelled], @"The losing copy should have been cancelled");
+        XCTAssertTrue(copies.count <= 3);
+    }
+}
+
+- (void)testHedgeFailsOnceEveryCopyHasFailed
+{
+    __block int launched = 0;
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    SPTask *hedged = [SPTask hedge:^SPTask *{
+        launched++;
+        return [SPTask failedTask:error];
+    } after:0.5 maxCopies:3];
+    SPAssertTaskFailsWithErrorAndTimeout(hedged, error, 0.2);
+    XCTAssertEqual(launched, 3, @"Failed copies should make way for the next one right away");
+}
+
+- (void)testCancellingHedgeCancelsCopies
+{
+    __block SPTask *copy;
+    SPTask *hedged = [SPTask hedge:^SPTask *{
+        copy = [SPTask delay:1.0];
+        return copy;
+    } after:1.0 maxCopies:2];
+    [hedged cancel];
+    XCTAssertTrue(copy.cancelled);
+}
+
+- (void)testAsyncCallStackRemembersThenAndChainCallSites
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *then = [source.task then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    SPTask *chained = [then chain:^SPTask *(id value) { return [SPTask completedTask:value]; } on:dispatch_get_main_queue()];
+
+    XCTAssertEqual(source.task.asyncCallStackSymbols.count, 0u);
+    XCTAssertEqual(then.asyncCallStackSymbols.count, 1u);
+    NSArray *symbols = chained.asyncCallStackSymbols;
+    XCTAssertEqual(symbols.count, 2u);
+    for(NSString *symbol in symbols)
+        XCTAssertTrue([symbol rangeOfString:NSStringFromSelector(_cmd)].location != NSNotFound, @"%@ should be a call site in this test", symbol);
+}
+
+- (void)testAsyncCallStackIsBounded
+{
+    SPTask *task = [SPTask completedTask:@1];
+    for(int i = 0; i < 100; i++)
+        task = [task then:^id(id value) { return value; } on:[SPTask inlineQueue]];
+    XCTAssertEqual(task.asyncCallStackSymbols.count, 32u);
+}
+
+- (void)testWaitReturnsCompletedValue
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    NSError *waitError = nil;
+    XCTAssertEqualObjects([[SPTask completedTask:@1] waitWithTimeout:0 error:&waitError], @1);
+    XCTAssertNil(waitError);
+    XCTAssertNil([[SPTask failedTask:error] waitWithTimeout:0 error:&waitError]);
+    XCTAssertEqualObjects(waitError, error);
+}
+
+- (void)testWaitTimesOut
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    NSError *error = nil;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    XCTAssertNil([source.task waitWithTimeout:0.05 error:&error]);
+    XCTAssertGreaterThanOrEqual(CFAbsoluteTimeGetCurrent() - start, 0.05);
+    XCTAssertEqualObjects(error.domain, SPTaskErrorDomain);
+    XCTAssertEqual(error.code, SPTaskErrorTimedOut);
+
+    // The timed out wait's registration is still on the task; the next wait mustn't mind.
+    [source completeWithValue:@2];
+    XCTAssertEqualObjects([[SPTask delay:0.01 completeValue:@3] waitWithTimeout:1.0 error:&error], @3);
+}
+
+- (void)testWaitIsWokenFromAnotherThread
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.02 * NSEC_PER_SEC)), dispatch_get_global_queue(0, 0), ^{
+        [source completeWithValue:@1];
+    });
+    NSError *error = nil;
+    XCTAssertEqualObjects([[source.task chain] waitWithTimeout:INFINITY error:&error], @1);
+    XCTAssertNil(error);
+}
+
+- (void)testWaitReportsCancellation
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.02 * NSEC_PER_SEC)), dispatch_get_global_queue(0, 0), ^{
+        [source.task cancel];
+    });
+    NSError *error = nil;
+    XCTAssertNil([source.task waitWithTimeout:1.0 error:&error]);
+    XCTAssertEqual(error.code, SPTaskErrorCancelled);
+}
+
+- (void)testWaitOnMainThreadForMainQueueCallbackFails
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *then = [source.task then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    [source completeWithValue:@1];
+    NSError *error = nil;
+    XCTAssertNil([then waitWithTimeout:INFINITY error:&error]);
+    XCTAssertEqual(error.code, SPTaskErrorWouldDeadlock);
+
+    // Once the callback has run, there's nothing to deadlock on.
+    SPTestSpinRunloopWithCondition(then.completed, 1.0);
+    XCTAssertEqualObjects([then waitWithTimeout:INFINITY error:&error], @1);
+}
+
+static const int SPTaskWaitRoundTrips = 10000;
+
+/// Has a worker thread complete tasks one at a time, each as soon as the previous one has been
+/// waited for, with 'wait' doing the waiting.
+- (void)measureWaitRoundTrips:(id(^)(SPTask *task))wait
+{
+    [self measureBlock:^{
+        NSMutableArray *sources = [NSMutableArray arrayWithCapacity:SPTaskWaitRoundTrips];
+        for(int i = 0; i < SPTaskWaitRoundTrips; i++)
+            [sources addObject:[SPTaskCompletionSource new]];
+        dispatch_semaphore_t turn = dispatch_semaphore_create(0);
+        dispatch_async(dispatch_get_global_queue(0, 0), ^{
+            for(SPTaskCompletionSource *source in sources) {
+                dispatch_semaphore_wait(turn, DISPATCH_TIME_FOREVER);
+                [source completeWithValue:@1];
+            }
+        });
+        for(SPTaskCompletionSource *source in sources) {
+            dispatch_semaphore_signal(turn);
+            wait(source.task);
+        }
+    }];
+}
+
+- (void)testPerformanceWaitWithTimeout
+{
+    [self measureWaitRoundTrips:^id(SPTask *task) {
+        return [task waitWithTimeout:INFINITY error:NULL];
+    }];
+}
+
+- (void)testPerformanceWaitWithSemaphore
+{
+    // What synchronous callers had to do before waitWithTimeout:error:.
+    dispatch_queue_t queue = dispatch_queue_create("SPTaskTest.wait", DISPATCH_QUEUE_SERIAL);
+    [self measureWaitRoundTrips:^id(SPTask *task) {
+        __block id result = nil;
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        [task addCallback:^(id value) {
+            result = value;
+            dispatch_semaphore_signal(done);
+        } on:queue];
+        [task addErrorCallback:^(NSError *error) {
+            dispatch_semaphore_signal(done);
+        } on:queue];
+        dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+        return result;
+    }];
+}
+
+- (void)testCompletedTasksAreNeverShared
+{
+    XCTAssertNotEqual([SPTask completedTask:nil], [SPTask completedTask:nil]);
+    XCTAssertNotEqual([SPTask completedTask:@YES], [SPTask completedTaskWithBool:YES]);
+
+    // Cancelling one is up to whoever has it, and cancels its children as usual.
+    SPTask *completed = [SPTask completedTask:nil];
+    SPTask *child = [completed then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    [completed cancel];
+    XCTAssertTrue(completed.cancelled);
+    XCTAssertTrue(child.cancelled);
+    XCTAssertFalse([SPTask completedTask:nil].cancelled);
+    SPAssertTaskCompletesWithValueAndTimeout([SPTask completedTaskWithBool:NO], @NO, 0.1);
+}
+
+- (void)testPreresolvedTasks
+{
+    NSError *error = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+    SPTask *completed = [SPTask completedTask:@"value"];
+    XCTAssertTrue(completed.completed);
+    SPAssertTaskCompletesWithValueAndTimeout(completed, @"value", 0.1);
+    SPAssertTaskFailsWithErrorAndTimeout([SPTask failedTask:error], error, 0.1);
+    SPAssertTaskFailsWithErrorAndTimeout([SPTask completedTask:error], error, 0.1);
+
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    [source completeWithTask:completed];
+    SPAssertTaskCompletesWithValueAndTimeout(source.task, @"value", 0.1);
+}
+
+- (void)testScalarResults
+{
+    __block BOOL finished = NO;
+    __block NSInteger integer = 0;
+    __block double number = 0;
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    [source.task addBoolCallback:^(BOOL value) { finished = value; } on:dispatch_get_main_queue()];
+    [source completeWithBool:YES];
+    SPTestSpinRunloopWithCondition(finished, 0.1);
+    XCTAssertTrue(finished);
+    SPAssertTaskCompletesWithValueAndTimeout(source.task, @YES, 0.1);
+
+    SPTask *answer = [SPTask completedTaskWithInteger:42];
+    [answer addIntegerCallback:^(NSInteger value) { integer = value; } on:dispatch_get_main_queue()];
+    [answer addDoubleCallback:^(double value) { number = value; } on:dispatch_get_main_queue()];
+    SPTestSpinRunloopWithCondition(integer != 0 && number != 0, 0.1);
+    XCTAssertEqual(integer, 42);
+    XCTAssertEqual(number, 42.0);
+    SPAssertTaskCompletesWithValueAndTimeout(answer, @42, 0.1);
+
+    // Objects convert too.
+    [[SPTask completedTask:@"7"] addIntegerCallback:^(NSInteger value) { integer = value; } on:dispatch_get_main_queue()];
+    SPTestSpinRunloopWithCondition(integer == 7, 0.1);
+    XCTAssertEqual(integer, 7);
+}
+
+- (void)testPerformanceCompletedTask
+{
+    [self measureBlock:^{
+        for(int i = 0; i < 1000000; i++) @autoreleasepool {
+            [SPTask completedTask:@(i)];
+            [SPTask completedTask:nil];
+        }
+    }];
+}
+
 @end
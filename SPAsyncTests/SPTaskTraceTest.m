@@ -0,0 +1,119 @@
+//
+//  SPTaskTraceTest.m
+//  SPAsync
+//
+
+#import <XCTest/XCTest.h>
+#import <SPAsync/SPTask.h>
+#import <SPAsync/SPTaskTrace.h>
+#import "SPTaskTest.h"
+
+@interface SPTaskTraceTest : XCTestCase
+@end
+
+@implementation SPTaskTraceTest
+
+- (void)setUp
+{
+    [super setUp];
+    [SPTaskTrace reset];
+}
+
+- (void)tearDown
+{
+    [SPTaskTrace setEnabled:NO];
+    [SPTaskTrace reset];
+    [super tearDown];
+}
+
+- (NSArray*)traceEvents
+{
+    NSDictionary *trace = [NSJSONSerialization JSONObjectWithData:[SPTaskTrace chromeTraceJSON] options:0 error:NULL];
+    XCTAssertNotNil(trace, @"The export should be valid JSON");
+    return [trace[@"traceEvents"] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"ph != 'M'"]];
+}
+
+- (void)testRecordsNothingWhileDisabled
+{
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *then = [source.task then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    [source completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(then, @1, 0.1);
+
+    XCTAssertEqual([self traceEvents].count, 0u);
+    XCTAssertEqual([SPTaskTrace slowestChains:10].count, 0u);
+}
+
+- (void)testRecordsTaskLifecyclesAndEdges
+{
+    [SPTaskTrace setEnabled:YES];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    SPTask *then = [source.task then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    [source completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(then, @1, 0.1);
+
+    NSArray *events = [self traceEvents];
+    NSString *sourceTask = [NSString stringWithFormat:@"%p", source.task];
+    NSString *thenTask = [NSString stringWithFormat:@"%p", then];
+    NSPredicate *began = [NSPredicate predicateWithFormat:@"cat == 'task' AND ph == 'b' AND id == %@", thenTask];
+    NSPredicate *ended = [NSPredicate predicateWithFormat:@"cat == 'task' AND ph == 'e' AND id == %@ AND args.outcome == 'succeeded'", thenTask];
+    NSPredicate *edge = [NSPredicate predicateWithFormat:@"name == 'edge' AND args.from == %@ AND args.to == %@", sourceTask, thenTask];
+    NSPredicate *waited = [NSPredicate predicateWithFormat:@"cat == 'queue' AND ph == 'e'"];
+    XCTAssertEqual([events filteredArrayUsingPredicate:began].count, 1u);
+    XCTAssertEqual([events filteredArrayUsingPredicate:ended].count, 1u);
+    XCTAssertEqual([events filteredArrayUsingPredicate:edge].count, 1u);
+    XCTAssertGreaterThan([events filteredArrayUsingPredicate:waited].count, 0u, @"The callback should have waited for the main queue");
+}
+
+- (void)testRecordsCancellation
+{
+    [SPTaskTrace setEnabled:YES];
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    [source.task cancel];
+
+    NSPredicate *cancelled = [NSPredicate predicateWithFormat:@"cat == 'task' AND ph == 'e' AND id == %@ AND args.outcome == 'cancelled'", [NSString stringWithFormat:@"%p", source.task]];
+    XCTAssertEqual([[self traceEvents] filteredArrayUsingPredicate:cancelled].count, 1u);
+}
+
+- (void)testSummaries
+{
+    [SPTaskTrace setEnabled:YES];
+    SPTaskCompletionSource *slow = [SPTaskCompletionSource new];
+    SPTaskCompletionSource *fast = [SPTaskCompletionSource new];
+    SPTask *slowChain = [[slow.task then:^id(id value) { return value; } on:dispatch_get_main_queue()] then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+    SPTask *fastChain = [fast.task then:^id(id value) { return value; } on:dispatch_get_main_queue()];
+
+    [fast completeWithValue:@1];
+    SPAssertTaskCompletesWithValueAndTimeout(fastChain, @1, 0.1);
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    [slow completeWithValue:@2];
+    SPAssertTaskCompletesWithValueAndTimeout(slowChain, @2, 0.1);
+
+    NSArray *chains = [SPTaskTrace slowestChains:10];
+    XCTAssertEqual(chains.count, 2u);
+    SPTaskTraceChain *slowest = chains.firstObject;
+    XCTAssertEqualObjects(slowest.rootTask, ([NSString stringWithFormat:@"%p", slow.task]));
+    XCTAssertEqual(slowest.taskCount, 3u);
+    XCTAssertGreaterThanOrEqual(slowest.duration, 0.05);
+    XCTAssertEqual([SPTaskTrace slowestChains:1].count, 1u);
+
+    NSArray *queues = [SPTaskTrace worstQueues:10];
+    XCTAssertEqual(queues.count, 1u, @"Everything ran on the main queue");
+    SPTaskTraceQueueStatistics *main = queues.firstObject;
+    XCTAssertEqualObjects(main.label, @(dispatch_queue_get_label(dispatch_get_main_queue())));
+    XCTAssertGreaterThanOrEqual(main.count, 3u);
+    XCTAssertGreaterThanOrEqual(main.maxWait, main.meanWait);
+}
+
+- (void)testPerformanceOverheadWhileDisabled
+{
+    [self measureBlock:^{
+        for(int i = 0; i < 100000; i++) {
+            SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+            [source.task addCallback:^(id value) {} on:[SPTask inlineQueue]];
+            [source completeWithValue:@1];
+        }
+    }];
+}
+
+@end
@@ -1,10 +1,14 @@
 #import <SPAsync/NSObject+SPInvocationGrabbing.h>
 #import <execinfo.h>
 
+#define SPInvocationGrabberFrameLimit 64
+
 #pragma mark Invocation grabbing
 @interface SPInvocationGrabber () {
+    // Raw return addresses only; symbolizing them is far slower than capturing them, and only
+    // needed if the invocation raises.
     int frameCount;
-    char **frameStrings;
+    void *frames[SPInvocationGrabberFrameLimit];
     BOOL backgroundAfterForward;
     BOOL onMainAfterForward;
     BOOL waitUntilDone;
@@ -29,11 +33,6 @@
 
 	return self;
 }
--(void)dealloc;
-{
-	free(frameStrings);
-}
-
 @synthesize backgroundAfterForward, onMainAfterForward, waitUntilDone;
 - (void)runInBackground;
 {
@@ -83,16 +82,18 @@
 
 -(void)saveBacktrace;
 {
-  void *backtraceFrames[128];
-  frameCount = backtrace(&backtraceFrames[0], 128);
-  frameStrings = backtrace_symbols(&backtraceFrames[0], frameCount);
+  frameCount = backtrace(&frames[0], SPInvocationGrabberFrameLimit);
 }
 -(void)printBacktrace;
 {
+	char **frameStrings = backtrace_symbols(&frames[0], frameCount);
+	if(!frameStrings)
+		return;
 	for(int x = 3; x < frameCount; x++) {
 		if(frameStrings[x] == NULL) { break; }
 		printf("%s\n", frameStrings[x]);
 	}
+	free(frameStrings);
 }
 @end
 
@@ -1,41 +1,274 @@
 #import <SPAsync/SPAgent.h>
-#import <SPAsync/NSObject+SPInvocationGrabbing.h>
 #import <SPAsync/SPTask.h>
+#import <objc/runtime.h>
+#include <pthread.h>
+
+/*
+    [[agent sp_agentAsync] foo:bar] used to go through an SPInvocationGrabber: full message
+    forwarding, an NSInvocation, retained arguments and a return type check, for every call.
+
+    Now sp_agentAsync returns a proxy whose class is a subclass of SPAgentProxy made just for the
+    agent's class. The first time a selector is sent to it, +resolveInstanceMethod: looks at the
+    agent's method: if it takes only objects and returns an object or nothing, which covers
+    most agent methods, it adds a method to the proxy class that captures the arguments in a
+    block and calls the agent's IMP directly on its work queue. Every later call with that
+    selector is then an ordinary message send. Anything else (scalar or struct arguments or
+    return values, blocks, methods the agent only handles through forwarding) still goes
+    through forwardInvocation:.
+
+    Agents that have a mailbox get their messages through it instead of straight on their work
+    queue; whether an agent class has one is also looked up once, with the proxy class. The
+    mailbox gives every message a task, void ones included, since it may turn them away; the
+    proxy keeps the latest for sp_agentLastTask.
+
+    The agent's IMP is looked up once per class and selector, so swizzling an agent method
+    after it's first been called through sp_agentAsync isn't noticed.
+*/
+
+#define SPAgentProxyFastArgumentLimit 3
+
+@interface SPA_NS(AgentProxy) : NSProxy
+{
+@public
+    id _agent;
+    SPA_NS(AgentMailbox) *_mailbox; // the agent's, if it has one
+    SPAgentPriority _priority;
+}
+@property(strong) SPA_NS(Task) *sp_agentLastTask; // atomic, as the proxy may be shared
++ (Class)proxyClassForAgentClass:(Class)agentClass hasMailbox:(BOOL*)hasMailbox;
+@end
+
+static char SPAgentProxyAgentClassKey;
+
+// Agent class -> its SPAgentProxy subclass.
+static pthread_mutex_t gProxyClassesLock = PTHREAD_MUTEX_INITIALIZER;
+static NSMutableDictionary *gProxyClasses;
+static __thread Class tLastAgentClass;
+static __thread Class tLastProxyClass;
+static __thread BOOL tLastHasMailbox;
+
+static dispatch_queue_t SPAgentWorkQueue(id agent)
+{
+    return [(id<SPAgent>)agent workQueue];
+}
+
+/// Runs 'work' through 'mailbox' or, if there is none, on the agent's work queue. Returns a task
+/// for what 'work' returns if 'wantsResult' or there's a mailbox.
+static SPTask *SPAgentSend(id agent, SPA_NS(AgentMailbox) *mailbox, SPAgentPriority priority, SEL selector, BOOL wantsResult, id(^work)(void))
+{
+    if(mailbox)
+        return [mailbox send:work priority:priority selector:selector];
+    if(!wantsResult) {
+        dispatch_async(SPAgentWorkQueue(agent), ^{
+            work();
+        });
+        return nil;
+    }
+    SPTaskCompletionSource *source = [SPTaskCompletionSource new];
+    dispatch_async(SPAgentWorkQueue(agent), ^{
+        [source completeWithValue:work()];
+    });
+    return source.task;
+}
+
+/// Sends a message that returns nothing through 'proxy', keeping its task if the mailbox gave one.
+static void SPAgentSendVoid(SPA_NS(AgentProxy) *proxy, SEL selector, id(^work)(void))
+{
+    SPTask *task = SPAgentSend(proxy->_agent, proxy->_mailbox, proxy->_priority, selector, NO, work);
+    if(task)
+        proxy.sp_agentLastTask = task;
+}
+
+/// The part of an Objective-C type encoding after any method qualifiers (const, in, out...).
+static const char *SPAgentUnqualifiedType(const char *type)
+{
+    while(*type && strchr("rnNoORV", *type))
+        type++;
+    return type;
+}
+
+/// Builds the proxy method for an agent method taking 'argumentCount' objects, or returns nil.
+static id SPAgentProxyTrampoline(SEL sel, IMP imp, NSUInteger argumentCount, BOOL returnsObject)
+{
+    switch(argumentCount) {
+        case 0:
+            if(returnsObject) return ^id(SPA_NS(AgentProxy) *proxy) {
+                id agent = proxy->_agent;
+                return SPAgentSend(agent, proxy->_mailbox, proxy->_priority, sel, YES, ^id{ return ((id(*)(id, SEL))imp)(agent, sel); });
+            };
+            return ^(SPA_NS(AgentProxy) *proxy) {
+                id agent = proxy->_agent;
+                SPAgentSendVoid(proxy, sel, ^id{ ((void(*)(id, SEL))imp)(agent, sel); return nil; });
+            };
+        case 1:
+            if(returnsObject) return ^id(SPA_NS(AgentProxy) *proxy, id a) {
+                id agent = proxy->_agent;
+                return SPAgentSend(agent, proxy->_mailbox, proxy->_priority, sel, YES, ^id{ return ((id(*)(id, SEL, id))imp)(agent, sel, a); });
+            };
+            return ^(SPA_NS(AgentProxy) *proxy, id a) {
+                id agent = proxy->_agent;
+                SPAgentSendVoid(proxy, sel, ^id{ ((void(*)(id, SEL, id))imp)(agent, sel, a); return nil; });
+            };
+        case 2:
+            if(returnsObject) return ^id(SPA_NS(AgentProxy) *proxy, id a, id b) {
+                id agent = proxy->_agent;
+                return SPAgentSend(agent, proxy->_mailbox, proxy->_priority, sel, YES, ^id{ return ((id(*)(id, SEL, id, id))imp)(agent, sel, a, b); });
+            };
+            return ^(SPA_NS(AgentProxy) *proxy, id a, id b) {
+                id agent = proxy->_agent;
+                SPAgentSendVoid(proxy, sel, ^id{ ((void(*)(id, SEL, id, id))imp)(agent, sel, a, b); return nil; });
+            };
+        case 3:
+            if(returnsObject) return ^id(SPA_NS(AgentProxy) *proxy, id a, id b, id c) {
+                id agent = proxy->_agent;
+                return SPAgentSend(agent, proxy->_mailbox, proxy->_priority, sel, YES, ^id{ return ((id(*)(id, SEL, id, id, id))imp)(agent, sel, a, b, c); });
+            };
+            return ^(SPA_NS(AgentProxy) *proxy, id a, id b, id c) {
+                id agent = proxy->_agent;
+                SPAgentSendVoid(proxy, sel, ^id{ ((void(*)(id, SEL, id, id, id))imp)(agent, sel, a, b, c); return nil; });
+            };
+        default:
+            return nil;
+    }
+}
+
+@implementation SPA_NS(AgentProxy)
+
++ (Class)proxyClassForAgentClass:(Class)agentClass hasMailbox:(BOOL*)hasMailbox
+{
+    if(agentClass == tLastAgentClass) {
+        *hasMailbox = tLastHasMailbox;
+        return tLastProxyClass;
+    }
+
+    pthread_mutex_lock(&gProxyClassesLock);
+    if(!gProxyClasses)
+        gProxyClasses = [NSMutableDictionary new];
+    NSValue *key = [NSValue valueWithPointer:(__bridge void*)agentClass];
+    Class proxyClass = gProxyClasses[key];
+    if(!proxyClass) {
+        NSString *name = [NSString stringWithFormat:@"%@_%s", NSStringFromClass(self), class_getName(agentClass)];
+        proxyClass = objc_allocateClassPair(self, name.UTF8String, 0);
+        if(proxyClass) {
+            objc_setAssociatedObject(proxyClass, &SPAgentProxyAgentClassKey, agentClass, OBJC_ASSOCIATION_ASSIGN);
+            objc_registerClassPair(proxyClass);
+        } else {
+            // Name taken (say, by a class of the same name in another image); everything will
+            // just take the forwarding path.
+            proxyClass = self;
+        }
+        gProxyClasses[key] = proxyClass;
+    }
+    pthread_mutex_unlock(&gProxyClassesLock);
+
+    tLastAgentClass = agentClass;
+    tLastProxyClass = proxyClass;
+    tLastHasMailbox = *hasMailbox = [agentClass instancesRespondToSelector:@selector(mailbox)];
+    return proxyClass;
+}
+
++ (BOOL)resolveInstanceMethod:(SEL)sel
+{
+    Class agentClass = objc_getAssociatedObject(self, &SPAgentProxyAgentClassKey);
+    Method method = agentClass ? class_getInstanceMethod(agentClass, sel) : NULL;
+    if(!method)
+        return NO;
+
+    NSMethodSignature *signature = [NSMethodSignature signatureWithObjCTypes:method_getTypeEncoding(method)];
+    NSUInteger argumentCount = signature.numberOfArguments - 2;
+    if(argumentCount > SPAgentProxyFastArgumentLimit)
+        return NO;
+    for(NSUInteger i = 0; i < argumentCount; i++)
+        if(strcmp(SPAgentUnqualifiedType([signature getArgumentTypeAtIndex:i + 2]), @encode(id)) != 0)
+            return NO; // Blocks ("@?") are left to NSInvocation, which copies them.
+
+    const char *returnType = SPAgentUnqualifiedType(signature.methodReturnType);
+    BOOL returnsObject = strcmp(returnType, @encode(id)) == 0;
+    if(!returnsObject && strcmp(returnType, @encode(void)) != 0)
+        return NO;
+
+    // The proxy's version returns a task instead of what the agent returns, which is an object
+    // all the same. If another thread got here first, its method is just as good.
+    id trampoline = SPAgentProxyTrampoline(sel, method_getImplementation(method), argumentCount, returnsObject);
+    IMP imp = imp_implementationWithBlock(trampoline);
+    if(!class_addMethod(self, sel, imp, method_getTypeEncoding(method)))
+        imp_removeBlock(imp);
+    return YES;
+}
+
+- (NSMethodSignature *)methodSignatureForSelector:(SEL)sel
+{
+    return [_agent methodSignatureForSelector:sel];
+}
+
+- (void)forwardInvocation:(NSInvocation *)invocation
+{
+    // Run a copy, so that the agent's return value can't overwrite the task we return to the
+    // caller before the runtime has read it out of 'invocation'.
+    NSMethodSignature *signature = invocation.methodSignature;
+    NSInvocation *call = [NSInvocation invocationWithMethodSignature:signature];
+    call.target = _agent;
+    call.selector = invocation.selector;
+    for(NSUInteger i = 2; i < signature.numberOfArguments; i++) {
+        NSUInteger size;
+        NSGetSizeAndAlignment([signature getArgumentTypeAtIndex:i], &size, NULL);
+        void *argument = alloca(size);
+        [invocation getArgument:argument atIndex:i];
+        [call setArgument:argument atIndex:i];
+    }
+    [call retainArguments];
+
+    if(strcmp(SPAgentUnqualifiedType(signature.methodReturnType), @encode(id)) == 0) {
+        // Autoreleased, so that it outlives this method for the caller to retain.
+        __autoreleasing SPTask *task = SPAgentSend(_agent, _mailbox, _priority, call.selector, YES, ^id{
+            [call invoke];
+            __unsafe_unretained id result = nil;
+            [call getReturnValue:&result];
+            return result;
+        });
+        [invocation setReturnValue:&task];
+    } else {
+        SPAgentSendVoid(self, call.selector, ^id{
+            [call invoke];
+            return nil;
+        });
+    }
+}
+@end
 
 @implementation NSObject (SPAgentDo)
+- (SPA_NS(Task)*)sp_agentLastTask
+{
+    return nil;
+}
+
 - (instancetype)sp_agentAsync
 {
-    SPInvocationGrabber *grabber = [self grabWithoutStacktrace];
-    __weak SPInvocationGrabber *weakGrabber = grabber;
-    
-    SPTaskCompletionSource *completionSource = [SPTaskCompletionSource new];
-    SPTask *task = completionSource.task;
-    __block void *unsafeTask = (__bridge void *)(task);
-    
-    grabber.afterForwardInvocation = ^{
-        NSInvocation *invocation = [weakGrabber invocation];
-        
-        // Let the caller get the result of the invocation as a task.
-        // Block guarantees lifetime of 'task', so just bridge it here.
-        BOOL hasObjectReturn = strcmp([invocation.methodSignature methodReturnType], @encode(id)) == 0;
-        if(hasObjectReturn)
-            [invocation setReturnValue:&unsafeTask];
-        
-        dispatch_async([(id)self workQueue], ^{
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Warc-retain-cycles"
-            // "invoke" will break the cycle, and the block must hold on to grabber
-            // until this moment so that it survives (nothing else is holding the grabber)
-            [grabber invoke];
-#pragma clang diagnostic pop
-            if(hasObjectReturn) {
-                __unsafe_unretained id result = nil;
-                [invocation getReturnValue:&result];
-                [completionSource completeWithValue:result];
-            }
-        });
-    };
-    return grabber;
+    return [self sp_agentAsyncWithPriority:SPAgentPriorityNormal];
+}
+
+- (instancetype)sp_agentAsyncWithPriority:(SPAgentPriority)priority
+{
+    BOOL hasMailbox;
+    Class proxyClass = [SPA_NS(AgentProxy) proxyClassForAgentClass:object_getClass(self) hasMailbox:&hasMailbox];
+    SPA_NS(AgentProxy) *proxy = [proxyClass alloc];
+    proxy->_agent = self;
+    proxy->_mailbox = hasMailbox ? [(id<SPAgent>)self mailbox] : nil;
+    proxy->_priority = priority;
+    return (id)proxy;
 }
 
-@end
\ No newline at end of file
+- (SPA_NS(Task)*)sp_agentPerform:(SPAgentPerformCallback)work
+{
+    return [self sp_agentPerform:work priority:SPAgentPriorityNormal];
+}
+
+- (SPA_NS(Task)*)sp_agentPerform:(SPAgentPerformCallback)work priority:(SPAgentPriority)priority
+{
+    NSParameterAssert(work);
+    SPA_NS(AgentMailbox) *mailbox = [self respondsToSelector:@selector(mailbox)] ? [(id<SPAgent>)self mailbox] : nil;
+    return SPAgentSend(self, mailbox, priority, NULL, YES, ^id{
+        return work(self);
+    });
+}
+@end
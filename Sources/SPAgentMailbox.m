@@ -0,0 +1,345 @@
+//
+//  SPAgentMailbox.m
+//  SPAsync
+//
+
+#import <SPAsync/SPAgentMailbox.h>
+#import <SPAsync/SPTask.h>
+#import "SPAsyncClock.h"
+#include <pthread.h>
+
+#define SPAgentPriorityCount (SPAgentPriorityHigh + 1)
+#define SPAgentMailboxDrainBatch 16
+#define SPAgentMailboxRateWindow NSEC_PER_SEC
+
+NSString *const SPA_NS(AgentErrorDomain) = @"SPAgentErrorDomain";
+
+/*
+    A message whose selector coalesces can end up sent by several senders. Each of them gets a
+    task of its own, which only follows the message's through callbacks, so that one sender
+    cancelling doesn't cancel the call for the others; the message counts them, and once the
+    last one has cancelled before the message started, the message is cancelled too, and
+    skipped. Messages that don't coalesce only ever have the one sender, who gets the
+    message's own task.
+*/
+
+@interface SPA_NS(AgentMessage) : NSObject
+{
+@public
+    SPAgentMessageCallback _work;
+    SPA_NS(TaskCompletionSource) *_source;
+    SEL _selector;
+    SPAgentPriority _priority;
+    NSUInteger _senders; // of a coalescing message, those who haven't cancelled
+    BOOL _started;
+}
+@end
+@implementation SPA_NS(AgentMessage)
+@end
+
+static NSError *SPAgentMailboxError(SPAgentErrorCode code)
+{
+    return [NSError errorWithDomain:SPA_NS(AgentErrorDomain) code:code userInfo:@{
+        NSLocalizedDescriptionKey: code == SPAgentErrorMailboxFull ? @"The agent's mailbox is full." : @"The message was dropped from the agent's full mailbox.",
+    }];
+}
+
+@implementation SPA_NS(AgentMailbox)
+{
+    pthread_mutex_t _lock;
+    dispatch_queue_t _queue;
+    NSMutableArray *_lanes[SPAgentPriorityCount]; // of SPAgentMessage, oldest first
+    NSUInteger _depth;
+    NSMutableArray *_waiting; // held back by backpressure, oldest first; no more than _capacity
+    NSMutableSet *_coalescedSelectors;
+    NSMutableDictionary *_pendingBySelector; // coalesced selector name -> message not yet started
+    BOOL _draining;
+    NSUInteger _processedCount, _rejectedCount, _droppedCount, _coalescedCount;
+    uint64_t _rateWindowStart;
+    NSUInteger _rateWindowCount;
+    double _drainRate;
+}
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue capacity:(NSUInteger)capacity overflow:(SPAgentMailboxOverflow)overflow
+{
+    NSParameterAssert(queue);
+    NSParameterAssert(capacity > 0);
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _queue = queue;
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    dispatch_retain(_queue);
+#endif
+    _capacity = capacity;
+    _overflow = overflow;
+    for(int i = 0; i < SPAgentPriorityCount; i++)
+        _lanes[i] = [NSMutableArray new];
+    _waiting = [NSMutableArray new];
+    _coalescedSelectors = [NSMutableSet new];
+    _pendingBySelector = [NSMutableDictionary new];
+    _rateWindowStart = SPAsyncMonotonicNanoseconds();
+    return self;
+}
+
+- (void)dealloc
+{
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    dispatch_release(_queue);
+#endif
+    pthread_mutex_destroy(&_lock);
+}
+
+- (dispatch_queue_t)queue
+{
+    return _queue;
+}
+
+- (void)coalesceSelector:(SEL)selector
+{
+    NSParameterAssert(selector);
+    pthread_mutex_lock(&_lock);
+    [_coalescedSelectors addObject:NSStringFromSelector(selector)];
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark Sending
+
+- (SPA_NS(Task)*)send:(SPAgentMessageCallback)work priority:(SPAgentPriority)priority selector:(SEL)selector
+{
+    NSParameterAssert(work);
+    NSParameterAssert(priority >= SPAgentPriorityLow && priority <= SPAgentPriorityHigh);
+    SPA_NS(AgentMessage) *dropped = nil;
+
+    pthread_mutex_lock(&_lock);
+    NSString *selectorName = selector && _coalescedSelectors.count ? NSStringFromSelector(selector) : nil;
+    if(selectorName && ![_coalescedSelectors containsObject:selectorName])
+        selectorName = nil;
+
+    SPA_NS(AgentMessage) *pending = selectorName ? _pendingBySelector[selectorName] : nil;
+    if(pending) {
+        // Take the waiting message's place in line, with the newer arguments.
+        pending->_work = work;
+        pending->_senders++;
+        _coalescedCount++;
+        pthread_mutex_unlock(&_lock);
+        return [self senderTaskForMessage:pending];
+    }
+
+    SPA_NS(AgentMessage) *message = [SPA_NS(AgentMessage) new];
+    message->_work = work;
+    message->_source = [SPA_NS(TaskCompletionSource) new];
+    message->_selector = selector;
+    message->_priority = priority;
+
+    if(_depth >= _capacity) {
+        BOOL reject = _overflow == SPAgentMailboxOverflowReject;
+        if(_overflow == SPAgentMailboxOverflowDropOldest)
+            dropped = [self dropOldest];
+        else if(_overflow == SPAgentMailboxOverflowBackpressure && _waiting.count >= _capacity)
+            reject = YES; // holding back more than a mailbox's worth only hides the problem
+        if(reject) {
+            _rejectedCount++;
+            pthread_mutex_unlock(&_lock);
+            [message->_source failWithError:SPAgentMailboxError(SPAgentErrorMailboxFull)];
+            return message->_source.task;
+        }
+    }
+
+    BOOL shouldDrain = NO;
+    if(_depth >= _capacity) {
+        [_waiting addObject:message];
+    } else {
+        [self admit:message];
+        shouldDrain = !_draining;
+        _draining = YES;
+    }
+    if(selectorName) {
+        _pendingBySelector[selectorName] = message;
+        message->_senders = 1;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    [dropped->_source failWithError:SPAgentMailboxError(SPAgentErrorMessageDropped)];
+    if(shouldDrain)
+        [self scheduleDrain];
+    return selectorName ? [self senderTaskForMessage:message] : message->_source.task;
+}
+
+/// A task for one of the senders of a coalescing message.
+- (SPA_NS(Task)*)senderTaskForMessage:(SPA_NS(AgentMessage)*)message
+{
+    SPA_NS(Task) *call = message->_source.task;
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *sender = source.task;
+    dispatch_queue_t inlineQueue = [SPA_NS(Task) inlineQueue];
+
+    [call addCallback:^(id value) {
+        [source completeWithValue:value];
+    } on:inlineQueue];
+    [call addErrorCallback:^(NSError *error) {
+        [source failWithError:error];
+    } on:inlineQueue];
+    [call addFinallyCallback:^(BOOL cancelled) {
+        if(cancelled)
+            [sender cancel];
+    } on:inlineQueue];
+    [source addCancellationCallback:^{
+        [self abandonMessage:message];
+    }];
+    return sender;
+}
+
+/// One of the senders of a coalescing message has cancelled.
+- (void)abandonMessage:(SPA_NS(AgentMessage)*)message
+{
+    pthread_mutex_lock(&_lock);
+    BOOL lastOne = !message->_started && message->_senders > 0 && --message->_senders == 0;
+    if(lastOne)
+        [self forgetPending:message]; // so that nobody else joins it; it's skipped once its turn comes
+    pthread_mutex_unlock(&_lock);
+
+    if(lastOne)
+        [message->_source.task cancel];
+}
+
+#pragma mark Lanes (all with _lock held)
+
+- (void)admit:(SPA_NS(AgentMessage)*)message
+{
+    [_lanes[message->_priority] addObject:message];
+    _depth++;
+}
+
+/// Removes and returns the oldest message of the lowest priority there is.
+- (SPA_NS(AgentMessage)*)dropOldest
+{
+    for(int i = 0; i < SPAgentPriorityCount; i++) {
+        if(!_lanes[i].count)
+            continue;
+        SPA_NS(AgentMessage) *message = _lanes[i][0];
+        [_lanes[i] removeObjectAtIndex:0];
+        _depth--;
+        [self forgetPending:message];
+        _droppedCount++;
+        return message;
+    }
+    return nil;
+}
+
+/// Removes and returns the message to run next, letting a held back one in to take its place.
+- (SPA_NS(AgentMessage)*)takeNext
+{
+    for(int i = SPAgentPriorityCount - 1; i >= 0; i--) {
+        if(!_lanes[i].count)
+            continue;
+        SPA_NS(AgentMessage) *message = _lanes[i][0];
+        [_lanes[i] removeObjectAtIndex:0];
+        _depth--;
+        [self forgetPending:message];
+        message->_started = YES;
+        if(_waiting.count) {
+            [self admit:_waiting[0]];
+            [_waiting removeObjectAtIndex:0];
+        }
+        return message;
+    }
+    return nil;
+}
+
+/// Once a message is on its way out, newer ones with its selector need a message of their own.
+- (void)forgetPending:(SPA_NS(AgentMessage)*)message
+{
+    if(!message->_selector || !_pendingBySelector.count)
+        return;
+    NSString *selectorName = NSStringFromSelector(message->_selector);
+    if(_pendingBySelector[selectorName] == message)
+        [_pendingBySelector removeObjectForKey:selectorName];
+}
+
+- (void)countProcessed
+{
+    _processedCount++;
+    _rateWindowCount++;
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    if(now - _rateWindowStart >= SPAgentMailboxRateWindow) {
+        _drainRate = _rateWindowCount / ((now - _rateWindowStart) / (double)NSEC_PER_SEC);
+        _rateWindowStart = now;
+        _rateWindowCount = 0;
+    }
+}
+
+#pragma mark Draining
+
+- (void)scheduleDrain
+{
+    dispatch_async(_queue, ^{
+        [self drain];
+    });
+}
+
+- (void)drain
+{
+    for(int i = 0; i < SPAgentMailboxDrainBatch; i++) {
+        pthread_mutex_lock(&_lock);
+        SPA_NS(AgentMessage) *message = [self takeNext];
+        if(!message) {
+            _draining = NO;
+            pthread_mutex_unlock(&_lock);
+            return;
+        }
+        SPAgentMessageCallback work = message->_work;
+        pthread_mutex_unlock(&_lock);
+
+        if(!message->_source.task.cancelled) {
+            @autoreleasepool {
+                [message->_source completeWithValue:work()];
+            }
+        }
+
+        pthread_mutex_lock(&_lock);
+        [self countProcessed];
+        pthread_mutex_unlock(&_lock);
+    }
+    // Let whatever else is on the queue have a go before we carry on.
+    [self scheduleDrain];
+}
+
+#pragma mark Metrics
+
+#define SPAgentMailboxLockedGetter(type, name, ivar) \
+- (type)name \
+{ \
+    pthread_mutex_lock(&_lock); \
+    type value = ivar; \
+    pthread_mutex_unlock(&_lock); \
+    return value; \
+}
+
+SPAgentMailboxLockedGetter(NSUInteger, depth, _depth)
+SPAgentMailboxLockedGetter(NSUInteger, waitingCount, _waiting.count)
+SPAgentMailboxLockedGetter(NSUInteger, processedCount, _processedCount)
+SPAgentMailboxLockedGetter(NSUInteger, rejectedCount, _rejectedCount)
+SPAgentMailboxLockedGetter(NSUInteger, droppedCount, _droppedCount)
+SPAgentMailboxLockedGetter(NSUInteger, coalescedCount, _coalescedCount)
+
+- (NSUInteger)depthForPriority:(SPAgentPriority)priority
+{
+    NSParameterAssert(priority >= SPAgentPriorityLow && priority <= SPAgentPriorityHigh);
+    pthread_mutex_lock(&_lock);
+    NSUInteger depth = _lanes[priority].count;
+    pthread_mutex_unlock(&_lock);
+    return depth;
+}
+
+- (double)drainRate
+{
+    pthread_mutex_lock(&_lock);
+    // A window that's run long is one where the agent has gone quiet; let the rate show it.
+    uint64_t elapsed = SPAsyncMonotonicNanoseconds() - _rateWindowStart;
+    double rate = elapsed >= SPAgentMailboxRateWindow ? _rateWindowCount / (elapsed / (double)NSEC_PER_SEC) : _drainRate;
+    pthread_mutex_unlock(&_lock);
+    return rate;
+}
+
+@end
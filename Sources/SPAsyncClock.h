@@ -0,0 +1,17 @@
+//
+//  SPAsyncClock.h
+//  SPAsync
+//
+//  Private to SPAsync; not part of the public headers.
+
+#import <Foundation/Foundation.h>
+#include <time.h>
+
+/// Nanoseconds on the monotonic clock, which keeps counting through changes to the wall clock;
+/// what all of SPAsync's timeouts, deadlines and timestamps are measured in.
+static inline uint64_t SPAsyncMonotonicNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
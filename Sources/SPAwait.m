@@ -6,7 +6,9 @@
     SPAwaitCoroutineBody _body;
     SPTaskCompletionSource *_source;
     id _yieldedValue;
+    NSError *_failure; // set when an awaited task fails while the body is running
     BOOL _completed;
+    dispatch_queue_t _queue; // from queueFor:, at the first await that had to wait
 }
 - (id)init
 {
@@ -15,10 +17,17 @@
     _source = [SPTaskCompletionSource new];
     
     // We need to live until the coroutine is complete
-    CFRetain((__bridge CFTypeRef)(self));
+    (void)(__bridge_retained void *)self;
     
     return self;
 }
+- (void)dealloc
+{
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    if(_queue)
+        dispatch_release(_queue);
+#endif
+}
 - (void)setBody:(SPAwaitCoroutineBody)body;
 {
     _body = [body copy];
@@ -27,6 +36,10 @@
 - (void)resumeAt:(int)line
 {
     id ret = _body(line);
+    if(_failure) {
+        [self failWithError:_failure];
+        return;
+    }
     if(ret == [SPAwaitCoroutine awaitSentinel])
         return;
     
@@ -34,6 +47,38 @@
     [self finish];
 }
 
+- (BOOL)await:(SPTask*)task for:(id)object resumeAt:(int)line
+{
+    id value;
+    NSError *error;
+    if([task getCompletedValue:&value error:&error]) {
+        if(error) {
+            // Stop the body where it is; resumeAt: fails us once it has returned.
+            _failure = error;
+            return NO;
+        }
+        _lastAwaitedValue = value;
+        return YES;
+    }
+
+    if(!_queue) {
+        _queue = [self queueFor:object];
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+        dispatch_retain(_queue);
+#endif
+    }
+    dispatch_queue_t queue = _queue;
+    __weak SPAwaitCoroutine *weakSelf = self;
+    [task addCallback:^(id value) {
+        weakSelf.lastAwaitedValue = value;
+        [weakSelf resumeAt:line];
+    } on:queue];
+    [task addErrorCallback:^(NSError *error) {
+        [weakSelf failWithError:error];
+    } on:queue];
+    return NO;
+}
+
 + (id)awaitSentinel
 {
     static id sentinel;
@@ -51,7 +96,15 @@
     [_source completeWithValue:_yieldedValue];
     
     // The coroutine is complete. We can remove it now.
-    CFRelease((__bridge CFTypeRef)(self));
+    (void)(__bridge_transfer id)(__bridge void *)self;
+}
+
+- (void)failWithError:(NSError*)error
+{
+    NSAssert(!_completed, @"Didn't expect to complete twice");
+    _completed = YES;
+    [_source failWithError:error];
+    (void)(__bridge_transfer id)(__bridge void *)self;
 }
 
 - (void)yieldValue:(id)value
@@ -73,4 +126,4 @@
     return dispatch_get_global_queue(0, 0);
 }
 
-@end
\ No newline at end of file
+@end
@@ -0,0 +1,250 @@
+//
+//  SPExecutor.m
+//  SPAsync
+//
+
+#import <SPAsync/SPExecutor.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+@implementation SPA_NS(DispatchExecutor)
++ (instancetype)executorWithQueue:(dispatch_queue_t)queue
+{
+    return [[self alloc] initWithQueue:queue];
+}
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue
+{
+    NSParameterAssert(queue);
+    if(!(self = [super init]))
+        return nil;
+    _queue = queue;
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    dispatch_retain(queue);
+#endif
+    return self;
+}
+
+#if !OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+- (void)dealloc
+{
+    dispatch_release(_queue);
+}
+#endif
+
+- (void)execute:(dispatch_block_t)block
+{
+    dispatch_async(_queue, block);
+}
+@end
+
+#pragma mark Thread pool
+
+#define SPThreadPoolLIFOLimit 16 // LIFO slot runs in a row before it's made stealable
+#define SPThreadPoolInjectionInterval 61 // iterations between checks of the injection queue first
+
+/// Double-ended queue of retained blocks.
+typedef struct {
+    pthread_mutex_t lock;
+    void **items;
+    size_t head, count, capacity;
+} SPThreadPoolDeque;
+
+static void SPThreadPoolDequeInit(SPThreadPoolDeque *deque)
+{
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->capacity = 64;
+    deque->items = malloc(deque->capacity * sizeof(void*));
+    deque->head = deque->count = 0;
+}
+
+static void SPThreadPoolDequePushBack(SPThreadPoolDeque *deque, void *item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity) {
+        void **items = malloc(deque->capacity * 2 * sizeof(void*));
+        for(size_t i = 0; i < deque->count; i++)
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = item;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static void *SPThreadPoolDequePopBack(SPThreadPoolDeque *deque)
+{
+    void *item = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        deque->count--;
+        item = deque->items[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+static void *SPThreadPoolDequePopFront(SPThreadPoolDeque *deque)
+{
+    void *item = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        item = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+typedef struct {
+    SPThreadPoolDeque deque;
+    void *lifoSlot; // retained block; only ever touched by the worker itself
+    unsigned lifoStreak;
+    unsigned index;
+    void *pool; // unretained SPThreadPool
+} SPThreadPoolWorker;
+
+static __thread SPThreadPoolWorker *tCurrentWorker;
+
+@interface SPA_NS(ThreadPool) ()
+{
+    SPThreadPoolWorker *_workers;
+    SPThreadPoolDeque _injected;
+    // Stealable blocks: those in the deques and the injection queue, but not in LIFO slots.
+    atomic_long _pending;
+    atomic_uint _sleepers;
+    pthread_mutex_t _sleepLock;
+    pthread_cond_t _wake;
+}
+@end
+
+static void *SPThreadPoolWorkerMain(void *context);
+
+@implementation SPA_NS(ThreadPool)
++ (instancetype)sharedPool
+{
+    static SPA_NS(ThreadPool) *sharedPool;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedPool = [[self alloc] initWithThreadCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+    });
+    return sharedPool;
+}
+
+- (instancetype)initWithThreadCount:(NSUInteger)threadCount
+{
+    NSParameterAssert(threadCount > 0);
+    if(!(self = [super init]))
+        return nil;
+    _threadCount = threadCount;
+    SPThreadPoolDequeInit(&_injected);
+    atomic_init(&_pending, 0);
+    atomic_init(&_sleepers, 0);
+    pthread_mutex_init(&_sleepLock, NULL);
+    pthread_cond_init(&_wake, NULL);
+
+    _workers = calloc(threadCount, sizeof(SPThreadPoolWorker));
+    for(NSUInteger i = 0; i < threadCount; i++) {
+        SPThreadPoolWorker *worker = &_workers[i];
+        SPThreadPoolDequeInit(&worker->deque);
+        worker->index = (unsigned)i;
+        // Each worker keeps the pool alive for good.
+        worker->pool = (__bridge_retained void*)self;
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, SPThreadPoolWorkerMain, worker);
+        pthread_detach(thread);
+    }
+    return self;
+}
+
+- (void)execute:(dispatch_block_t)block
+{
+    void *item = (__bridge_retained void*)[block copy];
+    SPThreadPoolWorker *worker = tCurrentWorker;
+
+    if(worker && worker->pool == (__bridge void*)self) {
+        // Run it next on this worker, and let others steal whatever it displaces.
+        void *displaced = worker->lifoSlot;
+        worker->lifoSlot = item;
+        if(!displaced)
+            return;
+        SPThreadPoolDequePushBack(&worker->deque, displaced);
+    } else {
+        SPThreadPoolDequePushBack(&_injected, item);
+    }
+
+    atomic_fetch_add(&_pending, 1);
+    if(atomic_load(&_sleepers) > 0) {
+        pthread_mutex_lock(&_sleepLock);
+        pthread_cond_signal(&_wake);
+        pthread_mutex_unlock(&_sleepLock);
+    }
+}
+
+/// Finds the next block for 'worker' to run, or NULL if there's nothing to do anywhere.
+- (void *)nextItemForWorker:(SPThreadPoolWorker*)worker iteration:(unsigned)iteration
+{
+    if(worker->lifoSlot) {
+        void *item = worker->lifoSlot;
+        worker->lifoSlot = NULL;
+        if(++worker->lifoStreak <= SPThreadPoolLIFOLimit)
+            return item;
+        // A worker that keeps rescheduling onto itself has to share eventually.
+        SPThreadPoolDequePushBack(&worker->deque, item);
+        atomic_fetch_add(&_pending, 1);
+    }
+    worker->lifoStreak = 0;
+
+    void *item = NULL;
+    // Now and then, look at the injection queue first, so that work from outside the pool
+    // isn't starved by work that the pool keeps generating for itself.
+    if(iteration % SPThreadPoolInjectionInterval == 0)
+        item = SPThreadPoolDequePopFront(&_injected);
+    if(!item)
+        item = SPThreadPoolDequePopBack(&worker->deque);
+    if(!item)
+        item = SPThreadPoolDequePopFront(&_injected);
+    for(NSUInteger i = 1; !item && i < _threadCount; i++)
+        item = SPThreadPoolDequePopFront(&_workers[(worker->index + i) % _threadCount].deque);
+
+    if(item)
+        atomic_fetch_sub(&_pending, 1);
+    return item;
+}
+
+- (void)sleep
+{
+    pthread_mutex_lock(&_sleepLock);
+    atomic_fetch_add(&_sleepers, 1);
+    // Either execute: sees us as a sleeper and signals, or we see its block as pending.
+    while(atomic_load(&_pending) == 0)
+        pthread_cond_wait(&_wake, &_sleepLock);
+    atomic_fetch_sub(&_sleepers, 1);
+    pthread_mutex_unlock(&_sleepLock);
+}
+@end
+
+static void *SPThreadPoolWorkerMain(void *context)
+{
+    SPThreadPoolWorker *worker = context;
+    SPA_NS(ThreadPool) *pool = (__bridge SPA_NS(ThreadPool)*)worker->pool;
+    tCurrentWorker = worker;
+
+    for(unsigned iteration = 1;; iteration++) {
+        void *item = [pool nextItemForWorker:worker iteration:iteration];
+        if(!item) {
+            [pool sleep];
+            continue;
+        }
+        @autoreleasepool {
+            dispatch_block_t block = (__bridge_transfer dispatch_block_t)item;
+            block();
+        }
+    }
+    return NULL;
+}
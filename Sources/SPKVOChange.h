@@ -0,0 +1,18 @@
+//
+//  SPKVOChange.h
+//  SPAsync
+//
+//  Private to SPAsync; not part of the public headers.
+
+#import <Foundation/Foundation.h>
+
+/// The value at `keyPath` that a KVO notification reports, with NSNull turned back into nil.
+/// The new value comes with the notification when the property was set; changes to the
+/// contents of a collection only come with the objects that changed, so ask for those.
+static inline id SPKVOChangedValue(NSDictionary *change, id object, NSString *keyPath)
+{
+    if([change[NSKeyValueChangeKindKey] unsignedIntegerValue] != NSKeyValueChangeSetting)
+        return [object valueForKeyPath:keyPath];
+    id value = change[NSKeyValueChangeNewKey];
+    return value == [NSNull null] ? nil : value;
+}
@@ -1,4 +1,5 @@
 #import "SPKVOTask.h"
+#import "SPKVOChange.h"
 
 static void *kContext = &kContext;
 
@@ -18,7 +19,7 @@ static void *kContext = &kContext;
 	[source.task addFinallyCallback:^(BOOL cancelled) {
 		[object removeObserver:container forKeyPath:keyPath context:kContext];
 	}];
-	[object addObserver:container forKeyPath:keyPath options:NSKeyValueObservingOptionInitial context:kContext];
+	[object addObserver:container forKeyPath:keyPath options:NSKeyValueObservingOptionInitial|NSKeyValueObservingOptionNew context:kContext];
 	return (id)source.task;
 }
 @end
@@ -28,7 +29,7 @@ static void *kContext = &kContext;
 	if(context != kContext)
 		return [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
 	
-	id newValue = [object valueForKeyPath:keyPath];
+	id newValue = SPKVOChangedValue(change, object, keyPath);
 	if([newValue isEqual:self.value])
 		[self.source completeWithValue:newValue];
 }
@@ -0,0 +1,744 @@
+//
+//  SPStream.m
+//  SPAsync
+//
+
+#import <SPAsync/SPStream.h>
+#import <SPAsync/SPExecutor.h>
+#import "SPTaskTimer.h"
+#import "SPAsyncClock.h"
+#import "SPKVOChange.h"
+#include <pthread.h>
+
+/*
+    A stream keeps an immutable array of its subscriptions, replaced whenever somebody
+    subscribes or cancels, so that sending a value only takes the stream's lock for long
+    enough to grab the array.
+
+    Each subscription has its own lock, buffer and demand. Whenever there's something in the
+    buffer that the subscriber has asked for (and nothing's scheduled already), one drain is
+    scheduled on the subscriber's queue, which delivers everything it can before giving the
+    queue back; values sent in the meantime simply go in the buffer.
+
+    Operators subscribe to the receiver synchronously: their subscriptions have no queue and
+    no buffer, and run the operator right on the sending thread, which sends on to the derived
+    stream. Only the subscribers at the end of the line buffer anything.
+*/
+
+#define SPStreamDefaultBufferLimit 64
+#define SPStreamDeliveryBatch 64 // values delivered per drain before yielding the queue
+
+/// Something a derived stream keeps going while it's alive, and stops when it goes away.
+@protocol SPA_NS(StreamUpstream) <NSObject>
+- (void)cancel;
+@end
+
+@interface SPA_NS(Stream) ()
+{
+    pthread_mutex_t _lock;
+    NSArray *_subscriptions;
+    BOOL _finished;
+    NSError *_error;
+    @public
+    id<SPA_NS(StreamUpstream)> _upstream;
+}
+- (BOOL)send:(id)value;
+- (void)finishWithError:(NSError*)error;
+- (NSUInteger)demand;
+- (void)addSubscription:(SPA_NS(StreamSubscription)*)subscription;
+- (void)removeSubscription:(SPA_NS(StreamSubscription)*)subscription;
+@end
+
+@interface SPA_NS(StreamSubscription) () <SPA_NS(StreamUpstream)>
+{
+    pthread_mutex_t _lock;
+    SPA_NS(Stream) *_stream; // until cancelled or finished
+    SPA_NS(DispatchExecutor) *_executor; // nil for synchronous delivery, without buffering
+    SPStreamValueCallback _onValue;
+    SPStreamFinishedCallback _onFinished;
+    NSMutableArray *_buffer;
+    NSUInteger _bufferLimit;
+    SPStreamOverflow _overflow;
+    BOOL _manualDemand;
+    NSUInteger _demand;
+    BOOL _scheduled, _finished, _cancelled;
+    NSError *_error;
+    NSUInteger _droppedCount;
+    @public
+    __weak SPA_NS(Stream) *_downstream; // for synchronous subscriptions of operators
+}
+- (instancetype)initWithStream:(SPA_NS(Stream)*)stream queue:(dispatch_queue_t)queue onValue:(SPStreamValueCallback)onValue onFinished:(SPStreamFinishedCallback)onFinished bufferLimit:(NSUInteger)bufferLimit overflow:(SPStreamOverflow)overflow manualDemand:(BOOL)manualDemand;
+- (BOOL)enqueue:(id)value;
+- (void)finishWithError:(NSError*)error;
+- (NSUInteger)room;
+@end
+
+#pragma mark Stream
+
+@implementation SPA_NS(Stream)
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _subscriptions = @[];
+    return self;
+}
+
+- (void)dealloc
+{
+    [_upstream cancel];
+    pthread_mutex_destroy(&_lock);
+}
+
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue on:(dispatch_queue_t)queue
+{
+    return [self subscribe:onValue finished:nil on:queue];
+}
+
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue finished:(SPStreamFinishedCallback)onFinished on:(dispatch_queue_t)queue
+{
+    return [self subscribe:onValue finished:onFinished on:queue bufferLimit:SPStreamDefaultBufferLimit overflow:SPStreamOverflowDropOldest manualDemand:NO];
+}
+
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue finished:(SPStreamFinishedCallback)onFinished on:(dispatch_queue_t)queue bufferLimit:(NSUInteger)bufferLimit overflow:(SPStreamOverflow)overflow manualDemand:(BOOL)manualDemand
+{
+    NSParameterAssert(queue);
+    NSParameterAssert(bufferLimit > 0);
+    SPA_NS(StreamSubscription) *subscription = [[SPA_NS(StreamSubscription) alloc] initWithStream:self queue:queue onValue:onValue onFinished:onFinished bufferLimit:bufferLimit overflow:overflow manualDemand:manualDemand];
+    [self addSubscription:subscription];
+    return subscription;
+}
+
+- (void)addSubscription:(SPA_NS(StreamSubscription)*)subscription
+{
+    pthread_mutex_lock(&_lock);
+    BOOL finished = _finished;
+    NSError *error = _error;
+    if(!finished)
+        _subscriptions = [_subscriptions arrayByAddingObject:subscription];
+    pthread_mutex_unlock(&_lock);
+
+    if(finished)
+        [subscription finishWithError:error];
+}
+
+- (void)removeSubscription:(SPA_NS(StreamSubscription)*)subscription
+{
+    pthread_mutex_lock(&_lock);
+    NSArray *previous = _subscriptions; // let go of after unlocking
+    if([previous indexOfObjectIdenticalTo:subscription] != NSNotFound) {
+        NSMutableArray *subscriptions = [previous mutableCopy];
+        [subscriptions removeObjectIdenticalTo:subscription];
+        _subscriptions = subscriptions;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)send:(id)value
+{
+    if(!value)
+        return YES;
+    pthread_mutex_lock(&_lock);
+    NSArray *subscriptions = _finished ? nil : _subscriptions;
+    pthread_mutex_unlock(&_lock);
+
+    BOOL kept = YES;
+    for(SPA_NS(StreamSubscription) *subscription in subscriptions)
+        kept = [subscription enqueue:value] && kept;
+    return kept;
+}
+
+- (void)finishWithError:(NSError*)error
+{
+    pthread_mutex_lock(&_lock);
+    if(_finished) {
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    _finished = YES;
+    _error = error;
+    NSArray *subscriptions = _subscriptions;
+    _subscriptions = @[];
+    pthread_mutex_unlock(&_lock);
+
+    for(SPA_NS(StreamSubscription) *subscription in subscriptions)
+        [subscription finishWithError:error];
+}
+
+- (NSUInteger)demand
+{
+    pthread_mutex_lock(&_lock);
+    NSArray *subscriptions = _subscriptions;
+    pthread_mutex_unlock(&_lock);
+
+    if(subscriptions.count == 0)
+        return 0;
+    NSUInteger demand = NSUIntegerMax;
+    for(SPA_NS(StreamSubscription) *subscription in subscriptions)
+        demand = MIN(demand, [subscription room]);
+    return demand;
+}
+@end
+
+#pragma mark Subscription
+
+@implementation SPA_NS(StreamSubscription)
+- (instancetype)initWithStream:(SPA_NS(Stream)*)stream queue:(dispatch_queue_t)queue onValue:(SPStreamValueCallback)onValue onFinished:(SPStreamFinishedCallback)onFinished bufferLimit:(NSUInteger)bufferLimit overflow:(SPStreamOverflow)overflow manualDemand:(BOOL)manualDemand
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _stream = stream;
+    _executor = queue ? [SPA_NS(DispatchExecutor) executorWithQueue:queue] : nil;
+    _onValue = [onValue copy];
+    _onFinished = [onFinished copy];
+    _buffer = queue ? [NSMutableArray new] : nil;
+    _bufferLimit = bufferLimit;
+    _overflow = overflow;
+    _manualDemand = manualDemand;
+    _demand = manualDemand ? 0 : NSUIntegerMax;
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+/// Must hold _lock. Returns YES if the caller should schedule a drain.
+- (BOOL)claimDrain
+{
+    if(_scheduled || _cancelled)
+        return NO;
+    if(!(_buffer.count > 0 && _demand > 0) && !(_finished && _buffer.count == 0))
+        return NO;
+    _scheduled = YES;
+    return YES;
+}
+
+- (void)scheduleDrain
+{
+    [_executor execute:^{
+        [self drain];
+    }];
+}
+
+- (BOOL)enqueue:(id)value
+{
+    if(!_executor) {
+        pthread_mutex_lock(&_lock);
+        SPStreamValueCallback onValue = _cancelled ? nil : _onValue;
+        pthread_mutex_unlock(&_lock);
+        if(onValue)
+            onValue(value);
+        return YES;
+    }
+
+    BOOL kept = YES;
+    id dropped; // let go of after unlocking
+    pthread_mutex_lock(&_lock);
+    if(_cancelled || _finished) {
+        pthread_mutex_unlock(&_lock);
+        return YES;
+    }
+    if(_buffer.count < _bufferLimit) {
+        [_buffer addObject:value];
+    } else {
+        kept = NO;
+        _droppedCount++;
+        if(_overflow == SPStreamOverflowDropOldest) {
+            dropped = _buffer[0];
+            [_buffer removeObjectAtIndex:0];
+            [_buffer addObject:value];
+        }
+    }
+    BOOL schedule = [self claimDrain];
+    pthread_mutex_unlock(&_lock);
+    dropped = nil;
+
+    if(schedule)
+        [self scheduleDrain];
+    return kept;
+}
+
+/// Runs on the subscriber's queue.
+- (void)drain
+{
+    for(NSUInteger delivered = 0;; delivered++) {
+        pthread_mutex_lock(&_lock);
+        if(_cancelled) {
+            _scheduled = NO;
+            pthread_mutex_unlock(&_lock);
+            return;
+        }
+        if(delivered == SPStreamDeliveryBatch) {
+            // Still scheduled; give others a go at the queue before going on.
+            pthread_mutex_unlock(&_lock);
+            [self scheduleDrain];
+            return;
+        }
+        if(_buffer.count > 0 && _demand > 0) {
+            id value = _buffer[0];
+            [_buffer removeObjectAtIndex:0];
+            if(_manualDemand)
+                _demand--;
+            SPStreamValueCallback onValue = _onValue;
+            pthread_mutex_unlock(&_lock);
+            onValue(value);
+            continue;
+        }
+        if(_finished && _buffer.count == 0) {
+            SPStreamFinishedCallback onFinished = _onFinished;
+            NSError *error = _error;
+            SPA_NS(Stream) *stream = _stream;
+            SPStreamValueCallback onValue = _onValue;
+            _stream = nil;
+            _onValue = nil;
+            _onFinished = nil;
+            _cancelled = YES;
+            _scheduled = NO;
+            pthread_mutex_unlock(&_lock);
+            if(onFinished)
+                onFinished(error);
+            stream = nil;
+            onValue = nil;
+            return;
+        }
+        _scheduled = NO;
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+}
+
+- (void)finishWithError:(NSError*)error
+{
+    if(!_executor) {
+        pthread_mutex_lock(&_lock);
+        BOOL cancelled = _cancelled;
+        SPStreamFinishedCallback onFinished = _onFinished;
+        SPStreamValueCallback onValue = _onValue;
+        SPA_NS(Stream) *stream = _stream;
+        _cancelled = YES;
+        _stream = nil;
+        _onValue = nil;
+        _onFinished = nil;
+        pthread_mutex_unlock(&_lock);
+        if(!cancelled && onFinished)
+            onFinished(error);
+        stream = nil;
+        onValue = nil;
+        return;
+    }
+
+    pthread_mutex_lock(&_lock);
+    if(_cancelled || _finished) {
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    _finished = YES;
+    _error = error;
+    BOOL schedule = [self claimDrain];
+    pthread_mutex_unlock(&_lock);
+
+    if(schedule)
+        [self scheduleDrain];
+}
+
+- (void)cancel
+{
+    pthread_mutex_lock(&_lock);
+    if(_cancelled) {
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    _cancelled = YES;
+    // Let go of all of these after unlocking.
+    SPA_NS(Stream) *stream = _stream;
+    SPStreamValueCallback onValue = _onValue;
+    SPStreamFinishedCallback onFinished = _onFinished;
+    NSMutableArray *buffer = _buffer;
+    _stream = nil;
+    _onValue = nil;
+    _onFinished = nil;
+    _buffer = _buffer ? [NSMutableArray new] : nil;
+    pthread_mutex_unlock(&_lock);
+
+    [stream removeSubscription:self];
+    onValue = nil;
+    onFinished = nil;
+    buffer = nil;
+}
+
+- (void)request:(NSUInteger)count
+{
+    pthread_mutex_lock(&_lock);
+    _demand = count > NSUIntegerMax - _demand ? NSUIntegerMax : _demand + count;
+    BOOL schedule = [self claimDrain];
+    pthread_mutex_unlock(&_lock);
+
+    if(schedule)
+        [self scheduleDrain];
+}
+
+- (NSUInteger)room
+{
+    if(!_executor) {
+        SPA_NS(Stream) *downstream = _downstream;
+        return downstream ? [downstream demand] : 0;
+    }
+    pthread_mutex_lock(&_lock);
+    NSUInteger room = _cancelled ? NSUIntegerMax : _bufferLimit - MIN(_buffer.count, _bufferLimit);
+    pthread_mutex_unlock(&_lock);
+    return room;
+}
+
+- (NSUInteger)droppedCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger droppedCount = _droppedCount;
+    pthread_mutex_unlock(&_lock);
+    return droppedCount;
+}
+@end
+
+#pragma mark Operators
+
+/// Whatever state an operator needs to keep between values.
+@interface SPA_NS(StreamOperatorState) : NSObject
+{
+    @public
+    pthread_mutex_t _lock;
+    NSMutableArray *_values;
+    id _latest;
+    SPA_NS(TaskTimer) *_timer;
+    uint64_t _generation;
+    uint64_t _nextAllowed; // SPAsyncMonotonicNanoseconds()
+    BOOL _scheduled;
+}
+@end
+
+@implementation SPA_NS(StreamOperatorState)
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+@end
+
+@implementation SPA_NS(Stream) (SPStreamOperators)
+/// A stream derived from the receiver: 'onValue' and 'onFinished' are called synchronously for
+/// everything the receiver sends, for as long as the derived stream is alive, and are expected
+/// to send on to it. Without an 'onFinished', the derived stream finishes with the receiver.
+- (instancetype)derivedStream:(void(^)(SPA_NS(Stream) *down, id value))onValue finished:(void(^)(SPA_NS(Stream) *down, NSError *error))onFinished
+{
+    SPA_NS(Stream) *down = [SPA_NS(Stream) new];
+    __weak SPA_NS(Stream) *weakDown = down;
+    SPA_NS(StreamSubscription) *subscription = [[SPA_NS(StreamSubscription) alloc] initWithStream:self queue:nil onValue:^(id value) {
+        SPA_NS(Stream) *strongDown = weakDown;
+        if(strongDown)
+            onValue(strongDown, value);
+    } onFinished:^(NSError *error) {
+        SPA_NS(Stream) *strongDown = weakDown;
+        if(strongDown && onFinished)
+            onFinished(strongDown, error);
+        else
+            [strongDown finishWithError:error];
+    } bufferLimit:0 overflow:SPStreamOverflowDropOldest manualDemand:NO];
+    subscription->_downstream = down;
+    down->_upstream = subscription;
+    [self addSubscription:subscription];
+    return down;
+}
+
+- (instancetype)map:(SPStreamMapCallback)mapper
+{
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        [down send:mapper(value)];
+    } finished:nil];
+}
+
+- (instancetype)filter:(SPStreamFilterCallback)predicate
+{
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        if(predicate(value))
+            [down send:value];
+    } finished:nil];
+}
+
+- (instancetype)buffer:(NSUInteger)count
+{
+    NSParameterAssert(count > 0);
+    SPA_NS(StreamOperatorState) *state = [SPA_NS(StreamOperatorState) new];
+    state->_values = [NSMutableArray arrayWithCapacity:count];
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        NSArray *full = nil;
+        pthread_mutex_lock(&state->_lock);
+        [state->_values addObject:value];
+        if(state->_values.count == count) {
+            full = state->_values;
+            state->_values = [NSMutableArray arrayWithCapacity:count];
+        }
+        pthread_mutex_unlock(&state->_lock);
+        if(full)
+            [down send:full];
+    } finished:^(SPA_NS(Stream) *down, NSError *error) {
+        pthread_mutex_lock(&state->_lock);
+        NSArray *rest = state->_values;
+        state->_values = nil;
+        pthread_mutex_unlock(&state->_lock);
+        if(rest.count > 0)
+            [down send:rest];
+        [down finishWithError:error];
+    }];
+}
+
+- (instancetype)throttle:(NSTimeInterval)interval
+{
+    uint64_t intervalNanoseconds = interval > 0 ? (uint64_t)(interval * NSEC_PER_SEC) : 0;
+    SPA_NS(StreamOperatorState) *state = [SPA_NS(StreamOperatorState) new];
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        uint64_t now = SPAsyncMonotonicNanoseconds();
+        pthread_mutex_lock(&state->_lock);
+        if(!state->_timer && now >= state->_nextAllowed) {
+            state->_nextAllowed = now + intervalNanoseconds;
+            pthread_mutex_unlock(&state->_lock);
+            [down send:value];
+            return;
+        }
+        // Too soon; whatever's latest goes through when the interval is up.
+        state->_latest = value;
+        if(!state->_timer) {
+            __weak SPA_NS(Stream) *weakDown = down;
+            NSTimeInterval wait = (NSTimeInterval)(state->_nextAllowed - now) / NSEC_PER_SEC;
+            state->_timer = [SPA_NS(TaskTimer) timerWithDelay:wait queue:nil handler:^{
+                pthread_mutex_lock(&state->_lock);
+                id latest = state->_latest;
+                state->_latest = nil;
+                state->_timer = nil;
+                state->_nextAllowed = SPAsyncMonotonicNanoseconds() + intervalNanoseconds;
+                pthread_mutex_unlock(&state->_lock);
+                [weakDown send:latest];
+            }];
+        }
+        pthread_mutex_unlock(&state->_lock);
+    } finished:^(SPA_NS(Stream) *down, NSError *error) {
+        pthread_mutex_lock(&state->_lock);
+        id latest = state->_latest;
+        SPA_NS(TaskTimer) *timer = state->_timer;
+        state->_latest = nil;
+        state->_timer = nil;
+        pthread_mutex_unlock(&state->_lock);
+        [timer disarm];
+        [down send:latest];
+        [down finishWithError:error];
+    }];
+}
+
+- (instancetype)debounce:(NSTimeInterval)interval
+{
+    SPA_NS(StreamOperatorState) *state = [SPA_NS(StreamOperatorState) new];
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        __weak SPA_NS(Stream) *weakDown = down;
+        pthread_mutex_lock(&state->_lock);
+        state->_latest = value;
+        uint64_t generation = ++state->_generation;
+        SPA_NS(TaskTimer) *previous = state->_timer;
+        // The wheel makes re-arming on every value cheap.
+        state->_timer = [SPA_NS(TaskTimer) timerWithDelay:interval queue:nil handler:^{
+            pthread_mutex_lock(&state->_lock);
+            if(state->_generation != generation) {
+                // Another value came in while this was firing.
+                pthread_mutex_unlock(&state->_lock);
+                return;
+            }
+            id latest = state->_latest;
+            state->_latest = nil;
+            state->_timer = nil;
+            pthread_mutex_unlock(&state->_lock);
+            [weakDown send:latest];
+        }];
+        pthread_mutex_unlock(&state->_lock);
+        [previous disarm];
+    } finished:^(SPA_NS(Stream) *down, NSError *error) {
+        pthread_mutex_lock(&state->_lock);
+        id latest = state->_latest;
+        SPA_NS(TaskTimer) *timer = state->_timer;
+        state->_latest = nil;
+        state->_timer = nil;
+        state->_generation++;
+        pthread_mutex_unlock(&state->_lock);
+        [timer disarm];
+        [down send:latest];
+        [down finishWithError:error];
+    }];
+}
+
+- (instancetype)coalesceOn:(dispatch_queue_t)queue
+{
+    NSParameterAssert(queue);
+    SPA_NS(DispatchExecutor) *executor = [SPA_NS(DispatchExecutor) executorWithQueue:queue];
+    SPA_NS(StreamOperatorState) *state = [SPA_NS(StreamOperatorState) new];
+    return [self derivedStream:^(SPA_NS(Stream) *down, id value) {
+        pthread_mutex_lock(&state->_lock);
+        state->_latest = value;
+        BOOL schedule = !state->_scheduled;
+        state->_scheduled = YES;
+        pthread_mutex_unlock(&state->_lock);
+        if(!schedule)
+            return;
+
+        __weak SPA_NS(Stream) *weakDown = down;
+        [executor execute:^{
+            pthread_mutex_lock(&state->_lock);
+            id latest = state->_latest;
+            state->_latest = nil;
+            state->_scheduled = NO;
+            pthread_mutex_unlock(&state->_lock);
+            [weakDown send:latest];
+        }];
+    } finished:^(SPA_NS(Stream) *down, NSError *error) {
+        // After any delivery that's already scheduled.
+        [executor execute:^{
+            pthread_mutex_lock(&state->_lock);
+            id latest = state->_latest;
+            state->_latest = nil;
+            pthread_mutex_unlock(&state->_lock);
+            [down send:latest];
+            [down finishWithError:error];
+        }];
+    }];
+}
+@end
+
+#pragma mark KVO
+
+static void *kSPStreamKVOContext = &kSPStreamKVOContext;
+
+/// Observes one key path for a stream, coalescing changes onto a queue.
+@interface SPA_NS(StreamKVOObserver) : NSObject <SPA_NS(StreamUpstream)>
+{
+    @public
+    pthread_mutex_t _lock;
+    id _object;
+    NSString *_keyPath;
+    __weak SPA_NS(Stream) *_stream;
+    SPA_NS(DispatchExecutor) *_executor;
+    id _latest;
+    BOOL _scheduled;
+    BOOL _observing;
+}
+@end
+
+@implementation SPA_NS(StreamKVOObserver)
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+- (void)start
+{
+    _observing = YES;
+    [_object addObserver:self forKeyPath:_keyPath options:NSKeyValueObservingOptionInitial|NSKeyValueObservingOptionNew context:kSPStreamKVOContext];
+}
+
+- (void)cancel
+{
+    pthread_mutex_lock(&_lock);
+    BOOL wasObserving = _observing;
+    _observing = NO;
+    pthread_mutex_unlock(&_lock);
+    if(wasObserving)
+        [_object removeObserver:self forKeyPath:_keyPath context:kSPStreamKVOContext];
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+{
+    if(context != kSPStreamKVOContext)
+        return [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
+
+    id value = SPKVOChangedValue(change, object, keyPath);
+    pthread_mutex_lock(&_lock);
+    _latest = value;
+    BOOL schedule = !_scheduled;
+    _scheduled = YES;
+    pthread_mutex_unlock(&_lock);
+    if(!schedule)
+        return;
+
+    [_executor execute:^{
+        pthread_mutex_lock(&self->_lock);
+        id latest = self->_latest;
+        self->_latest = nil;
+        self->_scheduled = NO;
+        pthread_mutex_unlock(&self->_lock);
+        [self->_stream send:latest];
+    }];
+}
+@end
+
+@implementation SPA_NS(Stream) (SPStreamKVO)
++ (instancetype)streamWithKeyPath:(NSString*)keyPath ofObject:(id)object on:(dispatch_queue_t)queue
+{
+    NSParameterAssert(keyPath);
+    NSParameterAssert(object);
+    NSParameterAssert(queue);
+    SPA_NS(Stream) *stream = [SPA_NS(Stream) new];
+    SPA_NS(StreamKVOObserver) *observer = [SPA_NS(StreamKVOObserver) new];
+    observer->_object = object;
+    observer->_keyPath = [keyPath copy];
+    observer->_stream = stream;
+    observer->_executor = [SPA_NS(DispatchExecutor) executorWithQueue:queue];
+    stream->_upstream = observer;
+    [observer start];
+    return stream;
+}
+@end
+
+#pragma mark Source
+
+@implementation SPA_NS(StreamSource)
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    _stream = [SPA_NS(Stream) new];
+    return self;
+}
+
+- (BOOL)send:(id)value
+{
+    return [_stream send:value];
+}
+
+- (void)finish
+{
+    [_stream finishWithError:nil];
+}
+
+- (void)failWithError:(NSError*)error
+{
+    NSParameterAssert(error);
+    [_stream finishWithError:error];
+}
+
+- (NSUInteger)demand
+{
+    return [_stream demand];
+}
+@end
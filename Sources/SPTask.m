@@ -7,332 +7,2375 @@
 //
 
 #import <SPAsync/SPTask.h>
+#import <SPAsync/SPExecutor.h>
+#import "SPTaskTimer.h"
+#import "SPTaskTraceRecording.h"
+#import "SPTaskScopeMembership.h"
+#import "SPAsyncClock.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <execinfo.h>
+#include <math.h>
+#include <time.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-@interface SPA_NS(Task) ()
+#pragma mark Continuation storage
+/*
+    A task keeps all of its callbacks, errbacks and finallys in one intrusive, singly linked
+    list of continuations. The head of that list doubles as the task's state word: while the
+    task is pending it points at the most recently registered continuation (or is 0 if there
+    are none), and once the task resolves it is swapped for one of the SPTaskState constants.
+    
+    Registering a continuation is thus a single CAS pushing onto the head, and resolving the
+    task is a single exchange that takes ownership of the whole list. Only the thread that wins
+    the `_resolving` flag may publish a result, so the value and error ivars are always written
+    before the exchange that makes them visible.
+    
+    Most tasks only ever get one or two continuations, so the first two live inline in the
+    task itself. Any further ones come from a small per-thread pool, so a steady state of
+    registering and delivering continuations doesn't touch malloc.
+    
+    When a chain: or recover: callback returns a task that then:, chain: or recover: made, and
+    that nothing has been completed with yet, that task is linked to the one chain: or recover:
+    returned instead of forwarding through callbacks: it hands its continuations over and from
+    then on follows the outer task's state, so that resolving the inner task resolves the outer
+    one directly. Links always point at the outermost task, so a recursive chain (each link
+    completing with the next) keeps only the caller's task and the current link alive, rather
+    than every intermediate task in the chain. Any other task, such as one passed to
+    completeWithTask:, may be somebody else's too, so it is only ever followed.
+*/
+
+typedef NS_ENUM(uint8_t, SPTaskContinuationKind) {
+    SPTaskContinuationValue,
+    SPTaskContinuationError,
+    SPTaskContinuationFinally,
+    /// An SPTaskOutcomeCallback, called on both success and failure. Lets then: and friends
+    /// get away with a single record instead of one callback and one errback.
+    SPTaskContinuationOutcome,
+    /// Called synchronously if and only if the task is cancelled before it resolves.
+    SPTaskContinuationCancellation,
+    /// An SPTaskBoolCallback, SPTaskIntegerCallback or SPTaskDoubleCallback, called on success
+    /// with the result as that scalar.
+    SPTaskContinuationBool,
+    SPTaskContinuationInteger,
+    SPTaskContinuationDouble,
+};
+
+typedef struct SPTaskContinuation {
+    struct SPTaskContinuation *next;
+    SPTaskContinuationKind kind;
+    BOOL isInline; // lives inside its task, rather than in the pool
+    BOOL onExecutor; // 'queue' is an SPExecutor rather than a dispatch queue
+    void *callback; // retained block
+    void *queue; // retained dispatch_queue_t or SPExecutor, or NULL for synchronous continuations
+} SPTaskContinuation;
+
+typedef void(^SPTaskOutcomeCallback)(BOOL succeeded, id result);
+
+/// A result kept unboxed, for the typed callbacks of SPTaskScalars. Object callbacks get it
+/// boxed, which only happens once somebody asks.
+typedef NS_ENUM(uint8_t, SPTaskScalarType) {
+    SPTaskScalarNone, // the result is an object
+    SPTaskScalarBool,
+    SPTaskScalarInteger,
+    SPTaskScalarDouble,
+};
+
+typedef struct {
+    SPTaskScalarType type;
+    union {
+        BOOL boolValue;
+        NSInteger integerValue;
+        double doubleValue;
+    };
+} SPTaskScalar;
+
+static BOOL SPTaskScalarAsBool(SPTaskScalar scalar, id value)
 {
-    NSMutableArray *_callbacks;
-    NSMutableArray *_errbacks;
-    NSMutableArray *_finallys;
-    NSMutableArray *_childTasks;
-    id _completedValue;
-    NSError *_completedError;
-    __weak SPA_NS(TaskCompletionSource) *_source;
+    switch(scalar.type) {
+        case SPTaskScalarBool: return scalar.boolValue;
+        case SPTaskScalarInteger: return scalar.integerValue != 0;
+        case SPTaskScalarDouble: return scalar.doubleValue != 0;
+        case SPTaskScalarNone: break;
+    }
+    return [value boolValue];
+}
+
+static NSInteger SPTaskScalarAsInteger(SPTaskScalar scalar, id value)
+{
+    switch(scalar.type) {
+        case SPTaskScalarBool: return scalar.boolValue;
+        case SPTaskScalarInteger: return scalar.integerValue;
+        case SPTaskScalarDouble: return (NSInteger)scalar.doubleValue;
+        case SPTaskScalarNone: break;
+    }
+    return [value integerValue];
+}
+
+static double SPTaskScalarAsDouble(SPTaskScalar scalar, id value)
+{
+    switch(scalar.type) {
+        case SPTaskScalarBool: return scalar.boolValue;
+        case SPTaskScalarInteger: return scalar.integerValue;
+        case SPTaskScalarDouble: return scalar.doubleValue;
+        case SPTaskScalarNone: break;
+    }
+    return [value doubleValue];
+}
+
+static id SPTaskScalarBox(SPTaskScalar scalar)
+{
+    switch(scalar.type) {
+        case SPTaskScalarBool: return @(scalar.boolValue);
+        case SPTaskScalarInteger: return @(scalar.integerValue);
+        case SPTaskScalarDouble: return @(scalar.doubleValue);
+        case SPTaskScalarNone: break;
+    }
+    return nil;
+}
+
+// Values of the state word that aren't continuation list heads.
+enum {
+    SPTaskStatePending = 0,
+    SPTaskStateSucceeded = 1,
+    SPTaskStateFailed = 2,
+    SPTaskStateCancelled = 3,
+    SPTaskStateLinked = 4, // follows _linkedTask
+};
+
+static inline BOOL SPTaskStateIsResolved(uintptr_t state)
+{
+    return state != SPTaskStatePending && state <= SPTaskStateCancelled;
+}
+
+/// Whether 'state' is the head of a (possibly empty) continuation list.
+static inline BOOL SPTaskStateIsPending(uintptr_t state)
+{
+    return state == SPTaskStatePending || state > SPTaskStateLinked;
+}
+
+static inline void *SPTaskRetainQueue(dispatch_queue_t queue)
+{
+    if(!queue)
+        return NULL;
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    return (__bridge_retained void *)queue;
+#else
+    dispatch_retain(queue);
+    return (void *)queue;
+#endif
+}
+
+static inline dispatch_queue_t SPTaskQueue(void *queue)
+{
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    return (__bridge dispatch_queue_t)queue;
+#else
+    return (dispatch_queue_t)queue;
+#endif
+}
+
+/// For comparing queues with the ones stored in continuations.
+static inline void *SPTaskQueueIdentity(dispatch_queue_t queue)
+{
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    return (__bridge void *)queue;
+#else
+    return (void *)queue;
+#endif
+}
+
+static inline void SPTaskReleaseQueue(void *queue)
+{
+    if(!queue)
+        return;
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+    (void)(__bridge_transfer dispatch_queue_t)queue;
+#else
+    dispatch_release((dispatch_queue_t)queue);
+#endif
+}
+
+/// Where to run a continuation: a dispatch queue or an SPExecutor (unretained), or NULL to
+/// run it synchronously.
+typedef struct {
+    void *queue;
+    BOOL isExecutor;
+} SPTaskTarget;
+
+static inline SPTaskTarget SPTaskTargetQueue(dispatch_queue_t queue)
+{
+    return (SPTaskTarget){ SPTaskQueueIdentity(queue), NO };
+}
+
+static inline SPTaskTarget SPTaskTargetExecutor(id<SPA_NS(Executor)> executor)
+{
+    NSCParameterAssert(executor);
+    // Queues are faster to work with directly than through their adapter.
+    if([executor isKindOfClass:[SPA_NS(DispatchExecutor) class]])
+        return SPTaskTargetQueue([(SPA_NS(DispatchExecutor)*)executor queue]);
+    return (SPTaskTarget){ (__bridge void *)executor, YES };
+}
+
+static inline void *SPTaskRetainTarget(SPTaskTarget target)
+{
+    if(target.isExecutor)
+        return (__bridge_retained void *)(__bridge id)target.queue;
+    return SPTaskRetainQueue(SPTaskQueue(target.queue));
+}
+
+static inline void SPTaskReleaseTarget(void *queue, BOOL isExecutor)
+{
+    if(isExecutor)
+        (void)(__bridge_transfer id)queue;
+    else
+        SPTaskReleaseQueue(queue);
+}
+
+static inline void SPTaskTargetAsync(void *queue, BOOL isExecutor, dispatch_block_t block)
+{
+    if(isExecutor)
+        [(__bridge id<SPA_NS(Executor)>)queue execute:block];
+    else
+        dispatch_async(SPTaskQueue(queue), block);
+}
+
+/// What kind of callback the work of performWork: and friends is.
+typedef NS_OPTIONS(uint8_t, SPTaskWorkOptions) {
+    /// It returns a task to complete with, rather than a value.
+    SPTaskWorkFetches = 1 << 0,
+    /// It takes a cancellation token.
+    SPTaskWorkCancellable = 1 << 1,
+};
+
+#define SPTaskContinuationPoolLimit 64
+#define SPTaskInlineDepthLimit 32
+
+/// Everything SPTask keeps per thread.
+typedef struct {
+    /// Free continuation records, and how many there are.
+    SPTaskContinuation *pool;
+    unsigned poolCount;
+    /// How many continuations are currently being run synchronously inside each other.
+    unsigned inlineDepth;
+    /// The queue whose continuations this thread is currently running, if any.
+    void *currentQueue;
+    /// Retained SPTaskWaiter that waitWithTimeout:error: parks this thread on, once it has had to.
+    void *waiter;
+} SPTaskThreadState;
+
+static pthread_key_t gThreadStateKey;
+static void SPTaskWaiterRelease(void *waiter);
+
+static void SPTaskThreadStateDestroy(void *context)
+{
+    SPTaskThreadState *threadState = context;
+    while(threadState->pool) {
+        SPTaskContinuation *next = threadState->pool->next;
+        free(threadState->pool);
+        threadState->pool = next;
+    }
+    SPTaskWaiterRelease(threadState->waiter);
+    free(threadState);
+}
+
+static SPTaskThreadState *SPTaskThreadStateForCurrentThread(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        pthread_key_create(&gThreadStateKey, SPTaskThreadStateDestroy);
+    });
+    
+    SPTaskThreadState *threadState = pthread_getspecific(gThreadStateKey);
+    if(!threadState) {
+        threadState = calloc(1, sizeof(SPTaskThreadState));
+        pthread_setspecific(gThreadStateKey, threadState);
+    }
+    return threadState;
+}
+
+static SPTaskContinuation *SPTaskContinuationAllocate(void)
+{
+    SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+    SPTaskContinuation *continuation = threadState->pool;
+    if(continuation) {
+        threadState->pool = continuation->next;
+        threadState->poolCount--;
+    } else {
+        continuation = malloc(sizeof(SPTaskContinuation));
+    }
+    continuation->isInline = NO;
+    return continuation;
+}
+
+/// Sets up a freshly claimed continuation to call 'callback' on 'target'.
+static inline SPTaskContinuation *SPTaskContinuationFill(SPTaskContinuation *continuation, SPTaskContinuationKind kind, id callback, SPTaskTarget target)
+{
+    continuation->kind = kind;
+    continuation->onExecutor = target.isExecutor;
+    continuation->callback = (__bridge_retained void *)[callback copy];
+    continuation->queue = SPTaskRetainTarget(target);
+    return continuation;
+}
+
+/// Continuations stored inline can't outlive their task; returns a pooled copy of those that
+/// need to move to another task.
+static SPTaskContinuation *SPTaskContinuationDetach(SPTaskContinuation *continuation)
+{
+    if(!continuation->isInline)
+        return continuation;
+    
+    SPTaskContinuation *detached = SPTaskContinuationAllocate();
+    detached->next = continuation->next;
+    detached->kind = continuation->kind;
+    detached->onExecutor = continuation->onExecutor;
+    detached->callback = continuation->callback;
+    detached->queue = continuation->queue;
+    continuation->callback = NULL;
+    continuation->queue = NULL;
+    return detached;
+}
+
+/// Releases the queue and gives the continuation back to the pool. The callback must already
+/// have been taken out of it.
+static void SPTaskContinuationRecycle(SPTaskContinuation *continuation)
+{
+    SPTaskReleaseTarget(continuation->queue, continuation->onExecutor);
+    continuation->queue = NULL;
+    if(continuation->isInline)
+        return;
+    
+    SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+    if(threadState->poolCount < SPTaskContinuationPoolLimit) {
+        continuation->next = threadState->pool;
+        threadState->pool = continuation;
+        threadState->poolCount++;
+    } else {
+        free(continuation);
+    }
+}
+
+static dispatch_queue_t SPTaskInlineQueue(void)
+{
+    static dispatch_queue_t inlineQueue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        inlineQueue = dispatch_queue_create("SPAsync.inline", DISPATCH_QUEUE_CONCURRENT);
+    });
+    return inlineQueue;
+}
+
+/// Whether continuations for 'queue' may be run synchronously on the current thread right now:
+/// either they asked to be run inline, or we're already running on their queue. Either way,
+/// only up to a limited nesting depth so that long chains can't blow the stack.
+static inline BOOL SPTaskCanRunInline(SPTaskThreadState *threadState, void *queue, BOOL allowCurrentQueue)
+{
+    if(threadState->inlineDepth >= SPTaskInlineDepthLimit)
+        return NO;
+    return queue == SPTaskQueueIdentity(SPTaskInlineQueue()) || (allowCurrentQueue && queue == threadState->currentQueue);
+}
+
+/// The list is built by pushing onto its head; reverse it to get registration order.
+static SPTaskContinuation *SPTaskContinuationReverse(SPTaskContinuation *list)
+{
+    SPTaskContinuation *reversed = NULL;
+    while(list) {
+        SPTaskContinuation *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+    return reversed;
+}
+
+/// Lets go of every continuation in a list that will never be delivered.
+static void SPTaskContinuationReleaseList(SPTaskContinuation *list)
+{
+    while(list) {
+        SPTaskContinuation *next = list->next;
+        (void)(__bridge_transfer id)list->callback;
+        SPTaskContinuationRecycle(list);
+        list = next;
+    }
+}
+
+#pragma mark Child tasks
+/*
+    Tasks derived from a task (then:, chain:, recover:, the awaitAll: family...) are registered
+    as its children, so that cancelling it cancels them too. Each such relation is a link that
+    is listed twice: by the parent, so it can find the child to cancel, and by the child, so
+    that it can drop out of all its parents' lists as soon as it settles. Whichever side takes
+    the child out of the link first releases it, so a parent only ever keeps its in-flight
+    children alive; a long-lived task with a steady stream of short-lived children doesn't
+    accumulate them.
+    
+    Dead links are unlinked from the parent's list in batches, whenever the list has grown to
+    twice its size after the previous sweep, which keeps it proportional to the number of
+    children still in flight.
+
+    A task that comes to follow another (see linkToTask:) moves both its lists over to that one,
+    which cancels and settles in its place from then on. Its parents' links are swept the same
+    way on their new list, so a long recursive chain: keeps only the links still in use.
+*/
+
+typedef struct SPTaskChildLink {
+    struct SPTaskChildLink *next; // in the parent's list
+    struct SPTaskChildLink *nextOfChild; // in the child's list
+    atomic_uintptr_t child; // retained child task, until either side takes it out
+    atomic_int references; // one for the parent, one for the child
+} SPTaskChildLink;
+
+/// Value of a child's list of links once it no longer accepts new ones.
+#define SPTaskChildLinksClosed ((uintptr_t)1)
+#define SPTaskChildPruneMinimum 16
+
+static void SPTaskChildLinkRelease(SPTaskChildLink *link)
+{
+    if(atomic_fetch_sub_explicit(&link->references, 1, memory_order_acq_rel) == 1)
+        free(link);
+}
+
+/// Returns the child of the link, or nil if the other side has already taken it.
+static inline id SPTaskChildLinkTakeChild(SPTaskChildLink *link)
+{
+    return (__bridge_transfer id)(void*)atomic_exchange_explicit(&link->child, 0, memory_order_acq_rel);
+}
+
+/// The child's side of settling: lets go of the child in each of the links in 'list'.
+static void SPTaskChildLinksDrop(uintptr_t list)
+{
+    if(list == SPTaskChildLinksClosed)
+        return;
+    SPTaskChildLink *link = (SPTaskChildLink*)list;
+    while(link) {
+        SPTaskChildLink *next = link->nextOfChild;
+        (void)SPTaskChildLinkTakeChild(link);
+        SPTaskChildLinkRelease(link);
+        link = next;
+    }
+}
+
+#pragma mark Call sites
+/*
+    Each task made by then:, chain: or recover: remembers the return address of that call, in a
+    node that also points at the node of the task it was made from, so that a task at the end of
+    a chain knows the whole path of calls that led to it. Nodes are shared by every task made
+    from the same one and refcounted, so deriving one is a malloc and an increment whatever the
+    length of the path. Only raw addresses are kept; they're symbolized when somebody asks for
+    asyncCallStackSymbols, which for most tasks is never.
+
+    A task keeps the nodes of all the calls that led to it, but only the latest
+    SPTaskCallSiteLimit of them are ever symbolized.
+*/
+
+#define SPTaskCallSiteLimit 32
+
+typedef struct SPTaskCallSite {
+    atomic_uint refCount;
+    void *address;
+    struct SPTaskCallSite *parent; // retained; the call the receiver was made by, or NULL
+} SPTaskCallSite;
+
+static SPTaskCallSite *SPTaskCallSiteDerive(SPTaskCallSite *parent, void *address)
+{
+    SPTaskCallSite *callSite = malloc(sizeof(SPTaskCallSite));
+    atomic_init(&callSite->refCount, 1);
+    callSite->address = address;
+    callSite->parent = parent;
+    if(parent)
+        atomic_fetch_add_explicit(&parent->refCount, 1, memory_order_relaxed);
+    return callSite;
+}
+
+static void SPTaskCallSiteRelease(SPTaskCallSite *callSite)
+{
+    // A loop rather than recursion, as the path can be as long as any chain.
+    while(callSite && atomic_fetch_sub_explicit(&callSite->refCount, 1, memory_order_acq_rel) == 1) {
+        SPTaskCallSite *parent = callSite->parent;
+        free(callSite);
+        callSite = parent;
+    }
+}
+
+typedef NS_ENUM(NSInteger, SPTaskJoinKind) {
+    SPTaskJoinAll,
+    SPTaskJoinAny,
+    SPTaskJoinFirstSuccess,
+    SPTaskJoinAllSettled,
+};
+
+/// Bookkeeping shared by the children of one join; see +join:tasks:on:.
+@interface SPA_NS(TaskJoin) : NSObject
+{
+    @public
+    atomic_long _remaining;
+    atomic_bool _settled;
+    NSUInteger _count;
+    __strong id *_results;
+}
+- (instancetype)initWithCount:(NSUInteger)count;
+- (BOOL)settle;
+- (BOOL)countDown;
+- (BOOL)countDown:(NSUInteger)amount;
+- (BOOL)isSettled;
+- (NSArray*)results;
+- (NSError*)firstError;
+@end
+
+@implementation SPA_NS(TaskJoin)
+- (instancetype)initWithCount:(NSUInteger)count
+{
+    if(!(self = [super init]))
+        return nil;
+    _count = count;
+    atomic_init(&_remaining, (long)count);
+    _results = (__strong id *)calloc(count, sizeof(id));
+    return self;
+}
+
+- (void)dealloc
+{
+    for(NSUInteger i = 0; i < _count; i++)
+        _results[i] = nil;
+    free(_results);
+}
+
+/// Returns YES for the one caller that gets to resolve the join's task.
+- (BOOL)settle
+{
+    return !atomic_exchange_explicit(&_settled, YES, memory_order_acq_rel);
+}
+
+/// Returns YES for the caller that brings the count of outstanding tasks to zero.
+- (BOOL)countDown
+{
+    return [self countDown:1];
+}
+
+- (BOOL)countDown:(NSUInteger)amount
+{
+    return atomic_fetch_sub_explicit(&_remaining, (long)amount, memory_order_acq_rel) == (long)amount;
+}
+
+- (BOOL)isSettled
+{
+    return atomic_load_explicit(&_settled, memory_order_acquire);
+}
+
+- (NSArray*)results
+{
+    return [NSArray arrayWithObjects:_results count:_count];
+}
+
+- (NSError*)firstError
+{
+    for(NSUInteger i = 0; i < _count; i++) {
+        if(_results[i])
+            return _results[i];
+    }
+    return nil;
 }
-@property(getter=isCancelled,readwrite) BOOL cancelled;
-@property(getter=isCompleted,readwrite) BOOL completed;
 @end
 
-@interface SPA_NS(TaskCompletionSource) ()
-- (void)cancel;
+#define SPTaskMapChunkLimit 64
+
+/// Bookkeeping for one +map:... or +mapTasks:...; the join's slots hold the mapped values, and
+/// settling it stops the map.
+@interface SPA_NS(TaskMap) : SPA_NS(TaskJoin)
+{
+    @public
+    atomic_ulong _next; // index of the next item to hand out
+    NSUInteger _laneCount;
+    atomic_uintptr_t *_lanes; // retained task that each lane of mapTasks: is waiting on, or 0
+}
+- (instancetype)initWithCount:(NSUInteger)count lanes:(NSUInteger)laneCount;
 @end
 
-@implementation SPA_NS(Task)
-@synthesize cancelled = _isCancelled;
-@synthesize completed = _isCompleted;
+@implementation SPA_NS(TaskMap)
+- (instancetype)initWithCount:(NSUInteger)count lanes:(NSUInteger)laneCount
+{
+    if(!(self = [super initWithCount:count]))
+        return nil;
+    atomic_init(&_next, 0);
+    _laneCount = laneCount;
+    _lanes = (atomic_uintptr_t*)calloc(laneCount ?: 1, sizeof(atomic_uintptr_t));
+    return self;
+}
+
+- (void)dealloc
+{
+    for(NSUInteger i = 0; i < _laneCount; i++) {
+        uintptr_t task = atomic_load_explicit(&_lanes[i], memory_order_relaxed);
+        if(task)
+            (void)(__bridge_transfer id)(void*)task;
+    }
+    free(_lanes);
+}
+
+/// Hands out the index of the first of the next 'amount' items; at or past _count when there are none left.
+- (NSUInteger)claim:(NSUInteger)amount
+{
+    return atomic_fetch_add_explicit(&_next, amount, memory_order_relaxed);
+}
+
+/// Remembers the task that 'lane' is now waiting on, so that stopping the map can cancel it.
+- (void)setTask:(id)task forLane:(NSUInteger)lane
+{
+    uintptr_t previous = atomic_exchange(&_lanes[lane], (uintptr_t)(__bridge_retained void*)task);
+    if(previous)
+        (void)(__bridge_transfer id)(void*)previous;
+    // Either this sees the map settled, or cancelLanes sees the new task.
+    if([self isSettled])
+        [self cancelLanes];
+}
 
-- (instancetype)initFromSource:(SPA_NS(TaskCompletionSource)*)source;
+- (void)cancelLanes
+{
+    for(NSUInteger i = 0; i < _laneCount; i++) {
+        uintptr_t task = atomic_exchange(&_lanes[i], 0);
+        if(!task)
+            continue;
+        SPA_NS(Task) *laneTask = (__bridge_transfer SPA_NS(Task)*)(void*)task;
+        if(!laneTask.completed)
+            [laneTask cancel];
+    }
+}
+@end
+
+/// Bookkeeping for one +hedge:after:maxCopies:.
+@interface SPA_NS(TaskHedge) : NSObject
+{
+    @public
+    pthread_mutex_t _lock;
+    NSMutableArray *_copies; // every copy launched so far, until the hedge is done
+    NSUInteger _launched, _settled; // copies launched, and copies that have failed or been cancelled
+    NSError *_lastError;
+    SPA_NS(TaskTimer) *_timer; // for the next copy
+    BOOL _done;
+}
+- (void)finish;
+@end
+
+@implementation SPA_NS(TaskHedge)
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _copies = [NSMutableArray new];
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+/// Stops launching copies, and cancels the ones still running.
+- (void)finish
+{
+    pthread_mutex_lock(&_lock);
+    _done = YES;
+    NSArray *copies = _copies;
+    _copies = nil;
+    SPA_NS(TaskTimer) *timer = _timer;
+    _timer = nil;
+    pthread_mutex_unlock(&_lock);
+    
+    [timer disarm];
+    for(SPA_NS(Task) *copy in copies) {
+        if(!copy.completed)
+            [copy cancel];
+    }
+}
+@end
+
+#pragma mark Waiting
+/*
+    waitWithTimeout:error: first polls the task's state word for a little while, since a task
+    that's about to complete is much cheaper to spin on than to sleep on. After that, it parks
+    the thread on a waiter: a generation counter that a synchronous Finally continuation bumps
+    when the task resolves, and which the thread sleeps on with a futex on Linux and a condition
+    variable elsewhere. Each thread keeps its waiter, and the continuation block that wakes it,
+    for every wait after the first; only when a wait has timed out and its task still holds the
+    waiter's block is a new one made.
+*/
+
+#define SPTaskWaitSpinLimit 1024
+
+static inline void SPTaskCPURelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t SPTaskWaitDeadline(NSTimeInterval timeout)
+{
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    if(isinf(timeout) || timeout >= (double)(UINT64_MAX - now) / NSEC_PER_SEC)
+        return UINT64_MAX;
+    return now + (uint64_t)(timeout * NSEC_PER_SEC);
+}
+
+@interface SPA_NS(TaskWaiter) : NSObject
+{
+@public
+    atomic_uint _generation; // bumped by every wake
+    atomic_bool _armed; // registered with a task that hasn't woken it yet
+    SPTaskFinally _wake; // what's registered; cleared when the thread goes away
+#if !defined(__linux__)
+    pthread_mutex_t _lock;
+    pthread_cond_t _condition;
+#endif
+}
+- (void)parkExpecting:(unsigned)generation until:(uint64_t)deadline;
+@end
+
+@implementation SPA_NS(TaskWaiter)
+- (instancetype)init
 {
     if(!(self = [super init]))
         return nil;
-    _callbacks = [NSMutableArray new];
-    _errbacks = [NSMutableArray new];
-    _finallys = [NSMutableArray new];
-    _childTasks = [NSMutableArray new];
-    _source = source;
+#if !defined(__linux__)
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_condition, NULL);
+#endif
+    // Keeps the waiter alive for as long as a task holds on to it, even past its thread.
+    SPA_NS(TaskWaiter) *waiter = self;
+    _wake = ^(BOOL cancelled) {
+        [waiter wake];
+    };
     return self;
 }
 
-- (instancetype)addCallback:(SPTaskCallback)callback on:(dispatch_queue_t)queue
+#if !defined(__linux__)
+- (void)dealloc
+{
+    pthread_cond_destroy(&_condition);
+    pthread_mutex_destroy(&_lock);
+}
+#endif
+
+- (void)wake
+{
+#if defined(__linux__)
+    atomic_fetch_add_explicit(&_generation, 1, memory_order_release);
+    syscall(SYS_futex, &_generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&_lock);
+    atomic_fetch_add_explicit(&_generation, 1, memory_order_release);
+    pthread_cond_broadcast(&_condition);
+    pthread_mutex_unlock(&_lock);
+#endif
+    atomic_store_explicit(&_armed, NO, memory_order_release);
+}
+
+/// Sleeps until woken, unless woken since 'generation' was read, or until 'deadline' at the
+/// latest. May also return early for no reason at all.
+- (void)parkExpecting:(unsigned)generation until:(uint64_t)deadline
+{
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    if(now >= deadline)
+        return;
+#if defined(__linux__)
+    struct timespec timeout = {
+        .tv_sec = (time_t)((deadline - now) / NSEC_PER_SEC),
+        .tv_nsec = (long)((deadline - now) % NSEC_PER_SEC),
+    };
+    syscall(SYS_futex, &_generation, FUTEX_WAIT_PRIVATE, generation, deadline == UINT64_MAX ? NULL : &timeout, NULL, 0);
+#else
+    pthread_mutex_lock(&_lock);
+    if(atomic_load_explicit(&_generation, memory_order_acquire) == generation) {
+        if(deadline == UINT64_MAX) {
+            pthread_cond_wait(&_condition, &_lock);
+        } else {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t remaining = deadline - now + (uint64_t)until.tv_nsec;
+            until.tv_sec += (time_t)(remaining / NSEC_PER_SEC);
+            until.tv_nsec = (long)(remaining % NSEC_PER_SEC);
+            pthread_cond_timedwait(&_condition, &_lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+#endif
+}
+@end
+
+static void SPTaskWaiterRelease(void *context)
+{
+    if(!context)
+        return;
+    SPA_NS(TaskWaiter) *waiter = (__bridge_transfer SPA_NS(TaskWaiter)*)context;
+    // Break the cycle with the wake block. If a task still holds that block, the waiter lives
+    // on until the task lets go of it.
+    waiter->_wake = nil;
+}
+
+static SPA_NS(TaskWaiter) *SPTaskWaiterForCurrentThread(void)
+{
+    SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+    SPA_NS(TaskWaiter) *waiter = (__bridge SPA_NS(TaskWaiter)*)threadState->waiter;
+    if(waiter && !atomic_load_explicit(&waiter->_armed, memory_order_acquire))
+        return waiter;
+    // Still registered with a task that we stopped waiting for; leave it to that task.
+    SPTaskWaiterRelease(threadState->waiter);
+    waiter = [SPA_NS(TaskWaiter) new];
+    threadState->waiter = (__bridge_retained void*)waiter;
+    return waiter;
+}
+
+/// _scopeContinuations of a task that has left its scope.
+#define SPTaskScopeContinuationsClosed UINT_MAX
+
+static NSError *SPTaskWaitError(SPTaskErrorCode code)
+{
+    NSString *description = code == SPTaskErrorTimedOut ? @"The operation timed out."
+        : code == SPTaskErrorCancelled ? @"The operation was cancelled."
+        : @"Waiting for the operation would deadlock.";
+    return [NSError errorWithDomain:SPA_NS(TaskErrorDomain) code:code userInfo:@{
+        NSLocalizedDescriptionKey: description,
+    }];
+}
+
+/// What a task, or a callback, that would take its SPTaskScope past one of its limits gets.
+static NSError *SPTaskScopeLimitError(void)
+{
+    return [NSError errorWithDomain:SPA_NS(TaskErrorDomain) code:SPTaskErrorScopeLimitExceeded userInfo:@{
+        NSLocalizedDescriptionKey: @"Too many tasks or callbacks in the task's scope.",
+    }];
+}
+
+@interface SPA_NS(Task) ()
+{
+    atomic_uintptr_t _state;
+    atomic_bool _resolving;
+    atomic_bool _cancelled;
+    atomic_uintptr_t _childTasks; // list of SPTaskChildLink, by 'next'
+    atomic_uint _childTaskCount; // roughly how many links are in _childTasks
+    atomic_uint _childTaskPruneLimit;
+    atomic_bool _pruningChildTasks;
+    atomic_uintptr_t _parentLinks; // list of SPTaskChildLink, by 'nextOfChild', or SPTaskChildLinksClosed
+    atomic_uint _parentLinkCount; // roughly how many links adoptParentLinks: has added to _parentLinks
+    atomic_uint _parentLinkPruneLimit;
+    atomic_bool _pruningParentLinks;
+    atomic_uint _inlineContinuationsUsed; // bitmask of claimed slots
+    SPTaskContinuation _inlineContinuations[2];
+    id _completedValue;
+    NSError *_completedError;
+    SPA_NS(Task) *_linkedTask; // set once, before _state becomes SPTaskStateLinked
+    SPTaskCallSite *_callSite; // set once, before the task is handed out
+    atomic_uintptr_t _producerQueue; // queue of the queued callback that will complete us, if known
+    SPTaskScalar _scalar; // the result instead of _completedValue, if its type isn't SPTaskScalarNone
+    atomic_uintptr_t _boxedScalar; // retained object for _scalar, made on first demand
+    BOOL _shared; // the nilPlaceholderTask; can't be cancelled or have children
+    BOOL _linkable; // made by then:, chain: or recover:, so the first chain: or recover: to get it may link it
+    atomic_uintptr_t _scope; // retained SPTaskScope we're in, set at most once
+    atomic_bool _leftScope;
+    atomic_uint _scopeContinuations; // reserved against _scope's limit, or SPTaskScopeContinuationsClosed
+    BOOL _rejected; // failed by rejectForScopeLimit, so its owner may still try to complete it
+}
+- (instancetype)initResolvedToState:(uintptr_t)state value:(id)value error:(NSError*)error scalar:(SPTaskScalar)scalar;
+- (id)boxedScalar;
+- (void)completeWithScalar:(SPTaskScalar)scalar;
+- (void)addContinuation:(SPTaskContinuationKind)kind callback:(id)callback on:(dispatch_queue_t)queue;
+- (void)addContinuation:(SPTaskContinuationKind)kind callback:(id)callback onTarget:(SPTaskTarget)target;
+- (void)addChildTask:(SPA_NS(Task)*)child;
+- (void)adoptTask:(SPA_NS(Task)*)task;
+- (void)followTask:(SPA_NS(Task)*)task;
+- (SPA_NS(Task)*)linkRoot;
+- (BOOL)resolveToState:(uintptr_t)resolvedState value:(id)value error:(NSError*)error;
+- (void)dropParentLinks;
+@end
+
+NSString *const SPA_NS(TaskErrorDomain) = @"SPTaskErrorDomain";
+
+@implementation SPA_NS(Task)
+
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    SPTaskTraceEvent(SPTaskTraceCreated, (__bridge void*)self, NULL);
+    void *scope = SPA_NS(TaskScopeCurrent);
+    if(__builtin_expect(scope != NULL, 0))
+        [self joinScope:(__bridge SPA_NS(TaskScope)*)scope];
+    return self;
+}
+
+/// A task that is born resolved, for completedTask: and friends: no completion source, no
+/// continuations to deliver and no parents to settle with, so just the one allocation.
+- (instancetype)initResolvedToState:(uintptr_t)state value:(id)value error:(NSError*)error scalar:(SPTaskScalar)scalar
+{
+    if(!(self = [super init]))
+        return nil;
+    _completedValue = scalar.type ? nil : value;
+    _completedError = error;
+    _scalar = scalar;
+    if(scalar.type && value)
+        atomic_init(&_boxedScalar, (uintptr_t)(__bridge_retained void*)value);
+    atomic_init(&_resolving, YES);
+    atomic_init(&_parentLinks, SPTaskChildLinksClosed);
+    atomic_init(&_state, state);
+    SPTaskTraceEvent(SPTaskTraceCreated, (__bridge void*)self, NULL);
+    SPTaskTraceEvent(state == SPTaskStateSucceeded ? SPTaskTraceSucceeded : SPTaskTraceFailed, (__bridge void*)self, NULL);
+    return self;
+}
+
+/// A succeeded task with no value, for retry:, hedge: and the like to stand in for work that
+/// returned no task at all. Only for SPAsync's own use and never handed out: cancelling it or
+/// deriving from it can't work as it would for anybody else's task, since it isn't anybody's.
++ (SPA_NS(Task)*)nilPlaceholderTask
+{
+    static SPA_NS(Task) *task;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        task = [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateSucceeded value:nil error:nil scalar:(SPTaskScalar){0}];
+        task->_shared = YES;
+    });
+    return task;
+}
+
+/// The object that object callbacks get for a scalar result.
+- (id)boxedScalar
+{
+    uintptr_t boxed = atomic_load_explicit(&_boxedScalar, memory_order_acquire);
+    if(!boxed) {
+        uintptr_t fresh = (uintptr_t)(__bridge_retained void*)SPTaskScalarBox(_scalar);
+        if(atomic_compare_exchange_strong_explicit(&_boxedScalar, &boxed, fresh, memory_order_acq_rel, memory_order_acquire))
+            boxed = fresh;
+        else
+            (void)(__bridge_transfer id)(void*)fresh;
+    }
+    return (__bridge id)(void*)boxed;
+}
+
+- (void)dealloc
+{
+    uintptr_t state = atomic_load_explicit(&_state, memory_order_acquire);
+    if(SPTaskStateIsPending(state)) {
+        // Never resolved; let go of everything that was still waiting.
+        SPTaskContinuationReleaseList((SPTaskContinuation*)state);
+    }
+    SPTaskChildLink *link = (SPTaskChildLink*)atomic_load_explicit(&_childTasks, memory_order_acquire);
+    while(link) {
+        SPTaskChildLink *next = link->next;
+        (void)SPTaskChildLinkTakeChild(link);
+        SPTaskChildLinkRelease(link);
+        link = next;
+    }
+    // Our parents have all let go of us, or we wouldn't be here.
+    SPTaskChildLinksDrop(atomic_load_explicit(&_parentLinks, memory_order_acquire));
+    SPTaskCallSiteRelease(_callSite);
+    uintptr_t boxed = atomic_load_explicit(&_boxedScalar, memory_order_acquire);
+    if(boxed)
+        (void)(__bridge_transfer id)(void*)boxed;
+    uintptr_t scope = atomic_load_explicit(&_scope, memory_order_acquire);
+    if(scope)
+        (void)(__bridge_transfer id)(void*)scope;
+}
+
+- (BOOL)isCancelled
+{
+    if(atomic_load_explicit(&_cancelled, memory_order_acquire))
+        return YES;
+    return atomic_load_explicit(&_state, memory_order_acquire) == SPTaskStateLinked && [_linkedTask isCancelled];
+}
+
+- (BOOL)isCompleted
+{
+    SPA_NS(Task) *root = [self linkRoot];
+    uintptr_t state = atomic_load_explicit(&root->_state, memory_order_acquire);
+    return state == SPTaskStateSucceeded || state == SPTaskStateFailed;
+}
+
+/// The task whose state this one follows: itself, unless it has been linked to another.
+- (SPA_NS(Task)*)linkRoot
+{
+    SPA_NS(Task) *task = self;
+    while(atomic_load_explicit(&task->_state, memory_order_acquire) == SPTaskStateLinked)
+        task = task->_linkedTask;
+    return task;
+}
+
+/// For a task that somebody else has claimed the resolution of: waits until they're done, and
+/// returns the task it was linked to, or nil if it resolved normally.
+- (SPA_NS(Task)*)linkTargetAfterResolving
+{
+    uintptr_t state;
+    while(SPTaskStateIsPending(state = atomic_load_explicit(&_state, memory_order_acquire)))
+        sched_yield();
+    return state == SPTaskStateLinked ? _linkedTask : nil;
+}
+
+/// Whether a continuation of the given kind should run at all once its task has resolved to 'state'.
+static inline BOOL SPTaskContinuationApplies(SPTaskContinuationKind kind, uintptr_t state)
+{
+    switch(kind) {
+        case SPTaskContinuationValue:
+            return state == SPTaskStateSucceeded;
+        case SPTaskContinuationError:
+            return state == SPTaskStateFailed;
+        case SPTaskContinuationOutcome:
+            return state != SPTaskStateCancelled;
+        case SPTaskContinuationFinally:
+            return YES;
+        case SPTaskContinuationCancellation:
+            return state == SPTaskStateCancelled;
+        case SPTaskContinuationBool:
+        case SPTaskContinuationInteger:
+        case SPTaskContinuationDouble:
+            return state == SPTaskStateSucceeded;
+    }
+    return NO;
+}
+
+/// Calls a continuation of a task that has resolved to 'state'. Must be on the continuation's queue.
+- (void)invokeContinuation:(SPTaskContinuationKind)kind callback:(id)callback forState:(uintptr_t)state
+{
+    switch(kind) {
+        case SPTaskContinuationValue:
+            if(!self.cancelled)
+                ((SPTaskCallback)callback)(_scalar.type ? [self boxedScalar] : _completedValue);
+            break;
+        case SPTaskContinuationError:
+            ((SPTaskErrback)callback)(_completedError);
+            break;
+        case SPTaskContinuationOutcome:
+            if(state == SPTaskStateFailed)
+                ((SPTaskOutcomeCallback)callback)(NO, _completedError);
+            else if(!self.cancelled)
+                ((SPTaskOutcomeCallback)callback)(YES, _scalar.type ? [self boxedScalar] : _completedValue);
+            break;
+        case SPTaskContinuationFinally:
+            ((SPTaskFinally)callback)(state == SPTaskStateCancelled || self.cancelled);
+            break;
+        case SPTaskContinuationCancellation:
+            ((dispatch_block_t)callback)();
+            break;
+        case SPTaskContinuationBool:
+            if(!self.cancelled)
+                ((SPTaskBoolCallback)callback)(SPTaskScalarAsBool(_scalar, _completedValue));
+            break;
+        case SPTaskContinuationInteger:
+            if(!self.cancelled)
+                ((SPTaskIntegerCallback)callback)(SPTaskScalarAsInteger(_scalar, _completedValue));
+            break;
+        case SPTaskContinuationDouble:
+            if(!self.cancelled)
+                ((SPTaskDoubleCallback)callback)(SPTaskScalarAsDouble(_scalar, _completedValue));
+            break;
+    }
+}
+
+/// Schedules a single continuation for a task that has resolved to 'state', or drops it if
+/// it doesn't apply to that state.
+- (void)dispatchContinuation:(SPTaskContinuationKind)kind callback:(id)callback on:(SPTaskTarget)target forState:(uintptr_t)state
+{
+    if(!SPTaskContinuationApplies(kind, state))
+        return;
+    
+    if(!target.queue) {
+        [self invokeContinuation:kind callback:callback forState:state];
+        return;
+    }
+    
+    // A late registration is only run synchronously if it explicitly asked to be; a callback
+    // added from its own queue to an already completed task is still called asynchronously.
+    SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+    if(SPTaskCanRunInline(threadState, target.queue, NO)) {
+        threadState->inlineDepth++;
+        [self invokeContinuation:kind callback:callback forState:state];
+        threadState->inlineDepth--;
+        return;
+    }
+    uint64_t flow = SPTaskTraceEnqueue((__bridge void*)self, target.queue, target.isExecutor);
+    SPTaskTargetAsync(target.queue, target.isExecutor, ^{
+        SPTaskTraceDequeue((__bridge void*)self, flow);
+        [self invokeContinuation:kind callback:callback forState:state];
+    });
+}
+
+/// Invokes and recycles every continuation in 'list', in order.
+- (void)runContinuations:(SPTaskContinuation*)list forState:(uintptr_t)state
+{
+    while(list) {
+        SPTaskContinuation *continuation = list;
+        list = continuation->next;
+        
+        id callback = (__bridge_transfer id)continuation->callback;
+        SPTaskContinuationKind kind = continuation->kind;
+        SPTaskContinuationRecycle(continuation);
+        [self invokeContinuation:kind callback:callback forState:state];
+    }
+}
+
+/// Submits a list of continuations that all target the same queue as one block, or runs them
+/// right here if that's allowed.
+- (void)submitContinuations:(SPTaskContinuation*)list forState:(uintptr_t)state
+{
+    void *queue = list->queue;
+    SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+    if(SPTaskCanRunInline(threadState, queue, YES)) {
+        threadState->inlineDepth++;
+        [self runContinuations:list forState:state];
+        threadState->inlineDepth--;
+        return;
+    }
+    
+    uint64_t flow = SPTaskTraceEnqueue((__bridge void*)self, queue, list->onExecutor);
+    SPTaskTargetAsync(queue, list->onExecutor, ^{
+        SPTaskTraceDequeue((__bridge void*)self, flow);
+        // Whoever runs us keeps the queue or executor alive while doing so, so it's fine for
+        // the continuations to release their references to it.
+        SPTaskThreadState *threadState = SPTaskThreadStateForCurrentThread();
+        void *previousQueue = threadState->currentQueue;
+        threadState->currentQueue = queue;
+        [self runContinuations:list forState:state];
+        threadState->currentQueue = previousQueue;
+    });
+}
+
+#define SPTaskDeliveryGroupLimit 8
+
+/// Delivers (and recycles) the continuations in 'list', which must already be detached from
+/// the state word and in registration order.
+///
+/// Rather than one dispatch_async per continuation, continuations are grouped by target queue
+/// and each group is submitted as a single block which runs the group in registration order,
+/// followed by the group's finallys. A broadcast to dozens of main queue listeners thus costs
+/// one main queue wakeup. If a task has continuations on more distinct queues than we have
+/// groups, the oldest group is submitted early; queues aren't ordered against each other, so
+/// nothing can tell the difference.
+- (void)deliverContinuations:(SPTaskContinuation*)list forState:(uintptr_t)state
+{
+    struct {
+        void *queue;
+        SPTaskContinuation *head, *tail;
+        SPTaskContinuation *finallyHead, *finallyTail;
+    } groups[SPTaskDeliveryGroupLimit];
+    int groupCount = 0;
+    
+    while(list) {
+        SPTaskContinuation *continuation = list;
+        list = continuation->next;
+        continuation->next = NULL;
+        
+        if(!SPTaskContinuationApplies(continuation->kind, state)) {
+            (void)(__bridge_transfer id)continuation->callback;
+            SPTaskContinuationRecycle(continuation);
+            continue;
+        }
+        if(!continuation->queue) {
+            [self runContinuations:continuation forState:state];
+            continue;
+        }
+        
+        int i = 0;
+        while(i < groupCount && groups[i].queue != continuation->queue)
+            i++;
+        if(i == groupCount) {
+            if(groupCount == SPTaskDeliveryGroupLimit) {
+                [self submitGroupHead:groups[0].head tail:groups[0].tail finallys:groups[0].finallyHead forState:state];
+                i = 0;
+            } else {
+                groupCount++;
+            }
+            groups[i].queue = continuation->queue;
+            groups[i].head = groups[i].tail = NULL;
+            groups[i].finallyHead = groups[i].finallyTail = NULL;
+        }
+        
+        if(continuation->kind == SPTaskContinuationFinally) {
+            if(groups[i].finallyTail)
+                groups[i].finallyTail->next = continuation;
+            else
+                groups[i].finallyHead = continuation;
+            groups[i].finallyTail = continuation;
+        } else {
+            if(groups[i].tail)
+                groups[i].tail->next = continuation;
+            else
+                groups[i].head = continuation;
+            groups[i].tail = continuation;
+        }
+    }
+    
+    for(int i = 0; i < groupCount; i++)
+        [self submitGroupHead:groups[i].head tail:groups[i].tail finallys:groups[i].finallyHead forState:state];
+}
+
+- (void)submitGroupHead:(SPTaskContinuation*)head tail:(SPTaskContinuation*)tail finallys:(SPTaskContinuation*)finallys forState:(uintptr_t)state
+{
+    if(tail)
+        tail->next = finallys;
+    else
+        head = finallys;
+    [self submitContinuations:head forState:state];
+}
+
+- (SPTaskContinuation*)claimContinuation
+{
+    unsigned used = atomic_load_explicit(&_inlineContinuationsUsed, memory_order_relaxed);
+    while(used != 0x3) {
+        unsigned slot = (used & 0x1) ? 1 : 0;
+        if(atomic_compare_exchange_weak_explicit(&_inlineContinuationsUsed, &used, used | (1u << slot), memory_order_relaxed, memory_order_relaxed)) {
+            SPTaskContinuation *continuation = &_inlineContinuations[slot];
+            continuation->isInline = YES;
+            return continuation;
+        }
+    }
+    return SPTaskContinuationAllocate();
+}
+
+- (void)addContinuation:(SPTaskContinuationKind)kind callback:(id)callback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:kind callback:callback onTarget:SPTaskTargetQueue(queue)];
+}
+
+- (void)addContinuation:(SPTaskContinuationKind)kind callback:(id)callback onTarget:(SPTaskTarget)target
+{
+    SPA_NS(Task) *task = [self linkRoot];
+    uintptr_t state = atomic_load_explicit(&task->_state, memory_order_acquire);
+    if(SPTaskStateIsResolved(state)) {
+        // Already resolved: no need to store anything, deliver right away (but still asynchronously).
+        [task dispatchContinuation:kind callback:callback on:target forState:state];
+        return;
+    }
+    
+    uintptr_t scope = atomic_load_explicit(&task->_scope, memory_order_acquire);
+    if(__builtin_expect(scope != 0, 0) && ![task reserveScopeContinuation:(__bridge SPA_NS(TaskScope)*)(void*)scope]) {
+        // Its scope is full. Only this continuation is turned away: it's delivered as if the
+        // task had failed with the limit error, and the task itself carries on for everybody else.
+        [[SPA_NS(Task) failedTask:SPTaskScopeLimitError()] addContinuation:kind callback:callback onTarget:target];
+        return;
+    }
+    
+    [task pushContinuation:SPTaskContinuationFill([task claimContinuation], kind, callback, target)];
+}
+
+/// Pushes a continuation claimed from the receiver onto the task it follows, or delivers it if
+/// that task has already resolved.
+- (void)pushContinuation:(SPTaskContinuation*)continuation
+{
+    SPA_NS(Task) *task = self;
+    uintptr_t state = atomic_load_explicit(&task->_state, memory_order_acquire);
+    for(;;) {
+        if(state == SPTaskStateLinked) {
+            // Linked while we were setting up.
+            continuation = SPTaskContinuationDetach(continuation);
+            task = task->_linkedTask;
+            state = atomic_load_explicit(&task->_state, memory_order_acquire);
+            continue;
+        }
+        if(SPTaskStateIsResolved(state)) {
+            // Resolved while we were setting up.
+            continuation->next = NULL;
+            [task deliverContinuations:continuation forState:state];
+            return;
+        }
+        continuation->next = (SPTaskContinuation*)state;
+        if(atomic_compare_exchange_weak_explicit(&task->_state, &state, (uintptr_t)continuation, memory_order_release, memory_order_acquire))
+            return;
+    }
+}
+
+- (void)addChildTask:(SPA_NS(Task)*)child
+{
+    // The placeholder task is never cancelled, and mustn't keep anyone's children.
+    if(_shared)
+        return;
+    
+    // Children of a linked task are cancelled along with the task it follows.
+    SPA_NS(Task) *task = [self linkRoot];
+    if(task != self)
+        return [task addChildTask:child];
+    
+    SPTaskChildLink *link = malloc(sizeof(SPTaskChildLink));
+    atomic_init(&link->references, 2);
+    
+    // A linked child is cancelled through the task it follows, and a settled one needs no cancelling.
+    for(;;) {
+        child = [child linkRoot];
+        atomic_init(&link->child, (uintptr_t)(__bridge_retained void*)child);
+        if([child addParentLink:link])
+            break;
+        (void)SPTaskChildLinkTakeChild(link);
+        if(![child linkTargetAfterResolving]) {
+            free(link);
+            return;
+        }
+    }
+    
+    uintptr_t head = atomic_load_explicit(&_childTasks, memory_order_relaxed);
+    do {
+        link->next = (SPTaskChildLink*)head;
+    } while(!atomic_compare_exchange_weak_explicit(&_childTasks, &head, (uintptr_t)link, memory_order_release, memory_order_relaxed));
+    
+    unsigned count = atomic_fetch_add_explicit(&_childTaskCount, 1, memory_order_relaxed) + 1;
+    if(count >= MAX(atomic_load_explicit(&_childTaskPruneLimit, memory_order_relaxed), SPTaskChildPruneMinimum))
+        [self pruneChildTasks];
+}
+
+/// Lists 'link' as one of the receiver's parents. Returns NO if the receiver has already
+/// settled or been linked to another task.
+- (BOOL)addParentLink:(SPTaskChildLink*)link
+{
+    uintptr_t head = atomic_load_explicit(&_parentLinks, memory_order_relaxed);
+    do {
+        if(head == SPTaskChildLinksClosed)
+            return NO;
+        link->nextOfChild = (SPTaskChildLink*)head;
+    } while(!atomic_compare_exchange_weak_explicit(&_parentLinks, &head, (uintptr_t)link, memory_order_release, memory_order_relaxed));
+    return YES;
+}
+
+/// Called once the receiver has settled: takes it out of all of its parents' lists.
+/// NOTE: Releases the parents' references to the receiver, so this must be the last thing done
+/// with it unless the caller holds a reference of its own.
+- (void)dropParentLinks
+{
+    SPTaskChildLinksDrop(atomic_exchange_explicit(&_parentLinks, SPTaskChildLinksClosed, memory_order_acq_rel));
+}
+
+/// Unlinks the links whose children have settled.
+- (void)pruneChildTasks
+{
+    if(atomic_exchange_explicit(&_pruningChildTasks, YES, memory_order_acquire))
+        return;
+    
+    // Take the whole list, so that nobody else walks it while we rearrange it...
+    SPTaskChildLink *list = (SPTaskChildLink*)atomic_exchange_explicit(&_childTasks, 0, memory_order_acquire);
+    SPTaskChildLink *survivors = NULL, *tail = NULL;
+    unsigned kept = 0, dropped = 0;
+    while(list) {
+        SPTaskChildLink *next = list->next;
+        if(atomic_load_explicit(&list->child, memory_order_acquire)) {
+            list->next = NULL;
+            if(tail)
+                tail->next = list;
+            else
+                survivors = list;
+            tail = list;
+            kept++;
+        } else {
+            SPTaskChildLinkRelease(list);
+            dropped++;
+        }
+        list = next;
+    }
+    
+    // ... and put back what's left in front of anything added meanwhile.
+    if(survivors) {
+        uintptr_t head = atomic_load_explicit(&_childTasks, memory_order_relaxed);
+        do {
+            tail->next = (SPTaskChildLink*)head;
+        } while(!atomic_compare_exchange_weak_explicit(&_childTasks, &head, (uintptr_t)survivors, memory_order_release, memory_order_relaxed));
+    }
+    atomic_fetch_sub_explicit(&_childTaskCount, dropped, memory_order_relaxed);
+    atomic_store_explicit(&_childTaskPruneLimit, kept * 2, memory_order_relaxed);
+    atomic_store_explicit(&_pruningChildTasks, NO, memory_order_release);
+    
+    // A cancel that came while the survivors were out of the list will have missed them, and so
+    // will a link to another task, which would have handed them over.
+    if(survivors && atomic_load(&_cancelled))
+        [self cancelChildTasks];
+    if(survivors && atomic_load_explicit(&_state, memory_order_acquire) == SPTaskStateLinked)
+        [self handOverChildTasksTo:_linkedTask];
+}
+
+/// Moves the receiver's children over to 'root', once the receiver follows it.
+- (void)handOverChildTasksTo:(SPA_NS(Task)*)root
+{
+    SPTaskChildLink *list = (SPTaskChildLink*)atomic_exchange_explicit(&_childTasks, 0, memory_order_acquire);
+    if(!list)
+        return;
+    SPTaskChildLink *tail = list;
+    unsigned count = 1;
+    for(; tail->next; tail = tail->next)
+        count++;
+    atomic_fetch_sub_explicit(&_childTaskCount, count, memory_order_relaxed);
+    
+    uintptr_t head = atomic_load_explicit(&root->_childTasks, memory_order_relaxed);
+    do {
+        tail->next = (SPTaskChildLink*)head;
+    } while(!atomic_compare_exchange_weak_explicit(&root->_childTasks, &head, (uintptr_t)list, memory_order_release, memory_order_relaxed));
+    count = atomic_fetch_add_explicit(&root->_childTaskCount, count, memory_order_relaxed) + count;
+    
+    // A cancel that came before they were in root's list will have missed them.
+    if(atomic_load_explicit(&root->_cancelled, memory_order_acquire))
+        [root cancelChildTasks];
+    else if(count >= MAX(atomic_load_explicit(&root->_childTaskPruneLimit, memory_order_relaxed), SPTaskChildPruneMinimum))
+        [root pruneChildTasks];
+}
+
+/// Lists the links in 'list' (by 'nextOfChild') as the receiver's own parents, so that they're
+/// dropped when it settles. If the receiver follows another task by now, they go to that one
+/// instead, which is returned; nil means they've been dropped already.
+- (SPA_NS(Task)*)appendParentLinks:(SPTaskChildLink*)list count:(unsigned*)count
+{
+    SPTaskChildLink *tail = list;
+    *count = 1;
+    for(; tail->nextOfChild; tail = tail->nextOfChild)
+        (*count)++;
+    
+    SPA_NS(Task) *task = self;
+    uintptr_t head = atomic_load_explicit(&task->_parentLinks, memory_order_relaxed);
+    for(;;) {
+        if(head == SPTaskChildLinksClosed) {
+            if(!(task = [task linkTargetAfterResolving])) {
+                SPTaskChildLinksDrop((uintptr_t)list);
+                return nil;
+            }
+            head = atomic_load_explicit(&task->_parentLinks, memory_order_relaxed);
+            continue;
+        }
+        tail->nextOfChild = (SPTaskChildLink*)head;
+        if(atomic_compare_exchange_weak_explicit(&task->_parentLinks, &head, (uintptr_t)list, memory_order_release, memory_order_relaxed))
+            return task;
+    }
+}
+
+/// Takes over the links to the parents of a task that now follows the receiver. Each step of a
+/// long chain of chain: callbacks hands its links over like this, and their parents mostly go
+/// away long before the outermost task settles; so, as with children, the dead ones are
+/// unlinked in batches, to keep the list proportional to the parents still around.
+- (void)adoptParentLinks:(SPTaskChildLink*)list
+{
+    unsigned count;
+    SPA_NS(Task) *task = [self appendParentLinks:list count:&count];
+    if(!task)
+        return;
+    count = atomic_fetch_add_explicit(&task->_parentLinkCount, count, memory_order_relaxed) + count;
+    if(count >= MAX(atomic_load_explicit(&task->_parentLinkPruneLimit, memory_order_relaxed), SPTaskChildPruneMinimum))
+        [task pruneParentLinks];
+}
+
+/// Unlinks the parent links whose parents have let go of the receiver.
+- (void)pruneParentLinks
+{
+    if(atomic_exchange_explicit(&_pruningParentLinks, YES, memory_order_acquire))
+        return;
+    
+    // Take the whole list, unless we've settled (and dropped it) already...
+    uintptr_t head = atomic_load_explicit(&_parentLinks, memory_order_relaxed);
+    do {
+        if(head == SPTaskChildLinksClosed) {
+            atomic_store_explicit(&_pruningParentLinks, NO, memory_order_release);
+            return;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&_parentLinks, &head, 0, memory_order_acquire, memory_order_relaxed));
+    
+    SPTaskChildLink *list = (SPTaskChildLink*)head, *survivors = NULL, *tail = NULL;
+    unsigned kept = 0;
+    while(list) {
+        SPTaskChildLink *next = list->nextOfChild;
+        if(atomic_load_explicit(&list->child, memory_order_acquire)) {
+            list->nextOfChild = NULL;
+            if(tail)
+                tail->nextOfChild = list;
+            else
+                survivors = list;
+            tail = list;
+            kept++;
+        } else {
+            SPTaskChildLinkRelease(list);
+        }
+        list = next;
+    }
+    
+    // ... and put back what's left, which is dropped instead if we settled meanwhile.
+    atomic_store_explicit(&_parentLinkCount, kept, memory_order_relaxed);
+    atomic_store_explicit(&_parentLinkPruneLimit, kept * 2, memory_order_relaxed);
+    unsigned count;
+    if(survivors)
+        [self appendParentLinks:survivors count:&count];
+    atomic_store_explicit(&_pruningParentLinks, NO, memory_order_release);
+}
+
+/// Moves the task into 'resolvedState' and delivers its continuations. Returns NO without
+/// touching anything if some other thread already resolved (or cancelled) the task.
+- (BOOL)resolveToState:(uintptr_t)resolvedState value:(id)value error:(NSError*)error
+{
+    if(atomic_exchange_explicit(&_resolving, YES, memory_order_acquire))
+        return NO;
+    
+    _completedValue = value;
+    _completedError = error;
+    [self publishState:resolvedState];
+    return YES;
+}
+
+/// resolveToState:value:error: for a scalar result.
+- (BOOL)resolveWithScalar:(SPTaskScalar)scalar
+{
+    if(atomic_exchange_explicit(&_resolving, YES, memory_order_acquire))
+        return NO;
+    
+    _scalar = scalar;
+    [self publishState:SPTaskStateSucceeded];
+    return YES;
+}
+
+/// Second half of resolving, once the result has been written: makes it visible, and delivers
+/// the continuations.
+- (void)publishState:(uintptr_t)resolvedState
+{
+    uintptr_t list = atomic_exchange_explicit(&_state, resolvedState, memory_order_acq_rel);
+    SPTaskTraceEvent(resolvedState == SPTaskStateSucceeded ? SPTaskTraceSucceeded : resolvedState == SPTaskStateFailed ? SPTaskTraceFailed : SPTaskTraceCancelled, (__bridge void*)self, NULL);
+    [self deliverContinuations:SPTaskContinuationReverse((SPTaskContinuation*)list) forState:resolvedState];
+    [self leaveScope];
+    [self dropParentLinks];
+}
+
+/// Makes the receiver follow 'root' from now on, handing all of its continuations over to it.
+/// Returns NO without touching anything if the receiver is already resolving.
+- (BOOL)linkToTask:(SPA_NS(Task)*)root
+{
+    if(atomic_exchange_explicit(&_resolving, YES, memory_order_acquire))
+        return NO;
+    
+    _linkedTask = root;
+    uintptr_t list = atomic_exchange_explicit(&_state, SPTaskStateLinked, memory_order_acq_rel);
+    SPTaskContinuation *continuation = SPTaskContinuationReverse((SPTaskContinuation*)list);
+    while(continuation) {
+        SPTaskContinuation *next = continuation->next;
+        [root pushContinuation:SPTaskContinuationDetach(continuation)];
+        continuation = next;
+    }
+    
+    // Our children and our parents' links go over to the task we now follow, which cancels and
+    // settles in our place. Parents added from now on go straight to it.
+    [self handOverChildTasksTo:root];
+    SPTaskChildLink *parentLinks = (SPTaskChildLink*)atomic_exchange_explicit(&_parentLinks, SPTaskChildLinksClosed, memory_order_acq_rel);
+    if(parentLinks && (uintptr_t)parentLinks != SPTaskChildLinksClosed)
+        [root adoptParentLinks:parentLinks];
+    
+    // Somebody may have cancelled us just before we linked.
+    if(atomic_load_explicit(&_cancelled, memory_order_acquire))
+        [root cancel];
+    // The task we follow carries on with what we were doing, so it takes our place in our scope.
+    uintptr_t scope = atomic_load_explicit(&_scope, memory_order_acquire);
+    [self leaveScope];
+    if(scope)
+        [root joinScope:(__bridge SPA_NS(TaskScope)*)(void*)scope];
+    return YES;
+}
+
+/// Completes the receiver with 'task', for chain: and recover:. A task they made themselves is
+/// linked, if nobody got to it first; anything else is followed, and cancelled along with the
+/// receiver like any other child.
+- (void)adoptTask:(SPA_NS(Task)*)task
+{
+    if(!task)
+        return;
+    
+    SPA_NS(Task) *root = [self linkRoot];
+    NSAssert([task linkRoot] != root, @"Can't complete a task with itself");
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)task, (__bridge void*)self);
+    // linkToTask: turns away a task that is already resolving, or linked to somebody else.
+    if(task->_linkable && [task linkToTask:root])
+        return;
+    
+    [self addChildTask:task];
+    [self followTask:task];
+}
+
+/// Completes the receiver with the outcome of 'task', without touching 'task' itself, which
+/// may have other observers.
+- (void)followTask:(SPA_NS(Task)*)task
+{
+    [task addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        if(succeeded)
+            [self completeWithValue:result];
+        else
+            [self failWithError:result ignoreIfAlreadyCompleted:NO];
+    } on:SPTaskInlineQueue()];
+    [task addContinuation:SPTaskContinuationCancellation callback:^{
+        [self cancel];
+    } on:nil];
+}
+
+- (instancetype)addCallback:(SPTaskCallback)callback onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    [self addContinuation:SPTaskContinuationValue callback:callback onTarget:SPTaskTargetExecutor(executor)];
+    return self;
+}
+
+- (instancetype)addErrorCallback:(SPTaskErrback)errback onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    [self addContinuation:SPTaskContinuationError callback:errback onTarget:SPTaskTargetExecutor(executor)];
+    return self;
+}
+
+- (instancetype)addFinallyCallback:(SPTaskFinally)finally onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    [self addContinuation:SPTaskContinuationFinally callback:finally onTarget:SPTaskTargetExecutor(executor)];
+    return self;
+}
+
+- (instancetype)addCallback:(SPTaskCallback)callback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationValue callback:callback on:queue];
+    return self;
+}
+
+- (instancetype)addCallback:(SPTaskCallback)callback
+{
+    return [self addCallback:callback on:dispatch_get_main_queue()];
+}
+
+- (instancetype)addErrorCallback:(SPTaskErrback)errback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationError callback:errback on:queue];
+    return self;
+}
+
+- (instancetype)addErrorCallback:(SPTaskErrback)errback
+{
+    return [self addErrorCallback:errback on:dispatch_get_main_queue()];
+}
+
+- (instancetype)addFinallyCallback:(SPTaskFinally)finally on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationFinally callback:finally on:queue];
+    return self;
+}
+    
+    
+- (instancetype)addFinallyCallback:(SPTaskFinally)finally
+{
+    return [self addFinallyCallback:finally on:dispatch_get_main_queue()];
+}
+
++ (instancetype)awaitAll:(NSArray*)tasks
+{
+    return [self awaitAll:tasks on:SPTaskInlineQueue()];
+}
+
++ (instancetype)awaitAll:(NSArray*)tasks on:(dispatch_queue_t)queue
+{
+    return [self join:SPTaskJoinAll tasks:tasks on:queue];
+}
+
++ (instancetype)awaitAny:(NSArray*)tasks
+{
+    return [self awaitAny:tasks on:SPTaskInlineQueue()];
+}
+
++ (instancetype)awaitAny:(NSArray*)tasks on:(dispatch_queue_t)queue
+{
+    return [self join:SPTaskJoinAny tasks:tasks on:queue];
+}
+
++ (instancetype)awaitFirstSuccess:(NSArray*)tasks
+{
+    return [self awaitFirstSuccess:tasks on:SPTaskInlineQueue()];
+}
+
++ (instancetype)awaitFirstSuccess:(NSArray*)tasks on:(dispatch_queue_t)queue
+{
+    return [self join:SPTaskJoinFirstSuccess tasks:tasks on:queue];
+}
+
++ (instancetype)awaitAllSettled:(NSArray*)tasks
+{
+    return [self awaitAllSettled:tasks on:SPTaskInlineQueue()];
+}
+
++ (instancetype)awaitAllSettled:(NSArray*)tasks on:(dispatch_queue_t)queue
+{
+    return [self join:SPTaskJoinAllSettled tasks:tasks on:queue];
+}
+
+/// Shared implementation of the awaitAll: family. Each child reports its outcome into its own
+/// slot of a preallocated buffer and counts down an atomic counter, so children can finish on
+/// any number of threads at once without locking or hashing; whichever outcome settles the join
+/// (the last one in, or the first deciding one) resolves the returned task.
++ (instancetype)join:(SPTaskJoinKind)kind tasks:(NSArray*)tasks on:(dispatch_queue_t)queue
+{
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    tasks = [tasks copy];
+    NSUInteger count = [tasks count];
+    
+    if(count == 0) {
+        if(kind == SPTaskJoinAll || kind == SPTaskJoinAllSettled)
+            [source completeWithValue:@[]];
+        return source.task;
+    }
+    
+    SPA_NS(Task) *joined = source.task;
+    SPA_NS(TaskJoin) *join = [[SPA_NS(TaskJoin) alloc] initWithCount:count];
+    
+    // Cancel the stragglers once the outcome is decided.
+    void(^cancelIncomplete)(void) = ^{
+        for(SPA_NS(Task) *task in tasks) {
+            if(!task.completed)
+                [task cancel];
+        }
+    };
+    // Nothing more will come of a task that has been cancelled, which decides some joins.
+    dispatch_block_t onCancel = ^{
+        if(kind == SPTaskJoinAny || kind == SPTaskJoinFirstSuccess) {
+            if(![join countDown])
+                return;
+            NSError *error = kind == SPTaskJoinFirstSuccess ? [join firstError] : nil;
+            if(error && [join settle])
+                return [source failWithError:error];
+        }
+        if([join settle])
+            [joined cancel];
+    };
+    
+    NSUInteger i = 0;
+    for(SPA_NS(Task) *task in tasks) {
+        [joined addChildTask:task];
+        SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)task, (__bridge void*)joined);
+        
+        [task addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+            switch(kind) {
+                case SPTaskJoinAll:
+                    if(!succeeded) {
+                        if([join settle]) {
+                            [source failWithError:result];
+                            cancelIncomplete();
+                        }
+                        return;
+                    }
+                    join->_results[i] = result ?: [NSNull null];
+                    if([join countDown] && [join settle])
+                        [source completeWithValue:[join results]];
+                    break;
+                case SPTaskJoinAny:
+                    if([join settle]) {
+                        if(succeeded)
+                            [source completeWithValue:result];
+                        else
+                            [source failWithError:result];
+                    }
+                    break;
+                case SPTaskJoinFirstSuccess:
+                    if(succeeded) {
+                        if([join settle]) {
+                            [source completeWithValue:result];
+                            cancelIncomplete();
+                        }
+                        return;
+                    }
+                    join->_results[i] = result;
+                    if([join countDown] && [join settle])
+                        [source failWithError:[join firstError]];
+                    break;
+                case SPTaskJoinAllSettled:
+                    join->_results[i] = result ?: [NSNull null];
+                    if([join countDown] && [join settle])
+                        [source completeWithValue:[join results]];
+                    break;
+            }
+        } on:queue];
+        [task addContinuation:SPTaskContinuationCancellation callback:onCancel on:nil];
+        
+        i++;
+    }
+    return joined;
+}
+
+- (void)completeWithValue:(id)value
+{
+    if([value isKindOfClass:[NSError class]]) {
+        return [self failWithError:value ignoreIfAlreadyCompleted:NO];
+    }
+    
+    if(self.cancelled)
+        return;
+    
+    if([self resolveToState:SPTaskStateSucceeded value:value error:nil])
+        return;
+    
+    SPA_NS(Task) *linkedTask = [self linkTargetAfterResolving];
+    if(linkedTask)
+        return [linkedTask completeWithValue:value];
+    NSAssert(self.cancelled || _rejected, @"Can't complete a task twice");
+}
+
+- (void)completeWithScalar:(SPTaskScalar)scalar
+{
+    if(self.cancelled)
+        return;
+    
+    if([self resolveWithScalar:scalar])
+        return;
+    
+    SPA_NS(Task) *linkedTask = [self linkTargetAfterResolving];
+    if(linkedTask)
+        return [linkedTask completeWithScalar:scalar];
+    NSAssert(self.cancelled || _rejected, @"Can't complete a task twice");
+}
+
+- (void)failWithError:(NSError*)error ignoreIfAlreadyCompleted:(BOOL)ignoreSubsequentValues
+{
+    if(self.cancelled)
+        return;
+    
+    if([self resolveToState:SPTaskStateFailed value:nil error:error])
+        return;
+    
+    SPA_NS(Task) *linkedTask = [self linkTargetAfterResolving];
+    if(linkedTask)
+        return [linkedTask failWithError:error ignoreIfAlreadyCompleted:ignoreSubsequentValues];
+    if(!ignoreSubsequentValues) {
+        NSAssert(self.cancelled || _rejected, @"Can't complete a task twice");
+    }
+}
+@end
+
+@implementation SPA_NS(Task) (SPTaskCancellation)
+@dynamic cancelled; // provided in main implementation block
+
+- (void)cancel
+{
+    if(_shared)
+        return;
+    BOOL shouldCancel = !atomic_exchange_explicit(&_cancelled, YES, memory_order_acq_rel);
+    BOOL didResolve = NO;
+    
+    if(shouldCancel) {
+        // Run cancellation handlers, and break any circular references between source<> task
+        // by dropping callbacks and errbacks which might reference the source
+        if(!atomic_exchange_explicit(&_resolving, YES, memory_order_acquire)) {
+            uintptr_t list = atomic_exchange_explicit(&_state, SPTaskStateCancelled, memory_order_acq_rel);
+            SPTaskTraceEvent(SPTaskTraceCancelled, (__bridge void*)self, NULL);
+            [self deliverContinuations:SPTaskContinuationReverse((SPTaskContinuation*)list) forState:SPTaskStateCancelled];
+            didResolve = YES;
+        } else {
+            // Cancelling a linked task cancels the task it follows.
+            [[self linkTargetAfterResolving] cancel];
+        }
+    }
+    
+    [self cancelChildTasks];
+    if(didResolve) {
+        [self leaveScope];
+        [self dropParentLinks];
+    }
+}
+
+- (void)cancelChildTasks
+{
+    // Taking the whole list means each child is cancelled (and let go of) exactly once, even if
+    // we're cancelled from several threads at once. Cancelled children settle, so there's no
+    // need to keep them around.
+    SPTaskChildLink *link = (SPTaskChildLink*)atomic_exchange_explicit(&_childTasks, 0, memory_order_acquire);
+    unsigned taken = 0;
+    while(link) {
+        SPTaskChildLink *next = link->next;
+        SPA_NS(Task) *child = SPTaskChildLinkTakeChild(link);
+        SPTaskChildLinkRelease(link);
+        [child cancel];
+        taken++;
+        link = next;
+    }
+    atomic_fetch_sub_explicit(&_childTaskCount, taken, memory_order_relaxed);
+}
+@end
+
+@implementation SPA_NS(Task) (SPTaskExtended)
+- (instancetype)then:(SPTaskThenCallback)worker on:(dispatch_queue_t)queue
+{
+    return [self then:worker onTarget:SPTaskTargetQueue(queue) from:__builtin_return_address(0)];
+}
+
+- (instancetype)then:(SPTaskThenCallback)worker onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self then:worker onTarget:SPTaskTargetExecutor(executor) from:__builtin_return_address(0)];
+}
+
+- (instancetype)then:(SPTaskThenCallback)worker onTarget:(SPTaskTarget)target from:(void*)callSite
+{
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *then = source.task;
+    then->_callSite = SPTaskCallSiteDerive(_callSite, callSite);
+    then->_linkable = YES;
+    [self addChildTask:then];
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)self, (__bridge void*)then);
+    atomic_store_explicit(&then->_producerQueue, target.isExecutor ? 0 : (uintptr_t)target.queue, memory_order_relaxed);
+    
+    [self addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        atomic_store_explicit(&then->_producerQueue, 0, memory_order_relaxed);
+        if(!succeeded) {
+            [source failWithError:result];
+            return;
+        }
+        void *previousScope = SPTaskScopeEnter((void*)atomic_load_explicit(&then->_scope, memory_order_acquire));
+        id value = worker(result);
+        SPTaskScopeLeave(previousScope);
+        [source completeWithValue:value];
+    } onTarget:target];
+
+    return then;
+}
+    
+- (instancetype)chain:(SPTaskChainCallback)chainer on:(dispatch_queue_t)queue
+{
+    return [self chain:chainer onTarget:SPTaskTargetQueue(queue) from:__builtin_return_address(0)];
+}
+
+- (instancetype)chain:(SPTaskChainCallback)chainer onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self chain:chainer onTarget:SPTaskTargetExecutor(executor) from:__builtin_return_address(0)];
+}
+
+- (instancetype)chain:(SPTaskChainCallback)chainer onTarget:(SPTaskTarget)target from:(void*)callSite
 {
-    @synchronized(_callbacks) {
-        if(_isCompleted) {
-            if(!_completedError) {
-                dispatch_async(queue, ^{
-                    callback(self->_completedValue);
-                });
-            }
-        } else {
-            [_callbacks addObject:[[SPA_NS(CallbackHolder) alloc] initWithCallback:callback onQueue:queue]];
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *chain = source.task;
+    chain->_callSite = SPTaskCallSiteDerive(_callSite, callSite);
+    chain->_linkable = YES;
+    [self addChildTask:chain];
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)self, (__bridge void*)chain);
+    atomic_store_explicit(&chain->_producerQueue, target.isExecutor ? 0 : (uintptr_t)target.queue, memory_order_relaxed);
+    
+    [self addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        atomic_store_explicit(&chain->_producerQueue, 0, memory_order_relaxed);
+        if(!succeeded) {
+            [source failWithError:result];
+            return;
         }
-    }
-    return self;
+        void *previousScope = SPTaskScopeEnter((void*)atomic_load_explicit(&chain->_scope, memory_order_acquire));
+        SPA_NS(Task) *workToBeProvided = chainer(result);
+        SPTaskScopeLeave(previousScope);
+        [chain adoptTask:workToBeProvided];
+    } onTarget:target];
+
+    return chain;
 }
 
-- (instancetype)addCallback:(SPTaskCallback)callback
+- (instancetype)chain
 {
-    return [self addCallback:callback on:dispatch_get_main_queue()];
+    return [self chain:^SPA_NS(Task) *(id value) {
+        return value;
+    } onTarget:SPTaskTargetQueue(SPTaskInlineQueue()) from:__builtin_return_address(0)];
 }
 
-- (instancetype)addErrorCallback:(SPTaskErrback)errback on:(dispatch_queue_t)queue
+- (instancetype)recover:(SPTaskRecoverCallback)recoverer on:(dispatch_queue_t)queue
 {
-    @synchronized(_callbacks) {
-        if(_isCompleted) {
-            if(_completedError) {
-                dispatch_async(queue, ^{
-                    errback(self->_completedError);
-                });
-            }
-        } else {
-            [_errbacks addObject:[[SPA_NS(CallbackHolder) alloc] initWithCallback:errback onQueue:queue]];
-        }
-    }
-    return self;
+    return [self recover:recoverer onTarget:SPTaskTargetQueue(queue) from:__builtin_return_address(0)];
 }
 
-- (instancetype)addErrorCallback:(SPTaskErrback)errback
+- (instancetype)recover:(SPTaskRecoverCallback)recoverer onExecutor:(id<SPA_NS(Executor)>)executor
 {
-    return [self addErrorCallback:errback on:dispatch_get_main_queue()];
+    return [self recover:recoverer onTarget:SPTaskTargetExecutor(executor) from:__builtin_return_address(0)];
 }
 
-- (instancetype)addFinallyCallback:(SPTaskFinally)finally on:(dispatch_queue_t)queue
+- (instancetype)recover:(SPTaskRecoverCallback)recoverer onTarget:(SPTaskTarget)target from:(void*)callSite
 {
-    @synchronized(_callbacks) {
-        if(_isCompleted) {
-            dispatch_async(queue, ^{
-                finally(self->_isCancelled);
-            });
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *chain = source.task;
+    chain->_callSite = SPTaskCallSiteDerive(_callSite, callSite);
+    chain->_linkable = YES;
+    [self addChildTask:chain];
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)self, (__bridge void*)chain);
+    atomic_store_explicit(&chain->_producerQueue, target.isExecutor ? 0 : (uintptr_t)target.queue, memory_order_relaxed);
+    
+    [self addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        atomic_store_explicit(&chain->_producerQueue, 0, memory_order_relaxed);
+        if(succeeded) {
+            [source completeWithValue:result];
+            return;
+        }
+        void *previousScope = SPTaskScopeEnter((void*)atomic_load_explicit(&chain->_scope, memory_order_acquire));
+        SPA_NS(Task) *workToBeProvided = recoverer(result);
+        SPTaskScopeLeave(previousScope);
+        if(!workToBeProvided) {
+            [source failWithError:result];
         } else {
-            [_finallys addObject:[[SPA_NS(CallbackHolder) alloc] initWithCallback:(id)finally onQueue:queue]];
+            [chain adoptTask:workToBeProvided];
         }
-    }
-    return self;
+    } onTarget:target];
+
+    return chain;
+
 }
+@end
+
+@implementation SPA_NS(Task) (SPTaskTimeout)
+- (instancetype)timeout:(NSTimeInterval)timeout
+{
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *timed = source.task;
+    [self addChildTask:timed];
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)self, (__bridge void*)timed);
     
+    // Whichever of the timer and the receiver resolves 'timed' first wins; the other is ignored.
+    SPA_NS(TaskTimer) *timer = [SPA_NS(TaskTimer) timerWithDelay:timeout queue:nil handler:^{
+        NSError *error = [NSError errorWithDomain:SPA_NS(TaskErrorDomain) code:SPTaskErrorTimedOut userInfo:@{
+            NSLocalizedDescriptionKey: @"The operation timed out.",
+        }];
+        if([timed resolveToState:SPTaskStateFailed value:nil error:error])
+            [self cancel];
+    }];
+    [self addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        if(succeeded)
+            [timed resolveToState:SPTaskStateSucceeded value:result error:nil];
+        else
+            [timed resolveToState:SPTaskStateFailed value:nil error:result];
+    } on:SPTaskInlineQueue()];
+    [timed addContinuation:SPTaskContinuationFinally callback:^(BOOL cancelled) {
+        [timer disarm];
+    } on:nil];
     
-- (instancetype)addFinallyCallback:(SPTaskFinally)finally
+    return timed;
+}
+
+- (instancetype)deadline:(NSDate*)deadline
 {
-    return [self addFinallyCallback:finally on:dispatch_get_main_queue()];
+    return [self timeout:[deadline timeIntervalSinceNow]];
+}
+@end
+
+/// 'delay', shortened by a random fraction of up to 'jitter' of it.
+static NSTimeInterval SPTaskJitteredDelay(NSTimeInterval delay, double jitter)
+{
+    jitter = MIN(MAX(jitter, 0.0), 1.0);
+    return delay * (1.0 - jitter * ((double)arc4random() / UINT32_MAX));
 }
 
-+ (instancetype)awaitAll:(NSArray*)tasks
+@implementation SPA_NS(Task) (SPTaskRetry)
++ (instancetype)retry:(SPTaskTaskGeneratingCallback)work attempts:(NSUInteger)attempts backoff:(NSTimeInterval)backoff jitter:(double)jitter
 {
+    NSParameterAssert(attempts > 0);
     SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-		
-	if([tasks count] == 0) {
-		[source completeWithValue:@[]];
-			return source.task;
-	}
-    
-    NSMutableArray *values = [NSMutableArray new];
-    NSMutableSet *remainingTasks = [NSMutableSet setWithArray:tasks];
+    SPA_NS(Task) *retried = source.task;
+    [source completeWithTask:[self retryAttempt:1 of:attempts work:work backoff:backoff jitter:jitter retried:retried]];
+    return retried;
+}
+
+/// Runs attempt number 'attempt', recovering from its failure with the next one after 'delay'.
++ (SPA_NS(Task)*)retryAttempt:(NSUInteger)attempt of:(NSUInteger)attempts work:(SPTaskTaskGeneratingCallback)work backoff:(NSTimeInterval)delay jitter:(double)jitter retried:(SPA_NS(Task)*)retried
+{
+    SPA_NS(Task) *task = work() ?: [SPA_NS(Task) nilPlaceholderTask];
+    [retried addContinuation:SPTaskContinuationCancellation callback:^{
+        [task cancel];
+    } on:nil];
+    if(attempt >= attempts)
+        return task;
     
-    int i = 0;
-    for(SPA_NS(Task) *task in tasks) {
-        [source.task->_childTasks addObject:task];
-        
-        __weak SPA_NS(Task) *weakTask = task;
-        
-        [values addObject:[NSNull null]];
-        [[[task addCallback:^(id value) {
-            if(value)
-                [values replaceObjectAtIndex:i withObject:value];
-            
-            [remainingTasks removeObject:weakTask];
-            if([remainingTasks count] == 0)
-                [source completeWithValue:values];
-        } on:dispatch_get_main_queue()] addErrorCallback:^(NSError *error) {
-            if ([remainingTasks count] == 0) {
+    return [task recover:^SPA_NS(Task)*(NSError *error) {
+        SPA_NS(TaskCompletionSource) *next = [SPA_NS(TaskCompletionSource) new];
+        SPA_NS(TaskTimer) *timer = [SPA_NS(TaskTimer) timerWithDelay:SPTaskJitteredDelay(delay, jitter) queue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) handler:^{
+            if(next.task.cancelled)
                 return;
-            }
-            
-            [remainingTasks removeObject:weakTask];
-            [source failWithError:error];
-            
-            [remainingTasks makeObjectsPerformSelector:@selector(cancel)];
-            [remainingTasks removeAllObjects];
-            [values removeAllObjects];
-        } on:dispatch_get_main_queue()] addFinallyCallback:^(BOOL canceled) {
-            if(canceled) {
-                [source.task cancel];
-            }
-        } on:dispatch_get_main_queue()];
-        
-        i++;
-    }
-    return source.task;
+            [next completeWithTask:[self retryAttempt:attempt + 1 of:attempts work:work backoff:delay * 2 jitter:jitter retried:retried]];
+        }];
+        [next addCancellationCallback:^{
+            [timer disarm];
+        }];
+        return next.task;
+    } on:SPTaskInlineQueue()];
 }
 
-- (void)completeWithValue:(id)value
++ (instancetype)hedge:(SPTaskTaskGeneratingCallback)work after:(NSTimeInterval)delay maxCopies:(NSUInteger)maxCopies
 {
-    if([value isKindOfClass:[NSError class]]) {
-        return [self failWithError:value ignoreIfAlreadyCompleted:NO];
-    }
+    NSParameterAssert(maxCopies > 0);
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *hedged = source.task;
+    SPA_NS(TaskHedge) *hedge = [SPA_NS(TaskHedge) new];
+    [source addCancellationCallback:^{
+        [hedge finish];
+    }];
+    [self launchCopyOf:work hedge:hedge after:delay maxCopies:maxCopies hedged:hedged];
+    return hedged;
+}
 
-    NSAssert(!_isCompleted, @"Can't complete a task twice");
-    if(_isCompleted)
++ (void)launchCopyOf:(SPTaskTaskGeneratingCallback)work hedge:(SPA_NS(TaskHedge)*)hedge after:(NSTimeInterval)delay maxCopies:(NSUInteger)maxCopies hedged:(SPA_NS(Task)*)hedged
+{
+    pthread_mutex_lock(&hedge->_lock);
+    if(hedge->_done || hedge->_launched == maxCopies) {
+        pthread_mutex_unlock(&hedge->_lock);
         return;
+    }
+    hedge->_launched++;
+    SPA_NS(TaskTimer) *previousTimer = hedge->_timer;
+    hedge->_timer = nil;
+    pthread_mutex_unlock(&hedge->_lock);
+    [previousTimer disarm];
     
-    if(self.cancelled)
-        return;
+    SPA_NS(Task) *copy = work() ?: [SPA_NS(Task) nilPlaceholderTask];
     
-    NSArray *callbacks = nil;
-    NSArray *finallys = nil;
-    @synchronized(_callbacks) {
-        _isCompleted = YES;
-        _completedValue = value;
-        callbacks = [_callbacks copy];
-        finallys = [_finallys copy];
-    
-        for(SPA_NS(CallbackHolder) *holder in callbacks) {
-            dispatch_async(holder.callbackQueue, ^{
-                if(self.cancelled)
-                    return;
-                
-                holder.callback(value);
-            });
-        }
-        
-        for(SPA_NS(CallbackHolder) *holder in finallys) {
-            dispatch_async(holder.callbackQueue, ^{
-                ((SPTaskFinally)holder.callback)(self.cancelled);
-            });
+    pthread_mutex_lock(&hedge->_lock);
+    BOOL done = hedge->_done;
+    if(!done) {
+        [hedge->_copies addObject:copy];
+        if(hedge->_launched < maxCopies && !hedge->_timer) {
+            hedge->_timer = [SPA_NS(TaskTimer) timerWithDelay:delay queue:dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0) handler:^{
+                [self launchCopyOf:work hedge:hedge after:delay maxCopies:maxCopies hedged:hedged];
+            }];
         }
-        
-        [_callbacks removeAllObjects];
-        [_errbacks removeAllObjects];
-        [_finallys removeAllObjects];
-    }
-}
-
-- (void)failWithError:(NSError*)error ignoreIfAlreadyCompleted:(BOOL)ignoreSubsequentValues
-{
-    if(!ignoreSubsequentValues) {
-        NSAssert(!_isCompleted, @"Can't complete a task twice");
     }
-    if(_isCompleted)
+    pthread_mutex_unlock(&hedge->_lock);
+    if(done) {
+        [copy cancel];
         return;
+    }
     
-    if(self.cancelled)
-        return;
-
-    NSArray *errbacks = nil;
-    NSArray *finallys = nil;
-    @synchronized(_callbacks) {
-        _isCompleted = YES;
-        _completedError = error;
-        errbacks = [_errbacks copy];
-        finallys = [_finallys copy];
-        
-        for(SPA_NS(CallbackHolder) *holder in errbacks) {
-            dispatch_async(holder.callbackQueue, ^{
-                holder.callback(error);
-            });
+    // A copy that fails or is cancelled makes way for the next one right away. Once they've
+    // all failed, so does the hedge, with the last error.
+    void(^giveUp)(NSError*) = ^(NSError *error) {
+        pthread_mutex_lock(&hedge->_lock);
+        if(hedge->_done) {
+            // Lost to another copy, or the hedge was cancelled.
+            pthread_mutex_unlock(&hedge->_lock);
+            return;
         }
+        hedge->_settled++;
+        if(error)
+            hedge->_lastError = error;
+        BOOL more = hedge->_launched < maxCopies;
+        BOOL allGone = !more && hedge->_settled == hedge->_launched;
+        NSError *lastError = hedge->_lastError;
+        pthread_mutex_unlock(&hedge->_lock);
         
-        for(SPA_NS(CallbackHolder) *holder in finallys) {
-            dispatch_async(holder.callbackQueue, ^{
-                ((SPTaskFinally)holder.callback)(self.cancelled);
-            });
+        if(more) {
+            [self launchCopyOf:work hedge:hedge after:delay maxCopies:maxCopies hedged:hedged];
+        } else if(allGone) {
+            if(!lastError)
+                [hedged cancel];
+            else if([hedged resolveToState:SPTaskStateFailed value:nil error:lastError])
+                [hedge finish];
         }
+    };
+    [copy addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        if(!succeeded)
+            return giveUp(result);
+        if([hedged resolveToState:SPTaskStateSucceeded value:result error:nil])
+            [hedge finish];
+    } on:SPTaskInlineQueue()];
+    [copy addContinuation:SPTaskContinuationCancellation callback:^{
+        giveUp(nil);
+    } on:nil];
+}
+@end
 
-        
-        [_callbacks removeAllObjects];
-        [_errbacks removeAllObjects];
-		[_finallys removeAllObjects];
+@implementation SPA_NS(Task) (SPTaskInlineExecution)
++ (dispatch_queue_t)inlineQueue
+{
+    return SPTaskInlineQueue();
+}
+
+- (BOOL)getCompletedValue:(id*)value error:(NSError**)error
+{
+    SPA_NS(Task) *root = [self linkRoot];
+    uintptr_t state = atomic_load_explicit(&root->_state, memory_order_acquire);
+    if(state == SPTaskStateSucceeded) {
+        if(value)
+            *value = root->_scalar.type ? [root boxedScalar] : root->_completedValue;
+        if(error)
+            *error = nil;
+        return YES;
+    }
+    if(state == SPTaskStateFailed) {
+        if(value)
+            *value = nil;
+        if(error)
+            *error = root->_completedError;
+        return YES;
     }
+    return NO;
 }
 @end
 
-@implementation SPA_NS(Task) (SPTaskCancellation)
-@dynamic cancelled; // provided in main implementation block as a synthesize
-
-- (void)cancel
+@implementation SPA_NS(Task) (SPTaskWaiting)
+- (id)waitWithTimeout:(NSTimeInterval)timeout error:(NSError**)error
 {
-    BOOL shouldCancel = NO;
-    @synchronized(self) {
-        shouldCancel = !self.cancelled;
-        self.cancelled = YES;
+    SPA_NS(Task) *root = [self resolvedLinkRoot];
+    if(!root && timeout > 0) {
+        // The main queue's callbacks can't run while we're blocking the main thread.
+        uintptr_t producer = atomic_load_explicit(&[self linkRoot]->_producerQueue, memory_order_relaxed);
+        if(producer && producer == (uintptr_t)SPTaskQueueIdentity(dispatch_get_main_queue()) && [NSThread isMainThread]) {
+            if(error)
+                *error = SPTaskWaitError(SPTaskErrorWouldDeadlock);
+            return nil;
+        }
+        
+        uint64_t deadline = SPTaskWaitDeadline(timeout);
+        for(int i = 0; i < SPTaskWaitSpinLimit && !(root = [self resolvedLinkRoot]); i++)
+            SPTaskCPURelax();
+        if(!root)
+            root = [self parkUntil:deadline];
     }
     
-    if(shouldCancel) {
-        [_source cancel];
-        // break any circular references between source<> task by removing
-        // callbacks and errbacks which might reference the source
-        @synchronized(_callbacks) {
-            [_callbacks removeAllObjects];
-            [_errbacks removeAllObjects];
-            
-            for(SPA_NS(CallbackHolder) *holder in _finallys) {
-                dispatch_async(holder.callbackQueue, ^{
-                    ((SPTaskFinally)holder.callback)(YES);
-                });
-            }
-            
-            [_finallys removeAllObjects];
-        }
+    uintptr_t state = root ? atomic_load_explicit(&root->_state, memory_order_acquire) : SPTaskStatePending;
+    if(state == SPTaskStateSucceeded) {
+        if(error)
+            *error = nil;
+        return root->_scalar.type ? [root boxedScalar] : root->_completedValue;
     }
+    if(error)
+        *error = state == SPTaskStateFailed ? root->_completedError : SPTaskWaitError(state == SPTaskStateCancelled ? SPTaskErrorCancelled : SPTaskErrorTimedOut);
+    return nil;
+}
+
+/// The task whose outcome this one has, once it has resolved; nil while it's pending.
+- (SPA_NS(Task)*)resolvedLinkRoot
+{
+    SPA_NS(Task) *root = [self linkRoot];
+    return SPTaskStateIsResolved(atomic_load_explicit(&root->_state, memory_order_acquire)) ? root : nil;
+}
+
+- (SPA_NS(Task)*)parkUntil:(uint64_t)deadline
+{
+    SPA_NS(TaskWaiter) *waiter = SPTaskWaiterForCurrentThread();
+    unsigned generation = atomic_load_explicit(&waiter->_generation, memory_order_acquire);
+    atomic_store_explicit(&waiter->_armed, YES, memory_order_relaxed);
+    // Runs synchronously on whichever thread resolves the task, or right here if that has
+    // already happened. It's pushed directly rather than with addContinuation:, so that it
+    // isn't counted against the task's scope: there can't be more waits than threads, and a
+    // refused one would wake us over and over until the deadline.
+    SPA_NS(Task) *task = [self linkRoot];
+    [task pushContinuation:SPTaskContinuationFill([task claimContinuation], SPTaskContinuationFinally, waiter->_wake, SPTaskTargetQueue(nil))];
     
-    for(SPA_NS(Task) *child in _childTasks)
-        [child cancel];
+    SPA_NS(Task) *root;
+    while(!(root = [self resolvedLinkRoot]) && SPAsyncMonotonicNanoseconds() < deadline)
+        [waiter parkExpecting:generation until:deadline];
+    return root;
 }
 @end
 
-@implementation SPA_NS(Task) (SPTaskExtended)
-- (instancetype)then:(SPTaskThenCallback)worker on:(dispatch_queue_t)queue
+@implementation SPA_NS(Task) (SPTaskScopeMembership)
+- (void)joinScope:(SPA_NS(TaskScope)*)scope
 {
-    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-    SPA_NS(Task) *then = source.task;
-    [_childTasks addObject:then];
+    // The placeholder task belongs to everybody; a linked task is in whatever scope it follows.
+    if(_shared)
+        return;
+    SPA_NS(Task) *task = [self linkRoot];
+    if(task != self)
+        return [task joinScope:scope];
+    if(atomic_load_explicit(&_scope, memory_order_acquire) || !SPTaskStateIsPending(atomic_load_explicit(&_state, memory_order_acquire)))
+        return;
+    
+    switch([scope admitTask:self]) {
+        case SPTaskScopeRejected:
+            [self rejectForScopeLimit];
+            return;
+        case SPTaskScopeCancelled:
+            [self cancel];
+            return;
+        case SPTaskScopeAdmitted:
+            break;
+    }
     
-    [self addCallback:^(id value) {
-        id result = worker(value);
-        [source completeWithValue:result];
-    } on:queue];
-    [self addErrorCallback:^(NSError *error) {
-        [source failWithError:error];
-    } on:queue];
+    uintptr_t expected = 0, retained = (uintptr_t)(__bridge_retained void*)scope;
+    if(!atomic_compare_exchange_strong_explicit(&_scope, &expected, retained, memory_order_acq_rel, memory_order_acquire)) {
+        // Added to another scope meanwhile.
+        (void)(__bridge_transfer id)(void*)retained;
+        [scope removeTask:self continuations:0];
+        return;
+    }
+    // Settling or linking only takes us out of a scope that was already set.
+    if(!SPTaskStateIsPending(atomic_load_explicit(&_state, memory_order_acquire)))
+        [self leaveScope];
+}
 
-    return then;
+/// Called once the receiver has settled or been linked: takes it out of its scope.
+/// NOTE: Like dropParentLinks, this may release the last reference to the receiver.
+- (void)leaveScope
+{
+    uintptr_t scope = atomic_load_explicit(&_scope, memory_order_acquire);
+    if(!scope || atomic_exchange_explicit(&_leftScope, YES, memory_order_acq_rel))
+        return;
+    unsigned continuations = atomic_exchange_explicit(&_scopeContinuations, SPTaskScopeContinuationsClosed, memory_order_acq_rel);
+    [(__bridge SPA_NS(TaskScope)*)(void*)scope removeTask:self continuations:continuations];
 }
-    
-- (instancetype)chain:(SPTaskChainCallback)chainer on:(dispatch_queue_t)queue
+
+/// Counts a continuation about to be pushed onto the receiver against its scope's limit.
+/// Returns NO if the scope is full.
+- (BOOL)reserveScopeContinuation:(SPA_NS(TaskScope)*)scope
 {
-    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-    SPA_NS(Task) *chain = source.task;
-    [_childTasks addObject:chain];
-    
-    [self addCallback:^(id value) {
-        SPA_NS(Task) *workToBeProvided = chainer(value);
-        
-        [chain->_childTasks addObject:workToBeProvided];
-        
-        [source completeWithTask:workToBeProvided];
-    } on:queue];
-    [self addErrorCallback:^(NSError *error) {
-        [source failWithError:error];
-    } on:queue];
+    if(![scope reserveContinuation])
+        return NO;
+    unsigned count = atomic_load_explicit(&_scopeContinuations, memory_order_relaxed);
+    do {
+        if(count == SPTaskScopeContinuationsClosed) {
+            // Left the scope meanwhile, so the continuation is about to be delivered anyway.
+            [scope releaseContinuations:1];
+            return YES;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&_scopeContinuations, &count, count + 1, memory_order_relaxed, memory_order_relaxed));
+    return YES;
+}
 
-    return chain;
+/// Fails the receiver with SPTaskErrorScopeLimitExceeded, unless it's already resolving. Whoever
+/// was going to complete it doesn't know, and can still try to; that's ignored.
+- (void)rejectForScopeLimit
+{
+    if(atomic_exchange_explicit(&_resolving, YES, memory_order_acquire))
+        return;
+    _rejected = YES;
+    _completedError = SPTaskScopeLimitError();
+    [self publishState:SPTaskStateFailed];
 }
+@end
 
-- (instancetype)chain
+@implementation SPA_NS(Task) (SPTaskScalars)
++ (instancetype)completedTaskWithBool:(BOOL)value
 {
-    return [self chain:^SPA_NS(Task) *(id value) {
-        return value;
-    } on:dispatch_get_global_queue(0, 0)];
+    return [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateSucceeded value:nil error:nil scalar:(SPTaskScalar){ .type = SPTaskScalarBool, .boolValue = value }];
 }
 
-- (instancetype)recover:(SPTaskRecoverCallback)recoverer on:(dispatch_queue_t)queue
++ (instancetype)completedTaskWithInteger:(NSInteger)value
 {
-    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-    SPA_NS(Task) *chain = source.task;
-    [_childTasks addObject:chain];
-    
-    [self addErrorCallback:^(NSError *error) {
-        SPA_NS(Task) *workToBeProvided = recoverer(error);
-        if(!workToBeProvided) {
-            [source failWithError:error];
-        } else {
-            [chain->_childTasks addObject:workToBeProvided];
-            [source completeWithTask:workToBeProvided];
-        }
-    } on:queue];
-    [self addCallback:^(id value) {
-        [source completeWithValue:value];
-    } on:queue];
+    return [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateSucceeded value:nil error:nil scalar:(SPTaskScalar){ .type = SPTaskScalarInteger, .integerValue = value }];
+}
 
-    return chain;
++ (instancetype)completedTaskWithDouble:(double)value
+{
+    return [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateSucceeded value:nil error:nil scalar:(SPTaskScalar){ .type = SPTaskScalarDouble, .doubleValue = value }];
+}
+
+- (instancetype)addBoolCallback:(SPTaskBoolCallback)callback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationBool callback:callback on:queue];
+    return self;
+}
+
+- (instancetype)addIntegerCallback:(SPTaskIntegerCallback)callback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationInteger callback:callback on:queue];
+    return self;
+}
+
+- (instancetype)addDoubleCallback:(SPTaskDoubleCallback)callback on:(dispatch_queue_t)queue
+{
+    [self addContinuation:SPTaskContinuationDouble callback:callback on:queue];
+    return self;
+}
+@end
 
+@implementation SPA_NS(Task) (SPTaskDebugging)
+- (NSArray*)asyncCallStackSymbols
+{
+    void *addresses[SPTaskCallSiteLimit];
+    int count = 0;
+    for(SPTaskCallSite *callSite = _callSite; callSite && count < SPTaskCallSiteLimit; callSite = callSite->parent)
+        addresses[count++] = callSite->address;
+    if(!count)
+        return @[];
+    char **symbols = backtrace_symbols(addresses, count);
+    if(!symbols)
+        return @[];
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
+    for(int i = 0; i < count; i++)
+        [result addObject:@(symbols[i])];
+    free(symbols);
+    return result;
 }
 @end
 
@@ -340,13 +2383,13 @@
 + (instancetype)delay:(NSTimeInterval)delay completeValue:(id)completeValue
 {
     SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-    dispatch_time_t popTime = dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_SEC);
-    dispatch_after(popTime, dispatch_get_main_queue(), ^(void){
-        if (source.task.cancelled)
-            return;
-        
+    SPA_NS(TaskTimer) *timer = [SPA_NS(TaskTimer) timerWithDelay:delay queue:nil handler:^{
         [source completeWithValue:completeValue];
-    });
+    }];
+    // Don't leave the timer (and whatever completeValue holds on to) around until it would have fired.
+    [source addCancellationCallback:^{
+        [timer disarm];
+    }];
     
     return source.task;
 }
@@ -357,37 +2400,200 @@
 }
 
 + (instancetype)performWork:(SPTaskWorkGeneratingCallback)work onQueue:(dispatch_queue_t)queue;
+{
+    return [self startWork:work options:0 onTarget:SPTaskTargetQueue(queue)];
+}
+
++ (instancetype)performWork:(SPTaskWorkGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self startWork:work options:0 onTarget:SPTaskTargetExecutor(executor)];
+}
+
++ (instancetype)fetchWork:(SPTaskTaskGeneratingCallback)work onQueue:(dispatch_queue_t)queue
+{
+    return [self startWork:work options:SPTaskWorkFetches onTarget:SPTaskTargetQueue(queue)];
+}
+
++ (instancetype)fetchWork:(SPTaskTaskGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self startWork:work options:SPTaskWorkFetches onTarget:SPTaskTargetExecutor(executor)];
+}
+
++ (instancetype)performCancellableWork:(SPTaskCancellableWorkCallback)work onQueue:(dispatch_queue_t)queue
+{
+    return [self startWork:work options:SPTaskWorkCancellable onTarget:SPTaskTargetQueue(queue)];
+}
+
++ (instancetype)performCancellableWork:(SPTaskCancellableWorkCallback)work onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self startWork:work options:SPTaskWorkCancellable onTarget:SPTaskTargetExecutor(executor)];
+}
+
++ (instancetype)fetchCancellableWork:(SPTaskCancellableTaskGeneratingCallback)work onQueue:(dispatch_queue_t)queue
+{
+    return [self startWork:work options:SPTaskWorkFetches|SPTaskWorkCancellable onTarget:SPTaskTargetQueue(queue)];
+}
+
++ (instancetype)fetchCancellableWork:(SPTaskCancellableTaskGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor
+{
+    return [self startWork:work options:SPTaskWorkFetches|SPTaskWorkCancellable onTarget:SPTaskTargetExecutor(executor)];
+}
+
+/// The performWork: and fetchWork: families: 'work' is whichever of their callback types
+/// 'options' says.
++ (instancetype)startWork:(id)work options:(SPTaskWorkOptions)options onTarget:(SPTaskTarget)target
 {
     SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-    dispatch_async(queue, ^{
-        id value = work();
-        [source completeWithValue:value];
+    SPA_NS(Task) *task = source.task;
+    atomic_store_explicit(&task->_producerQueue, target.isExecutor ? 0 : (uintptr_t)target.queue, memory_order_relaxed);
+    SPTaskTargetAsync(target.queue, target.isExecutor, ^{
+        atomic_store_explicit(&task->_producerQueue, 0, memory_order_relaxed);
+        // Cancelled, or rejected by its scope, while it was queued.
+        if(SPTaskStateIsResolved(atomic_load_explicit(&task->_state, memory_order_acquire)))
+            return;
+        void *previousScope = SPTaskScopeEnter((void*)atomic_load_explicit(&task->_scope, memory_order_acquire));
+        // The task itself is the token; it's already got everything a token needs.
+        id result = (options & SPTaskWorkCancellable)
+            ? ((SPTaskCancellableWorkCallback)work)(task)
+            : ((SPTaskWorkGeneratingCallback)work)();
+        SPTaskScopeLeave(previousScope);
+        if(options & SPTaskWorkFetches)
+            [source completeWithTask:result];
+        else
+            [source completeWithValue:result];
     });
-    return source.task;
+    return task;
 }
 
-+ (instancetype)fetchWork:(SPTaskTaskGeneratingCallback)work onQueue:(dispatch_queue_t)queue
++ (SPA_NS(Task)*)map:(NSArray*)items maxConcurrency:(NSUInteger)maxConcurrency on:(dispatch_queue_t)queue work:(SPTaskMapCallback)work
 {
     SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    items = [items copy];
+    NSUInteger count = [items count];
+    if(count == 0) {
+        [source completeWithValue:@[]];
+        return source.task;
+    }
+    
+    NSUInteger lanes = MIN(MAX(maxConcurrency, (NSUInteger)1), count);
+    // Small enough that every lane stays busy until the end, big enough to amortize the dispatch.
+    NSUInteger chunk = MAX((NSUInteger)1, MIN(count / (lanes * 8), (NSUInteger)SPTaskMapChunkLimit));
+    SPA_NS(TaskMap) *map = [[SPA_NS(TaskMap) alloc] initWithCount:count lanes:0];
+    [source.task addContinuation:SPTaskContinuationCancellation callback:^{
+        [map settle];
+    } on:nil];
+    
+    for(NSUInteger lane = 0; lane < lanes; lane++)
+        [self mapChunkOf:items map:map chunk:chunk on:queue work:work source:source];
+    return source.task;
+}
+
+/// Runs the next chunk of a +map:... on 'queue', and then schedules the one after it. Going back
+/// to the queue between chunks keeps a map from hogging a serial queue, and limits how much
+/// work is wasted once the map has stopped.
++ (void)mapChunkOf:(NSArray*)items map:(SPA_NS(TaskMap)*)map chunk:(NSUInteger)chunk on:(dispatch_queue_t)queue work:(SPTaskMapCallback)work source:(SPA_NS(TaskCompletionSource)*)source
+{
     dispatch_async(queue, ^{
-        SPA_NS(Task) *task = work();
-        [source completeWithTask:task];
+        if([map isSettled])
+            return;
+        NSUInteger start = [map claim:chunk];
+        if(start >= map->_count)
+            return;
+        NSUInteger end = MIN(start + chunk, map->_count);
+        
+        for(NSUInteger i = start; i < end; i++) {
+            if([map isSettled])
+                return;
+            id result;
+            @autoreleasepool {
+                result = work(items[i]);
+            }
+            if([result isKindOfClass:[NSError class]]) {
+                if([map settle])
+                    [source failWithError:result];
+                return;
+            }
+            map->_results[i] = result ?: [NSNull null];
+        }
+        
+        if([map countDown:end - start]) {
+            if([map settle])
+                [source completeWithValue:[map results]];
+            return;
+        }
+        [self mapChunkOf:items map:map chunk:chunk on:queue work:work source:source];
     });
+}
+
++ (SPA_NS(Task)*)mapTasks:(NSArray*)items maxConcurrency:(NSUInteger)maxConcurrency work:(SPTaskMapTaskCallback)work
+{
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    items = [items copy];
+    NSUInteger count = [items count];
+    if(count == 0) {
+        [source completeWithValue:@[]];
+        return source.task;
+    }
+    
+    NSUInteger lanes = MIN(MAX(maxConcurrency, (NSUInteger)1), count);
+    SPA_NS(TaskMap) *map = [[SPA_NS(TaskMap) alloc] initWithCount:count lanes:lanes];
+    [source.task addContinuation:SPTaskContinuationCancellation callback:^{
+        [map settle];
+        [map cancelLanes];
+    } on:nil];
+    
+    for(NSUInteger lane = 0; lane < lanes; lane++)
+        [self mapNextTaskOf:items map:map lane:lane work:work source:source];
     return source.task;
 }
 
+/// Starts the task for the next item of a +mapTasks:... in 'lane', and moves on to the item after
+/// it when it completes. Each lane only ever waits on one task at a time.
++ (void)mapNextTaskOf:(NSArray*)items map:(SPA_NS(TaskMap)*)map lane:(NSUInteger)lane work:(SPTaskMapTaskCallback)work source:(SPA_NS(TaskCompletionSource)*)source
+{
+    if([map isSettled])
+        return;
+    NSUInteger i = [map claim:1];
+    if(i >= map->_count)
+        return;
+    
+    SPA_NS(Task) *task = work(items[i]) ?: [SPA_NS(Task) nilPlaceholderTask];
+    [map setTask:task forLane:lane];
+    
+    [task addContinuation:SPTaskContinuationOutcome callback:^(BOOL succeeded, id result) {
+        if(!succeeded) {
+            if([map settle]) {
+                [source failWithError:result];
+                [map cancelLanes];
+            }
+            return;
+        }
+        map->_results[i] = result ?: [NSNull null];
+        if([map countDown]) {
+            if([map settle])
+                [source completeWithValue:[map results]];
+            return;
+        }
+        [self mapNextTaskOf:items map:map lane:lane work:work source:source];
+    } on:SPTaskInlineQueue()];
+    // An item's task being cancelled from elsewhere means the map can't complete.
+    [task addContinuation:SPTaskContinuationCancellation callback:^{
+        if([map settle])
+            [source.task cancel];
+    } on:nil];
+}
+
 + (instancetype)completedTask:(id)completeValue;
 {
-	SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-	[source completeWithValue:completeValue];
-	return source.task;
+    // Like -[SPTaskCompletionSource completeWithValue:].
+    if([completeValue isKindOfClass:[NSError class]])
+        return [self failedTask:completeValue];
+    return [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateSucceeded value:completeValue error:nil scalar:(SPTaskScalar){ .type = SPTaskScalarNone }];
 }
 
 + (instancetype)failedTask:(NSError*)failure
 {
-	SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
-	[source failWithError:failure];
-	return source.task;
+    return [[SPA_NS(Task) alloc] initResolvedToState:SPTaskStateFailed value:nil error:failure scalar:(SPTaskScalar){ .type = SPTaskScalarNone }];
 }
 
 @end
@@ -395,15 +2601,13 @@
 @implementation SPA_NS(TaskCompletionSource)
 {
     SPA_NS(Task) *_task;
-    NSMutableArray *_cancellationHandlers;
 }
 
 - (instancetype)init
 {
     if(!(self = [super init]))
         return nil;
-    _cancellationHandlers = [NSMutableArray new];
-    _task = [[SPA_NS(Task) alloc] initFromSource:self];
+    _task = [SPA_NS(Task) new];
     return self;
 }
 
@@ -417,6 +2621,21 @@
     [self.task completeWithValue:value];
 }
 
+- (void)completeWithBool:(BOOL)value
+{
+    [_task completeWithScalar:(SPTaskScalar){ .type = SPTaskScalarBool, .boolValue = value }];
+}
+
+- (void)completeWithInteger:(NSInteger)value
+{
+    [_task completeWithScalar:(SPTaskScalar){ .type = SPTaskScalarInteger, .integerValue = value }];
+}
+
+- (void)completeWithDouble:(double)value
+{
+    [_task completeWithScalar:(SPTaskScalar){ .type = SPTaskScalarDouble, .doubleValue = value }];
+}
+
 - (void)failWithError:(NSError*)error ignoreIfAlreadyCompleted:(BOOL)ignoreSubsequentValues
 {
     [self.task failWithError:error ignoreIfAlreadyCompleted:ignoreSubsequentValues];
@@ -429,11 +2648,11 @@
 
 - (void)completeWithTask:(SPA_NS(Task)*)task
 {
-    [[task addCallback:^(id value) {
-        [self.task completeWithValue:value];
-    } on:dispatch_get_global_queue(0, 0)] addErrorCallback:^(NSError *error) {
-        [self.task failWithError:error ignoreIfAlreadyCompleted:NO];
-    } on:dispatch_get_global_queue(0, 0)];
+    if(!task)
+        return;
+    NSAssert([task linkRoot] != [_task linkRoot], @"Can't complete a task with itself");
+    SPTaskTraceEvent(SPTaskTraceEdge, (__bridge void*)task, (__bridge void*)_task);
+    [_task followTask:task];
 }
 
 - (dispatch_block_t)voidResolver
@@ -452,13 +2671,7 @@
 
 - (void)addCancellationCallback:(void(^)(void))cancellationCallback
 {
-    [_cancellationHandlers addObject:cancellationCallback];
-}
-
-- (void)cancel
-{
-    for(void(^cancellationHandler)(void) in _cancellationHandlers)
-        cancellationHandler();
+    [_task addContinuation:SPTaskContinuationCancellation callback:cancellationCallback on:nil];
 }
 
 @end
@@ -0,0 +1,402 @@
+//
+//  SPTaskCache.m
+//  SPAsync
+//
+
+#import <SPAsync/SPTaskCache.h>
+#import "SPAsyncClock.h"
+#include <pthread.h>
+
+/*
+    Every key maps to an entry. While its fetch is in flight, the entry counts the callers
+    waiting for it, each of which has been handed a task of its own from a completion source
+    of its own; those only ever follow the fetch through callbacks, so that cancelling one of
+    them doesn't cancel the fetch for the others. The last one to cancel does cancel it, along
+    with the task that 'fetch' returned, which the fetch only follows.
+
+    Once the fetch resolves, the entry keeps its value or error and goes on the LRU list (most
+    recently used first), or is dropped. Callers asking for it from then on get a new, already
+    resolved task, rather than the fetch itself, for the same reason.
+
+    Entries are only touched with the cache's lock held, and are always let go of outside of it,
+    so that whatever their values hold on to isn't torn down under the lock.
+*/
+
+typedef NS_ENUM(uint8_t, SPTaskCacheEntryState) {
+    SPTaskCacheEntryFetching,
+    SPTaskCacheEntrySucceeded,
+    SPTaskCacheEntryFailed,
+    SPTaskCacheEntryAbandoned, // cancelled, or not cached after all
+};
+
+@interface SPA_NS(TaskCacheEntry) : NSObject
+{
+    @public
+    id<NSCopying> _key;
+    SPA_NS(TaskCompletionSource) *_source; // for the fetch
+    SPA_NS(Task) *_fetched; // what 'fetch' returned, while it's in flight
+    SPTaskCacheEntryState _state;
+    NSUInteger _consumers; // callers still waiting for the fetch
+    id _value;
+    NSError *_error;
+    NSUInteger _cost;
+    uint64_t _expiry; // SPAsyncMonotonicNanoseconds(), or 0 for never
+    __unsafe_unretained SPA_NS(TaskCacheEntry) *_prev, *_next; // in the LRU list, once cached
+}
+@end
+@implementation SPA_NS(TaskCacheEntry)
+@end
+
+static uint64_t SPTaskCacheExpiry(NSTimeInterval timeToLive)
+{
+    return timeToLive > 0 ? SPAsyncMonotonicNanoseconds() + (uint64_t)(timeToLive * NSEC_PER_SEC) : 0;
+}
+
+@implementation SPA_NS(TaskCache)
+{
+    pthread_mutex_t _lock;
+    NSMutableDictionary *_entries;
+    __unsafe_unretained SPA_NS(TaskCacheEntry) *_head, *_tail; // cached entries, most recently used first
+    NSUInteger _countLimit, _totalCostLimit;
+    NSTimeInterval _timeToLive, _failureTimeToLive;
+    SPTaskCacheCostCallback _costCallback;
+    NSUInteger _count, _totalCost;
+    NSUInteger _hitCount, _missCount, _coalescedCount, _evictionCount;
+}
+
+- (instancetype)init
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _entries = [NSMutableDictionary new];
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark LRU list (all with _lock held)
+
+- (void)listEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    entry->_prev = nil;
+    entry->_next = _head;
+    if(_head)
+        _head->_prev = entry;
+    _head = entry;
+    if(!_tail)
+        _tail = entry;
+    _count++;
+    _totalCost += entry->_cost;
+}
+
+- (void)unlistEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    if(entry->_prev)
+        entry->_prev->_next = entry->_next;
+    else
+        _head = entry->_next;
+    if(entry->_next)
+        entry->_next->_prev = entry->_prev;
+    else
+        _tail = entry->_prev;
+    entry->_prev = entry->_next = nil;
+    _count--;
+    _totalCost -= entry->_cost;
+}
+
+- (void)touchEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    if(entry == _head)
+        return;
+    [self unlistEntry:entry];
+    [self listEntry:entry];
+}
+
+/// Forgets a cached entry, adding it to 'dropped' so that it can be released after unlocking.
+- (void)dropEntry:(SPA_NS(TaskCacheEntry)*)entry into:(NSMutableArray*)dropped
+{
+    [dropped addObject:entry];
+    [self unlistEntry:entry];
+    [_entries removeObjectForKey:entry->_key];
+}
+
+- (void)evictInto:(NSMutableArray*)dropped
+{
+    while(_tail && ((_countLimit && _count > _countLimit) || (_totalCostLimit && _totalCost > _totalCostLimit))) {
+        [self dropEntry:_tail into:dropped];
+        _evictionCount++;
+    }
+}
+
+#pragma mark Lookup
+
+- (SPA_NS(Task)*)taskForKey:(id<NSCopying>)key fetch:(SPTaskCacheFetchCallback)fetch
+{
+    NSParameterAssert(key);
+    NSParameterAssert(fetch);
+    NSMutableArray *dropped = nil; // only made when needed, to keep hits allocation free
+
+    pthread_mutex_lock(&_lock);
+    SPA_NS(TaskCacheEntry) *entry = _entries[key];
+    if(entry && entry->_state != SPTaskCacheEntryFetching && entry->_expiry && entry->_expiry <= SPAsyncMonotonicNanoseconds()) {
+        dropped = [NSMutableArray new];
+        [self dropEntry:entry into:dropped];
+        entry = nil;
+    }
+
+    if(entry && entry->_state != SPTaskCacheEntryFetching) {
+        _hitCount++;
+        [self touchEntry:entry];
+        id value = entry->_value;
+        NSError *error = entry->_error;
+        BOOL succeeded = entry->_state == SPTaskCacheEntrySucceeded;
+        pthread_mutex_unlock(&_lock);
+        return succeeded ? [SPA_NS(Task) completedTask:value] : [SPA_NS(Task) failedTask:error];
+    }
+
+    if(entry) {
+        _coalescedCount++;
+        entry->_consumers++;
+        pthread_mutex_unlock(&_lock);
+        return [self consumerTaskForEntry:entry];
+    }
+
+    _missCount++;
+    entry = [SPA_NS(TaskCacheEntry) new];
+    entry->_key = [key copyWithZone:NULL];
+    entry->_source = [SPA_NS(TaskCompletionSource) new];
+    entry->_consumers = 1;
+    _entries[entry->_key] = entry;
+    pthread_mutex_unlock(&_lock);
+
+    SPA_NS(Task) *consumer = [self consumerTaskForEntry:entry];
+    [self watchEntry:entry];
+    SPA_NS(Task) *fetched = fetch(entry->_key);
+    if(fetched) {
+        // completeWithTask: only follows the fetch, so it's up to us to cancel it once everybody
+        // has given up on it, which may have happened already.
+        pthread_mutex_lock(&_lock);
+        BOOL abandoned = entry->_state != SPTaskCacheEntryFetching;
+        if(!abandoned)
+            entry->_fetched = fetched;
+        pthread_mutex_unlock(&_lock);
+        [entry->_source completeWithTask:fetched];
+        if(abandoned)
+            [fetched cancel];
+    } else {
+        [entry->_source completeWithValue:nil];
+    }
+    return consumer;
+}
+
+/// A task for one caller waiting for an entry's fetch.
+- (SPA_NS(Task)*)consumerTaskForEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    SPA_NS(Task) *fetch = entry->_source.task;
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(Task) *consumer = source.task;
+    dispatch_queue_t inlineQueue = [SPA_NS(Task) inlineQueue];
+
+    [fetch addCallback:^(id value) {
+        [source completeWithValue:value];
+    } on:inlineQueue];
+    [fetch addErrorCallback:^(NSError *error) {
+        [source failWithError:error];
+    } on:inlineQueue];
+    [fetch addFinallyCallback:^(BOOL cancelled) {
+        if(cancelled)
+            [consumer cancel];
+    } on:inlineQueue];
+    [source addCancellationCallback:^{
+        [self abandonEntry:entry];
+    }];
+    return consumer;
+}
+
+/// One of the callers waiting for 'entry' has cancelled.
+- (void)abandonEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    SPA_NS(Task) *fetched = nil;
+    pthread_mutex_lock(&_lock);
+    BOOL lastOne = entry->_state == SPTaskCacheEntryFetching && --entry->_consumers == 0;
+    if(lastOne) {
+        entry->_state = SPTaskCacheEntryAbandoned;
+        fetched = entry->_fetched;
+        entry->_fetched = nil;
+        if(_entries[entry->_key] == entry)
+            [_entries removeObjectForKey:entry->_key];
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if(lastOne) {
+        [entry->_source.task cancel];
+        [fetched cancel];
+    }
+}
+
+/// Files the outcome of an entry's fetch once it's in.
+- (void)watchEntry:(SPA_NS(TaskCacheEntry)*)entry
+{
+    dispatch_queue_t inlineQueue = [SPA_NS(Task) inlineQueue];
+    [entry->_source.task addCallback:^(id value) {
+        [self settleEntry:entry succeeded:YES value:value error:nil];
+    } on:inlineQueue];
+    [entry->_source.task addErrorCallback:^(NSError *error) {
+        [self settleEntry:entry succeeded:NO value:nil error:error];
+    } on:inlineQueue];
+    [entry->_source.task addFinallyCallback:^(BOOL cancelled) {
+        if(cancelled)
+            [self settleEntry:entry succeeded:NO value:nil error:nil];
+    } on:inlineQueue];
+}
+
+- (void)settleEntry:(SPA_NS(TaskCacheEntry)*)entry succeeded:(BOOL)succeeded value:(id)value error:(NSError*)error
+{
+    NSMutableArray *dropped = [NSMutableArray new];
+    pthread_mutex_lock(&_lock);
+    if(entry->_fetched)
+        [dropped addObject:entry->_fetched];
+    entry->_fetched = nil;
+    BOOL current = entry->_state == SPTaskCacheEntryFetching && _entries[entry->_key] == entry;
+    if(!current) {
+        // Abandoned or removed in the meantime.
+        entry->_state = SPTaskCacheEntryAbandoned;
+    } else if(error && _failureTimeToLive > 0) {
+        entry->_state = SPTaskCacheEntryFailed;
+        entry->_error = error;
+        entry->_expiry = SPTaskCacheExpiry(_failureTimeToLive);
+        [self listEntry:entry];
+        [self evictInto:dropped];
+    } else if(succeeded) {
+        entry->_state = SPTaskCacheEntrySucceeded;
+        entry->_value = value;
+        entry->_cost = _costCallback ? _costCallback(entry->_key, value) : 0;
+        entry->_expiry = SPTaskCacheExpiry(_timeToLive);
+        [self listEntry:entry];
+        [self evictInto:dropped];
+    } else {
+        // Failed without failure caching, or cancelled.
+        entry->_state = SPTaskCacheEntryAbandoned;
+        [dropped addObject:entry];
+        [_entries removeObjectForKey:entry->_key];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark Removal
+
+- (void)removeTaskForKey:(id)key
+{
+    NSMutableArray *dropped = [NSMutableArray new];
+    pthread_mutex_lock(&_lock);
+    SPA_NS(TaskCacheEntry) *entry = _entries[key];
+    if(entry && entry->_state == SPTaskCacheEntryFetching) {
+        [dropped addObject:entry];
+        [_entries removeObjectForKey:key];
+    } else if(entry) {
+        [self dropEntry:entry into:dropped];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeAllTasks
+{
+    pthread_mutex_lock(&_lock);
+    NSMutableDictionary *entries = _entries;
+    _entries = [NSMutableDictionary new];
+    _head = _tail = nil;
+    _count = _totalCost = 0;
+    pthread_mutex_unlock(&_lock);
+
+    entries = nil;
+}
+
+- (void)removeExpiredTasks
+{
+    NSMutableArray *dropped = [NSMutableArray new];
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    pthread_mutex_lock(&_lock);
+    for(SPA_NS(TaskCacheEntry) *entry = _head, *next; entry; entry = next) {
+        next = entry->_next;
+        if(entry->_expiry && entry->_expiry <= now)
+            [self dropEntry:entry into:dropped];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark Limits and statistics
+
+- (void)setCountLimit:(NSUInteger)countLimit
+{
+    NSMutableArray *dropped = [NSMutableArray new];
+    pthread_mutex_lock(&_lock);
+    _countLimit = countLimit;
+    [self evictInto:dropped];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setTotalCostLimit:(NSUInteger)totalCostLimit
+{
+    NSMutableArray *dropped = [NSMutableArray new];
+    pthread_mutex_lock(&_lock);
+    _totalCostLimit = totalCostLimit;
+    [self evictInto:dropped];
+    pthread_mutex_unlock(&_lock);
+}
+
+#define SPTaskCacheLockedGetter(type, name, ivar) \
+- (type)name \
+{ \
+    pthread_mutex_lock(&_lock); \
+    type value = ivar; \
+    pthread_mutex_unlock(&_lock); \
+    return value; \
+}
+
+SPTaskCacheLockedGetter(NSUInteger, countLimit, _countLimit)
+SPTaskCacheLockedGetter(NSUInteger, totalCostLimit, _totalCostLimit)
+SPTaskCacheLockedGetter(NSTimeInterval, timeToLive, _timeToLive)
+SPTaskCacheLockedGetter(NSTimeInterval, failureTimeToLive, _failureTimeToLive)
+SPTaskCacheLockedGetter(SPTaskCacheCostCallback, costCallback, _costCallback)
+SPTaskCacheLockedGetter(NSUInteger, count, _count)
+SPTaskCacheLockedGetter(NSUInteger, totalCost, _totalCost)
+SPTaskCacheLockedGetter(NSUInteger, hitCount, _hitCount)
+SPTaskCacheLockedGetter(NSUInteger, missCount, _missCount)
+SPTaskCacheLockedGetter(NSUInteger, coalescedCount, _coalescedCount)
+SPTaskCacheLockedGetter(NSUInteger, evictionCount, _evictionCount)
+
+- (void)setTimeToLive:(NSTimeInterval)timeToLive
+{
+    pthread_mutex_lock(&_lock);
+    _timeToLive = timeToLive;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setFailureTimeToLive:(NSTimeInterval)failureTimeToLive
+{
+    pthread_mutex_lock(&_lock);
+    _failureTimeToLive = failureTimeToLive;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setCostCallback:(SPTaskCacheCostCallback)costCallback
+{
+    costCallback = [costCallback copy];
+    pthread_mutex_lock(&_lock);
+    SPTaskCacheCostCallback previous = _costCallback; // released after unlocking
+    _costCallback = costCallback;
+    pthread_mutex_unlock(&_lock);
+    previous = nil;
+}
+
+- (void)resetStatistics
+{
+    pthread_mutex_lock(&_lock);
+    _hitCount = _missCount = _coalescedCount = _evictionCount = 0;
+    pthread_mutex_unlock(&_lock);
+}
+@end
@@ -0,0 +1,191 @@
+//
+//  SPTaskScope.m
+//  SPAsync
+//
+
+#import <SPAsync/SPTaskScope.h>
+#import <SPAsync/SPTask.h>
+#import "SPTaskScopeMembership.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+    Tasks do most of the work of belonging to a scope themselves (see SPTaskScopeMembership in
+    SPTask.m): they ask to be admitted when they're created or added, reserve their callbacks
+    against the continuation limit as they're added, and take themselves out, with their
+    reservations, once they settle.
+
+    The scope only keeps the set of outstanding tasks, so that cancelling it can cancel each of
+    them once, and so that draining knows when there are none left. The set holds on to the
+    tasks; as elsewhere, they're let go of and cancelled outside the lock.
+*/
+
+__thread void *SPA_NS(TaskScopeCurrent);
+
+@implementation SPA_NS(TaskScope)
+{
+    pthread_mutex_t _lock;
+    NSMutableSet *_tasks; // outstanding
+    NSMutableArray *_drainSources; // for drain tasks waiting for _tasks to empty
+    BOOL _cancelled;
+    atomic_uint _continuationCount;
+    atomic_uint _rejectedCount;
+}
+
+- (instancetype)init
+{
+    return [self initWithTaskLimit:0 continuationLimit:0];
+}
+
+- (instancetype)initWithTaskLimit:(NSUInteger)taskLimit continuationLimit:(NSUInteger)continuationLimit
+{
+    if(!(self = [super init]))
+        return nil;
+    pthread_mutex_init(&_lock, NULL);
+    _tasks = [NSMutableSet new];
+    _taskLimit = taskLimit;
+    _continuationLimit = continuationLimit;
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
++ (instancetype)currentScope
+{
+    return (__bridge SPA_NS(TaskScope)*)SPA_NS(TaskScopeCurrent);
+}
+
+- (id)run:(SPTaskScopeCallback)block
+{
+    void *previous = SPTaskScopeEnter((__bridge void*)self);
+    id result = block();
+    SPTaskScopeLeave(previous);
+    return result;
+}
+
+- (void)addTask:(SPA_NS(Task)*)task
+{
+    [task joinScope:self];
+}
+
+- (void)cancel
+{
+    pthread_mutex_lock(&_lock);
+    _cancelled = YES;
+    NSArray *tasks = [_tasks allObjects];
+    pthread_mutex_unlock(&_lock);
+
+    // Cancelled tasks settle, and take themselves out of _tasks as they do.
+    for(SPA_NS(Task) *task in tasks)
+        [task cancel];
+}
+
+- (BOOL)isCancelled
+{
+    pthread_mutex_lock(&_lock);
+    BOOL cancelled = _cancelled;
+    pthread_mutex_unlock(&_lock);
+    return cancelled;
+}
+
+- (SPA_NS(Task)*)drain
+{
+    // The drain task mustn't join the scope it's waiting for.
+    void *previous = SPA_NS(TaskScopeCurrent);
+    SPA_NS(TaskScopeCurrent) = NULL;
+    SPA_NS(TaskCompletionSource) *source = [SPA_NS(TaskCompletionSource) new];
+    SPA_NS(TaskScopeCurrent) = previous;
+
+    pthread_mutex_lock(&_lock);
+    BOOL drained = _tasks.count == 0;
+    if(!drained) {
+        if(!_drainSources)
+            _drainSources = [NSMutableArray new];
+        [_drainSources addObject:source];
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if(drained)
+        [source completeWithValue:nil];
+    return source.task;
+}
+
+- (NSUInteger)taskCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = _tasks.count;
+    pthread_mutex_unlock(&_lock);
+    return count;
+}
+
+- (NSUInteger)continuationCount
+{
+    return atomic_load_explicit(&_continuationCount, memory_order_relaxed);
+}
+
+- (NSUInteger)rejectedCount
+{
+    return atomic_load_explicit(&_rejectedCount, memory_order_relaxed);
+}
+@end
+
+@implementation SPA_NS(TaskScope) (SPTaskScopeMembership)
+- (SPTaskScopeAdmission)admitTask:(SPA_NS(Task)*)task
+{
+    SPTaskScopeAdmission admission = SPTaskScopeAdmitted;
+    pthread_mutex_lock(&_lock);
+    if(_cancelled)
+        admission = SPTaskScopeCancelled;
+    else if(_taskLimit && _tasks.count >= _taskLimit)
+        admission = SPTaskScopeRejected;
+    else
+        [_tasks addObject:task];
+    pthread_mutex_unlock(&_lock);
+
+    if(admission == SPTaskScopeRejected)
+        atomic_fetch_add_explicit(&_rejectedCount, 1, memory_order_relaxed);
+    return admission;
+}
+
+- (void)removeTask:(SPA_NS(Task)*)task continuations:(unsigned)continuations
+{
+    [self releaseContinuations:continuations];
+
+    // Keep it alive until we're out of the lock.
+    SPA_NS(Task) *removed = nil;
+    NSArray *drainSources = nil;
+    pthread_mutex_lock(&_lock);
+    removed = [_tasks member:task];
+    if(removed) {
+        [_tasks removeObject:task];
+        if(_tasks.count == 0) {
+            drainSources = _drainSources;
+            _drainSources = nil;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    for(SPA_NS(TaskCompletionSource) *source in drainSources)
+        [source completeWithValue:nil];
+}
+
+- (BOOL)reserveContinuation
+{
+    unsigned count = atomic_fetch_add_explicit(&_continuationCount, 1, memory_order_relaxed) + 1;
+    if(_continuationLimit && count > _continuationLimit) {
+        atomic_fetch_sub_explicit(&_continuationCount, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&_rejectedCount, 1, memory_order_relaxed);
+        return NO;
+    }
+    return YES;
+}
+
+- (void)releaseContinuations:(unsigned)count
+{
+    if(count)
+        atomic_fetch_sub_explicit(&_continuationCount, count, memory_order_relaxed);
+}
+@end
@@ -0,0 +1,51 @@
+//
+//  SPTaskScopeMembership.h
+//  SPAsync
+//
+//  Private to SPAsync; not part of the public headers.
+
+#import <SPAsync/SPTaskScope.h>
+
+/// The SPTaskScope (unretained) that tasks created on this thread join, if any.
+extern __thread void *SPA_NS(TaskScopeCurrent);
+
+/// Makes 'scope' current, if there is one, and returns what to pass to SPTaskScopeLeave.
+static inline void *SPTaskScopeEnter(void *scope)
+{
+    void *previous = SPA_NS(TaskScopeCurrent);
+    if(scope)
+        SPA_NS(TaskScopeCurrent) = scope;
+    return previous;
+}
+
+static inline void SPTaskScopeLeave(void *previous)
+{
+    SPA_NS(TaskScopeCurrent) = previous;
+}
+
+typedef NS_ENUM(uint8_t, SPTaskScopeAdmission) {
+    SPTaskScopeAdmitted,
+    /// The scope is full; the task should fail with SPTaskErrorScopeLimitExceeded.
+    SPTaskScopeRejected,
+    /// The scope has been cancelled; so should the task be.
+    SPTaskScopeCancelled,
+};
+
+@interface SPA_NS(TaskScope) (SPTaskScopeMembership)
+/// Lists 'task' as outstanding, unless the scope is full or cancelled.
+- (SPTaskScopeAdmission)admitTask:(SPA_NS(Task)*)task;
+/// Takes 'task' out of the scope (if it was admitted), along with the 'continuations' it
+/// had reserved.
+- (void)removeTask:(SPA_NS(Task)*)task continuations:(unsigned)continuations;
+/// Counts one more callback waiting on a task in the scope. Returns NO if the scope is full.
+- (BOOL)reserveContinuation;
+- (void)releaseContinuations:(unsigned)count;
+@end
+
+@interface SPA_NS(Task) (SPTaskScopeMembership)
+/// Joins 'scope', unless the receiver is in a scope already or has settled.
+- (void)joinScope:(SPA_NS(TaskScope)*)scope;
+- (void)leaveScope;
+- (BOOL)reserveScopeContinuation:(SPA_NS(TaskScope)*)scope;
+- (void)rejectForScopeLimit;
+@end
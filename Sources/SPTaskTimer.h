@@ -0,0 +1,26 @@
+//
+//  SPTaskTimer.h
+//  SPAsync
+//
+//  Private to SPAsync; not part of the public headers.
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+/** @class SPTaskTimer
+    @abstract One-shot timer on the timer wheel shared by all of SPAsync.
+    @discussion All timers live in one hierarchical timing wheel with millisecond ticks, driven
+    by a single dispatch timer source on a private queue, so arming and disarming a timer is a
+    constant-time list operation under a lock no matter how many other timers are armed. This
+    makes it cheap to put a timeout on every single request, even when most never fire.
+ */
+@interface SPA_NS(TaskTimer) : NSObject
+
+/** Arms a timer that calls 'handler' on 'queue' once 'delay' seconds have passed, or later.
+    If 'queue' is nil, 'handler' is called directly on the timer queue, and must be quick. */
++ (instancetype)timerWithDelay:(NSTimeInterval)delay queue:(dispatch_queue_t)queue handler:(dispatch_block_t)handler;
+
+/** Makes sure the handler won't be called, unless it already has been (or is being right now).
+    Safe to call any number of times, from any thread. */
+- (void)disarm;
+@end
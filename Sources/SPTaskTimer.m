@@ -0,0 +1,231 @@
+//
+//  SPTaskTimer.m
+//  SPAsync
+//
+
+#import "SPTaskTimer.h"
+#import "SPAsyncClock.h"
+#include <pthread.h>
+
+#pragma mark Timer wheel
+/*
+    Four levels of 64 slots each. Level 0 holds the timers due within the next 64 ticks, one
+    slot per tick; each slot of level 1 covers 64 ticks, each slot of level 2 covers 64 level 1
+    slots, and so on, for a horizon of 2^24 ms (about four and a half hours). Timers further
+    out than that wait in the last level and are re-filed whenever they come up.
+
+    Every time level 0 wraps around, the next slot of level 1 is emptied and its timers are
+    re-filed into level 0 (cascading further up on the levels' own wraparounds), so a timer is
+    moved at most once per level over its lifetime.
+
+    The driving dispatch source only runs while there are armed timers. It wakes up for the
+    next occupied level 0 slot, or at the latest when level 0 wraps around.
+*/
+
+#define SPTaskTimerLevels 4
+#define SPTaskTimerSlotBits 6
+#define SPTaskTimerSlots (1 << SPTaskTimerSlotBits)
+#define SPTaskTimerSlotMask (SPTaskTimerSlots - 1)
+#define SPTaskTimerTick NSEC_PER_MSEC
+#define SPTaskTimerIdle UINT64_MAX
+
+@interface SPA_NS(TaskTimer) ()
+{
+    @public
+    __unsafe_unretained SPA_NS(TaskTimer) *_prev, *_next; // in its slot while armed
+    uint64_t _expiry; // in ticks
+    int _level, _slot;
+    BOOL _armed;
+    dispatch_queue_t _queue;
+    dispatch_block_t _handler;
+}
+@end
+
+// All of these are protected by gWheelLock. The wheel holds a reference to each armed timer.
+static pthread_mutex_t gWheelLock = PTHREAD_MUTEX_INITIALIZER;
+static __unsafe_unretained SPA_NS(TaskTimer) *gWheel[SPTaskTimerLevels][SPTaskTimerSlots];
+static uint64_t gWheelTick; // the next tick to process
+static NSUInteger gWheelCount; // armed timers
+static uint64_t gWheelWakeTick = SPTaskTimerIdle; // when gWheelSource will next fire
+static dispatch_source_t gWheelSource;
+
+static void SPTaskTimerFile(SPA_NS(TaskTimer) *timer)
+{
+    uint64_t expiry = MAX(timer->_expiry, gWheelTick);
+    uint64_t delta = expiry - gWheelTick;
+    if(delta >> (SPTaskTimerSlotBits * SPTaskTimerLevels))
+        expiry = gWheelTick + (1ull << (SPTaskTimerSlotBits * SPTaskTimerLevels)) - 1;
+
+    int level = 0;
+    while(level < SPTaskTimerLevels - 1 && (delta >> (SPTaskTimerSlotBits * (level + 1))))
+        level++;
+    int slot = (int)((expiry >> (SPTaskTimerSlotBits * level)) & SPTaskTimerSlotMask);
+
+    timer->_level = level;
+    timer->_slot = slot;
+    timer->_prev = nil;
+    timer->_next = gWheel[level][slot];
+    if(timer->_next)
+        timer->_next->_prev = timer;
+    gWheel[level][slot] = timer;
+}
+
+static void SPTaskTimerUnfile(SPA_NS(TaskTimer) *timer)
+{
+    if(timer->_prev)
+        timer->_prev->_next = timer->_next;
+    else
+        gWheel[timer->_level][timer->_slot] = timer->_next;
+    if(timer->_next)
+        timer->_next->_prev = timer->_prev;
+    timer->_prev = timer->_next = nil;
+}
+
+/// Re-files the timers in a slot, and returns the slot's index.
+static int SPTaskTimerCascade(int level)
+{
+    int slot = (int)((gWheelTick >> (SPTaskTimerSlotBits * level)) & SPTaskTimerSlotMask);
+    __unsafe_unretained SPA_NS(TaskTimer) *timer = gWheel[level][slot];
+    gWheel[level][slot] = nil;
+    while(timer) {
+        __unsafe_unretained SPA_NS(TaskTimer) *next = timer->_next;
+        SPTaskTimerFile(timer);
+        timer = next;
+    }
+    return slot;
+}
+
+/// Processes every tick up to and including 'nowTick', and returns the timers that expired
+/// (linked through _next, and still retained by the wheel).
+static void *SPTaskTimerAdvance(uint64_t nowTick)
+{
+    __unsafe_unretained SPA_NS(TaskTimer) *expired = nil;
+    while(gWheelTick <= nowTick && gWheelCount > 0) {
+        int slot = (int)(gWheelTick & SPTaskTimerSlotMask);
+        for(int level = 1; slot == 0 && level < SPTaskTimerLevels; level++)
+            slot = SPTaskTimerCascade(level);
+
+        slot = (int)(gWheelTick & SPTaskTimerSlotMask);
+        __unsafe_unretained SPA_NS(TaskTimer) *timer = gWheel[0][slot];
+        gWheel[0][slot] = nil;
+        while(timer) {
+            __unsafe_unretained SPA_NS(TaskTimer) *next = timer->_next;
+            timer->_armed = NO;
+            timer->_prev = nil;
+            timer->_next = expired;
+            expired = timer;
+            gWheelCount--;
+            timer = next;
+        }
+        gWheelTick++;
+    }
+    if(gWheelCount == 0 && gWheelTick <= nowTick)
+        gWheelTick = nowTick + 1;
+    return (__bridge void*)expired;
+}
+
+/// The next tick at which something might happen: the next occupied slot in level 0, or the
+/// cascade when level 0 wraps around.
+static uint64_t SPTaskTimerNextWakeTick(void)
+{
+    if(gWheelCount == 0)
+        return SPTaskTimerIdle;
+    uint64_t tick = gWheelTick;
+    do {
+        if(gWheel[0][tick & SPTaskTimerSlotMask])
+            return tick;
+        tick++;
+    } while(tick & SPTaskTimerSlotMask);
+    return tick;
+}
+
+static void SPTaskTimerScheduleWake(uint64_t wakeTick, uint64_t now)
+{
+    gWheelWakeTick = wakeTick;
+    if(wakeTick == SPTaskTimerIdle)
+        return;
+    uint64_t wake = wakeTick * SPTaskTimerTick;
+    dispatch_source_set_timer(gWheelSource, dispatch_time(DISPATCH_TIME_NOW, wake > now ? (int64_t)(wake - now) : 0), DISPATCH_TIME_FOREVER, SPTaskTimerTick / 2);
+}
+
+static void SPTaskTimerFire(void)
+{
+    pthread_mutex_lock(&gWheelLock);
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    __unsafe_unretained SPA_NS(TaskTimer) *expired = (__bridge SPA_NS(TaskTimer)*)SPTaskTimerAdvance(now / SPTaskTimerTick);
+    // The source is one-shot, so always re-arm it if there's anything left.
+    SPTaskTimerScheduleWake(SPTaskTimerNextWakeTick(), now);
+    pthread_mutex_unlock(&gWheelLock);
+
+    while(expired) {
+        SPA_NS(TaskTimer) *timer = (__bridge_transfer SPA_NS(TaskTimer)*)(__bridge void*)expired;
+        expired = timer->_next;
+        timer->_next = nil;
+
+        dispatch_block_t handler = timer->_handler;
+        timer->_handler = nil; // it might well reference whoever holds on to the timer
+        if(timer->_queue)
+            dispatch_async(timer->_queue, handler);
+        else
+            handler();
+    }
+}
+
+static void SPTaskTimerSetUp(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        dispatch_queue_t queue = dispatch_queue_create("SPAsync.timers", DISPATCH_QUEUE_SERIAL);
+        gWheelSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+        dispatch_source_set_timer(gWheelSource, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_source_set_event_handler(gWheelSource, ^{
+            SPTaskTimerFire();
+        });
+        dispatch_resume(gWheelSource);
+    });
+}
+
+@implementation SPA_NS(TaskTimer)
++ (instancetype)timerWithDelay:(NSTimeInterval)delay queue:(dispatch_queue_t)queue handler:(dispatch_block_t)handler
+{
+    SPTaskTimerSetUp();
+
+    SPA_NS(TaskTimer) *timer = [self new];
+    timer->_queue = queue;
+    timer->_handler = [handler copy];
+    uint64_t now = SPAsyncMonotonicNanoseconds();
+    uint64_t delayNanoseconds = delay > 0 ? (uint64_t)(delay * NSEC_PER_SEC) : 0;
+    timer->_expiry = (now + delayNanoseconds + SPTaskTimerTick - 1) / SPTaskTimerTick;
+
+    pthread_mutex_lock(&gWheelLock);
+    if(gWheelCount == 0)
+        gWheelTick = MAX(gWheelTick, now / SPTaskTimerTick);
+    (void)(__bridge_retained void*)timer;
+    SPTaskTimerFile(timer);
+    timer->_armed = YES;
+    gWheelCount++;
+    if(timer->_expiry < gWheelWakeTick)
+        SPTaskTimerScheduleWake(timer->_expiry, now);
+    pthread_mutex_unlock(&gWheelLock);
+
+    return timer;
+}
+
+- (void)disarm
+{
+    pthread_mutex_lock(&gWheelLock);
+    BOOL wasArmed = _armed;
+    if(wasArmed) {
+        SPTaskTimerUnfile(self);
+        _armed = NO;
+        gWheelCount--;
+        // The source may be left to fire once for nothing; that's cheaper than re-arming it.
+    }
+    pthread_mutex_unlock(&gWheelLock);
+
+    if(wasArmed) {
+        _handler = nil;
+        (void)(__bridge_transfer SPA_NS(TaskTimer)*)(__bridge void*)self;
+    }
+}
+@end
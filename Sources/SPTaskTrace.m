@@ -0,0 +1,460 @@
+//
+//  SPTaskTrace.m
+//  SPAsync
+//
+
+#import "SPTaskTraceRecording.h"
+#import "SPAsyncClock.h"
+#include <objc/runtime.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#pragma mark Recording
+/*
+    Each thread that records anything gets a ring buffer of its own, which only that thread
+    ever writes to: an event is written to the slot at 'head', and then 'head' is bumped with a
+    release store to publish it. Readers snapshot 'head', copy out the slots before it, and
+    then check 'head' again to throw away whatever the writer may have lapped in the meantime,
+    so recording never waits for a reader.
+
+    Buffers are never freed (a thread that exits leaves its events behind for export), and are
+    kept on a lock-free list so that registering one doesn't contend with anything either.
+
+    Events only carry the address of the queue or executor they were put on. The first time a
+    thread sees an address, it also copies the queue's label (or the executor's class) into a
+    small ring of labels next to its events, published the same way, so naming queues never
+    takes a lock or allocates; the strings are only made when the labels are read.
+*/
+
+enum { SPTaskTraceBufferCapacity = 8192, SPTaskTraceLabelCapacity = 64 };
+
+typedef struct {
+    uint64_t timestamp; // SPAsyncMonotonicNanoseconds()
+    uint64_t flow;
+    const void *task;
+    const void *other;
+    SPTaskTraceEventKind kind;
+} SPTaskTraceRecord;
+
+typedef struct {
+    const void *queue;
+    Class executorClass; // Nil for a dispatch queue
+    char name[64]; // the dispatch queue's label, cut short if need be
+} SPTaskTraceLabelRecord;
+
+typedef struct SPTaskTraceBuffer {
+    struct SPTaskTraceBuffer *next;
+    uint32_t thread; // the tid in exported traces
+    char threadName[64];
+    _Atomic uint64_t head; // events ever written
+    _Atomic uint64_t start; // events before this were forgotten by +reset
+    SPTaskTraceRecord records[SPTaskTraceBufferCapacity];
+    _Atomic uint64_t labelHead; // labels ever written
+    SPTaskTraceLabelRecord labels[SPTaskTraceLabelCapacity];
+} SPTaskTraceBuffer;
+
+atomic_bool SPA_NS(TaskTraceEnabled);
+static _Atomic(SPTaskTraceBuffer *) gBuffers;
+static atomic_uint gThreadCount;
+static _Atomic uint64_t gFlowCount;
+static __thread SPTaskTraceBuffer *tBuffer;
+
+static __thread const void *tLastLabelled; // skips the search for runs on the same queue
+
+static SPTaskTraceBuffer *SPTaskTraceCurrentBuffer(void)
+{
+    SPTaskTraceBuffer *buffer = tBuffer;
+    if(buffer)
+        return buffer;
+
+    buffer = calloc(1, sizeof(SPTaskTraceBuffer));
+    buffer->thread = atomic_fetch_add(&gThreadCount, 1) + 1;
+    pthread_getname_np(pthread_self(), buffer->threadName, sizeof(buffer->threadName));
+
+    SPTaskTraceBuffer *head = atomic_load_explicit(&gBuffers, memory_order_relaxed);
+    do {
+        buffer->next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&gBuffers, &head, buffer, memory_order_release, memory_order_relaxed));
+
+    tBuffer = buffer;
+    return buffer;
+}
+
+static void SPTaskTraceLabel(SPTaskTraceBuffer *buffer, const void *queue, BOOL isExecutor)
+{
+    if(queue == tLastLabelled)
+        return;
+    tLastLabelled = queue;
+
+    // Only this thread writes the ring, so it can read it back without any ordering.
+    uint64_t head = atomic_load_explicit(&buffer->labelHead, memory_order_relaxed);
+    for(uint64_t i = head; i > 0 && head - i < SPTaskTraceLabelCapacity; i--)
+        if(buffer->labels[(i - 1) % SPTaskTraceLabelCapacity].queue == queue)
+            return;
+
+    SPTaskTraceLabelRecord *label = &buffer->labels[head % SPTaskTraceLabelCapacity];
+    label->queue = queue;
+    label->executorClass = Nil;
+    label->name[0] = 0;
+    if(isExecutor) {
+        label->executorClass = object_getClass((__bridge id)queue);
+    } else {
+#if OS_OBJECT_USE_OBJC_RETAIN_RELEASE
+        const char *name = dispatch_queue_get_label((__bridge dispatch_queue_t)queue);
+#else
+        const char *name = dispatch_queue_get_label((dispatch_queue_t)queue);
+#endif
+        if(name) {
+            strncpy(label->name, name, sizeof(label->name) - 1);
+            label->name[sizeof(label->name) - 1] = 0;
+        }
+    }
+    atomic_store_explicit(&buffer->labelHead, head + 1, memory_order_release);
+}
+
+void SPA_NS(TaskTraceRecord)(SPTaskTraceEventKind kind, const void *task, const void *other, uint64_t flow)
+{
+    SPTaskTraceBuffer *buffer = SPTaskTraceCurrentBuffer();
+    if(kind == SPTaskTraceEnqueued || kind == SPTaskTraceEnqueuedOnExecutor)
+        SPTaskTraceLabel(buffer, other, kind == SPTaskTraceEnqueuedOnExecutor);
+
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    buffer->records[head % SPTaskTraceBufferCapacity] = (SPTaskTraceRecord){
+        .timestamp = SPAsyncMonotonicNanoseconds(),
+        .flow = flow,
+        .task = task,
+        .other = other,
+        .kind = kind,
+    };
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+uint64_t SPA_NS(TaskTraceNextFlow)(void)
+{
+    return atomic_fetch_add_explicit(&gFlowCount, 1, memory_order_relaxed) + 1;
+}
+
+#pragma mark Reading
+
+@interface SPA_NS(TaskTraceEntry) : NSObject
+{
+@public
+    SPTaskTraceRecord _record;
+    uint32_t _thread;
+}
+@end
+@implementation SPA_NS(TaskTraceEntry)
+@end
+
+@interface SPA_NS(TaskTraceChain) ()
+@property(nonatomic,readwrite) NSString *rootTask;
+@property(nonatomic,readwrite) NSUInteger taskCount;
+@property(nonatomic,readwrite) NSTimeInterval duration;
+@end
+@implementation SPA_NS(TaskTraceChain)
+- (NSString*)description
+{
+    return [NSString stringWithFormat:@"<%@ %p: %lu tasks from %@ in %.3fms>", [self class], self, (unsigned long)_taskCount, _rootTask, _duration*1000];
+}
+@end
+
+@interface SPA_NS(TaskTraceQueueStatistics) ()
+@property(nonatomic,readwrite) NSString *label;
+@property(nonatomic,readwrite) NSUInteger count;
+@property(nonatomic,readwrite) NSTimeInterval meanWait;
+@property(nonatomic,readwrite) NSTimeInterval maxWait;
+@end
+@implementation SPA_NS(TaskTraceQueueStatistics)
+- (NSString*)description
+{
+    return [NSString stringWithFormat:@"<%@ %p: %@, %lu waits, mean %.3fms, max %.3fms>", [self class], self, _label, (unsigned long)_count, _meanWait*1000, _maxWait*1000];
+}
+@end
+
+@implementation SPA_NS(TaskTrace)
+
++ (void)setEnabled:(BOOL)enabled
+{
+    atomic_store(&SPA_NS(TaskTraceEnabled), enabled);
+}
+
++ (BOOL)isEnabled
+{
+    return atomic_load(&SPA_NS(TaskTraceEnabled));
+}
+
++ (void)reset
+{
+    for(SPTaskTraceBuffer *buffer = atomic_load_explicit(&gBuffers, memory_order_acquire); buffer; buffer = buffer->next)
+        atomic_store(&buffer->start, atomic_load_explicit(&buffer->head, memory_order_acquire));
+}
+
+/// Everything still in the buffers, oldest first.
++ (NSArray*)entries
+{
+    NSMutableArray *entries = [NSMutableArray new];
+    for(SPTaskTraceBuffer *buffer = atomic_load_explicit(&gBuffers, memory_order_acquire); buffer; buffer = buffer->next) {
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t first = MAX(atomic_load(&buffer->start), head > SPTaskTraceBufferCapacity ? head - SPTaskTraceBufferCapacity : 0);
+        NSMutableArray *copied = [NSMutableArray arrayWithCapacity:(NSUInteger)(head - first)];
+        for(uint64_t i = first; i < head; i++) {
+            SPA_NS(TaskTraceEntry) *entry = [SPA_NS(TaskTraceEntry) new];
+            entry->_record = buffer->records[i % SPTaskTraceBufferCapacity];
+            entry->_thread = buffer->thread;
+            [copied addObject:entry];
+        }
+
+        // Throw away whatever the thread overwrote while we were copying.
+        uint64_t lapped = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t valid = lapped > SPTaskTraceBufferCapacity ? lapped - SPTaskTraceBufferCapacity : 0;
+        if(valid > first)
+            [copied removeObjectsInRange:NSMakeRange(0, (NSUInteger)MIN(valid - first, copied.count))];
+        [entries addObjectsFromArray:copied];
+    }
+
+    [entries sortUsingComparator:^NSComparisonResult(SPA_NS(TaskTraceEntry) *a, SPA_NS(TaskTraceEntry) *b) {
+        if(a->_record.timestamp == b->_record.timestamp)
+            return NSOrderedSame;
+        return a->_record.timestamp < b->_record.timestamp ? NSOrderedAscending : NSOrderedDescending;
+    }];
+    return entries;
+}
+
+/// Labels of the queues and executors that anything has been enqueued on, by address.
++ (NSDictionary*)labels
+{
+    NSMutableDictionary *labels = [NSMutableDictionary new];
+    for(SPTaskTraceBuffer *buffer = atomic_load_explicit(&gBuffers, memory_order_acquire); buffer; buffer = buffer->next) {
+        uint64_t head = atomic_load_explicit(&buffer->labelHead, memory_order_acquire);
+        uint64_t first = head > SPTaskTraceLabelCapacity ? head - SPTaskTraceLabelCapacity : 0;
+        for(uint64_t i = first; i < head; i++) {
+            SPTaskTraceLabelRecord record = buffer->labels[i % SPTaskTraceLabelCapacity];
+            // Throw it away if the thread may have started on its slot while we were copying.
+            if(i + SPTaskTraceLabelCapacity <= atomic_load_explicit(&buffer->labelHead, memory_order_acquire))
+                continue;
+
+            NSString *label;
+            if(record.executorClass) {
+                label = [NSString stringWithFormat:@"%@ %p", NSStringFromClass(record.executorClass), record.queue];
+            } else {
+                record.name[sizeof(record.name) - 1] = 0;
+                label = record.name[0] ? @(record.name) : [NSString stringWithFormat:@"queue %p", record.queue];
+            }
+            labels[[NSValue valueWithPointer:record.queue]] = label;
+        }
+    }
+    return labels;
+}
+
+static NSString *SPTaskTraceAddress(const void *pointer)
+{
+    return [NSString stringWithFormat:@"%p", pointer];
+}
+
++ (NSData*)chromeTraceJSON
+{
+    NSArray *entries = [self entries];
+    NSDictionary *labels = [self labels];
+    NSNumber *pid = @(getpid());
+    NSMutableArray *events = [NSMutableArray arrayWithCapacity:entries.count + 8];
+
+    for(SPTaskTraceBuffer *buffer = atomic_load_explicit(&gBuffers, memory_order_acquire); buffer; buffer = buffer->next) {
+        if(!buffer->threadName[0])
+            continue;
+        [events addObject:@{
+            @"name": @"thread_name", @"ph": @"M", @"pid": pid, @"tid": @(buffer->thread),
+            @"args": @{@"name": @(buffer->threadName)},
+        }];
+    }
+
+    // Dequeues only carry their flow, so remember which queue each flow went to.
+    NSMutableDictionary *flowLabels = [NSMutableDictionary new];
+    for(SPA_NS(TaskTraceEntry) *entry in entries) {
+        SPTaskTraceRecord record = entry->_record;
+        NSMutableDictionary *event = [@{
+            @"pid": pid,
+            @"tid": @(entry->_thread),
+            @"ts": @(record.timestamp / 1000.0),
+        } mutableCopy];
+
+        switch(record.kind) {
+            case SPTaskTraceCreated:
+            case SPTaskTraceSucceeded:
+            case SPTaskTraceFailed:
+            case SPTaskTraceCancelled:
+                event[@"name"] = @"task";
+                event[@"cat"] = @"task";
+                event[@"id"] = SPTaskTraceAddress(record.task);
+                if(record.kind == SPTaskTraceCreated) {
+                    event[@"ph"] = @"b";
+                } else {
+                    event[@"ph"] = @"e";
+                    event[@"args"] = @{@"outcome":
+                        record.kind == SPTaskTraceSucceeded ? @"succeeded" :
+                        record.kind == SPTaskTraceFailed ? @"failed" : @"cancelled"
+                    };
+                }
+                break;
+            case SPTaskTraceEnqueued:
+            case SPTaskTraceEnqueuedOnExecutor: {
+                NSString *label = labels[[NSValue valueWithPointer:record.other]] ?: SPTaskTraceAddress(record.other);
+                flowLabels[@(record.flow)] = label;
+                event[@"name"] = label;
+                event[@"cat"] = @"queue";
+                event[@"ph"] = @"b";
+                event[@"id"] = [NSString stringWithFormat:@"0x%llx", (unsigned long long)record.flow];
+                event[@"args"] = @{@"task": SPTaskTraceAddress(record.task)};
+                break;
+            }
+            case SPTaskTraceDequeued: {
+                NSString *label = flowLabels[@(record.flow)];
+                if(!label)
+                    continue; // enqueued before the trace starts
+                event[@"name"] = label;
+                event[@"cat"] = @"queue";
+                event[@"ph"] = @"e";
+                event[@"id"] = [NSString stringWithFormat:@"0x%llx", (unsigned long long)record.flow];
+                break;
+            }
+            case SPTaskTraceEdge:
+                event[@"name"] = @"edge";
+                event[@"cat"] = @"task";
+                event[@"ph"] = @"i";
+                event[@"s"] = @"t";
+                event[@"args"] = @{@"from": SPTaskTraceAddress(record.task), @"to": SPTaskTraceAddress(record.other)};
+                break;
+        }
+        [events addObject:event];
+    }
+
+    return [NSJSONSerialization dataWithJSONObject:@{@"traceEvents": events, @"displayTimeUnit": @"ms"} options:0 error:NULL];
+}
+
++ (BOOL)writeChromeTraceToURL:(NSURL*)url error:(NSError**)error
+{
+    return [[self chromeTraceJSON] writeToURL:url options:NSDataWritingAtomic error:error];
+}
+
+static NSValue *SPTaskTraceFind(NSMutableDictionary *parents, NSValue *task)
+{
+    NSValue *parent = parents[task];
+    if(!parent || [parent isEqual:task])
+        return task;
+    NSValue *root = SPTaskTraceFind(parents, parent);
+    parents[task] = root;
+    return root;
+}
+
++ (NSArray*)slowestChains:(NSUInteger)limit
+{
+    NSMutableDictionary *starts = [NSMutableDictionary new]; // task -> NSNumber
+    NSMutableDictionary *ends = [NSMutableDictionary new];
+    NSMutableDictionary *parents = [NSMutableDictionary new]; // union-find over edges
+
+    for(SPA_NS(TaskTraceEntry) *entry in [self entries]) {
+        SPTaskTraceRecord record = entry->_record;
+        NSValue *task = [NSValue valueWithPointer:record.task];
+        NSNumber *timestamp = @(record.timestamp);
+        switch(record.kind) {
+            case SPTaskTraceCreated:
+                // Addresses are reused; a new task at the same address starts over.
+                starts[task] = timestamp;
+                [ends removeObjectForKey:task];
+                break;
+            case SPTaskTraceSucceeded:
+            case SPTaskTraceFailed:
+            case SPTaskTraceCancelled:
+                if(!starts[task])
+                    starts[task] = timestamp;
+                ends[task] = timestamp;
+                break;
+            case SPTaskTraceEdge: {
+                NSValue *other = [NSValue valueWithPointer:record.other];
+                for(NSValue *each in @[task, other])
+                    if(!starts[each])
+                        starts[each] = timestamp;
+                NSValue *a = SPTaskTraceFind(parents, task), *b = SPTaskTraceFind(parents, other);
+                if(![a isEqual:b])
+                    parents[b] = a;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    NSMutableDictionary *chains = [NSMutableDictionary new]; // component root -> chain
+    NSMutableDictionary *chainStarts = [NSMutableDictionary new], *chainEnds = [NSMutableDictionary new];
+    for(NSValue *task in starts) {
+        NSValue *component = SPTaskTraceFind(parents, task);
+        SPA_NS(TaskTraceChain) *chain = chains[component];
+        if(!chain) {
+            chain = chains[component] = [SPA_NS(TaskTraceChain) new];
+            chainEnds[component] = @0ull;
+        }
+        chain.taskCount++;
+        NSNumber *start = starts[task];
+        if(!chainStarts[component] || [start compare:chainStarts[component]] == NSOrderedAscending) {
+            chainStarts[component] = start;
+            chain.rootTask = SPTaskTraceAddress([task pointerValue]);
+        }
+        NSNumber *end = ends[task];
+        if(end && [end compare:chainEnds[component]] == NSOrderedDescending)
+            chainEnds[component] = end;
+    }
+
+    NSMutableArray *result = [NSMutableArray new];
+    for(NSValue *component in chains) {
+        uint64_t start = [chainStarts[component] unsignedLongLongValue], end = [chainEnds[component] unsignedLongLongValue];
+        if(end < start)
+            continue; // nothing in it has resolved yet
+        SPA_NS(TaskTraceChain) *chain = chains[component];
+        chain.duration = (end - start) / (NSTimeInterval)NSEC_PER_SEC;
+        [result addObject:chain];
+    }
+    [result sortUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:@"duration" ascending:NO]]];
+    return [result subarrayWithRange:NSMakeRange(0, MIN(limit, result.count))];
+}
+
++ (NSArray*)worstQueues:(NSUInteger)limit
+{
+    NSDictionary *labels = [self labels];
+    NSMutableDictionary *pending = [NSMutableDictionary new]; // flow -> enqueue entry
+    NSMutableDictionary *statistics = [NSMutableDictionary new]; // label -> statistics
+    NSMutableDictionary *totals = [NSMutableDictionary new];
+
+    for(SPA_NS(TaskTraceEntry) *entry in [self entries]) {
+        SPTaskTraceRecord record = entry->_record;
+        if(record.kind == SPTaskTraceEnqueued || record.kind == SPTaskTraceEnqueuedOnExecutor) {
+            pending[@(record.flow)] = entry;
+        } else if(record.kind == SPTaskTraceDequeued) {
+            SPA_NS(TaskTraceEntry) *enqueued = pending[@(record.flow)];
+            if(!enqueued)
+                continue;
+            [pending removeObjectForKey:@(record.flow)];
+
+            NSString *label = labels[[NSValue valueWithPointer:enqueued->_record.other]] ?: SPTaskTraceAddress(enqueued->_record.other);
+            SPA_NS(TaskTraceQueueStatistics) *queue = statistics[label];
+            if(!queue) {
+                queue = statistics[label] = [SPA_NS(TaskTraceQueueStatistics) new];
+                queue.label = label;
+            }
+            NSTimeInterval wait = (record.timestamp - enqueued->_record.timestamp) / (NSTimeInterval)NSEC_PER_SEC;
+            queue.count++;
+            queue.maxWait = MAX(queue.maxWait, wait);
+            totals[label] = @([totals[label] doubleValue] + wait);
+        }
+    }
+
+    NSMutableArray *result = [NSMutableArray new];
+    for(NSString *label in statistics) {
+        SPA_NS(TaskTraceQueueStatistics) *queue = statistics[label];
+        queue.meanWait = [totals[label] doubleValue] / queue.count;
+        [result addObject:queue];
+    }
+    [result sortUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:@"meanWait" ascending:NO]]];
+    return [result subarrayWithRange:NSMakeRange(0, MIN(limit, result.count))];
+}
+
+@end
@@ -0,0 +1,51 @@
+//
+//  SPTaskTraceRecording.h
+//  SPAsync
+//
+//  Private to SPAsync; not part of the public headers.
+
+#import <SPAsync/SPTaskTrace.h>
+#include <stdatomic.h>
+
+typedef NS_ENUM(uint8_t, SPTaskTraceEventKind) {
+    SPTaskTraceCreated,
+    SPTaskTraceSucceeded,
+    SPTaskTraceFailed,
+    SPTaskTraceCancelled,
+    /// 'other' is the dispatch queue (or executor) that callbacks of 'task' were put on, and
+    /// 'flow' pairs this with the SPTaskTraceDequeued for when they started running.
+    SPTaskTraceEnqueued,
+    SPTaskTraceEnqueuedOnExecutor,
+    SPTaskTraceDequeued,
+    /// 'task' feeds into 'other'.
+    SPTaskTraceEdge,
+};
+
+extern atomic_bool SPA_NS(TaskTraceEnabled);
+extern void SPA_NS(TaskTraceRecord)(SPTaskTraceEventKind kind, const void *task, const void *other, uint64_t flow);
+extern uint64_t SPA_NS(TaskTraceNextFlow)(void);
+
+#define SPTaskTraceIsEnabled() __builtin_expect(atomic_load_explicit(&SPA_NS(TaskTraceEnabled), memory_order_relaxed), 0)
+
+static inline void SPTaskTraceEvent(SPTaskTraceEventKind kind, const void *task, const void *other)
+{
+    if(SPTaskTraceIsEnabled())
+        SPA_NS(TaskTraceRecord)(kind, task, other, 0);
+}
+
+/// Records callbacks of 'task' being put on 'queue', and returns what to pass to
+/// SPTaskTraceDequeue once they start running; 0 if tracing is off.
+static inline uint64_t SPTaskTraceEnqueue(const void *task, const void *queue, BOOL isExecutor)
+{
+    if(!SPTaskTraceIsEnabled())
+        return 0;
+    uint64_t flow = SPA_NS(TaskTraceNextFlow)();
+    SPA_NS(TaskTraceRecord)(isExecutor ? SPTaskTraceEnqueuedOnExecutor : SPTaskTraceEnqueued, task, queue, flow);
+    return flow;
+}
+
+static inline void SPTaskTraceDequeue(const void *task, uint64_t flow)
+{
+    if(__builtin_expect(flow != 0, 0))
+        SPA_NS(TaskTraceRecord)(SPTaskTraceDequeued, task, NULL, flow);
+}
@@ -1,4 +1,8 @@
 #import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+#import <SPAsync/SPAgentMailbox.h>
+
+@class SPA_NS(Task);
 
 /**
  Experimental multithreading primitive: An object conforming to SPAgent is not thread safe,
@@ -7,9 +11,27 @@
  */
 @protocol SPAgent <NSObject>
 @property(nonatomic,readonly) dispatch_queue_t workQueue;
+@optional
+/// If the agent has a mailbox (usually on its workQueue), messages go through it instead, to be
+/// bounded, prioritized and coalesced as it's configured to. Should always return the same mailbox.
+@property(nonatomic,readonly) SPA_NS(AgentMailbox) *mailbox;
 @end
 
-/// Returns invocation grabber; resulting invocation will be performed on workQueue. Proxied invocation returns an SPTask.
+typedef id(^SPAgentPerformCallback)(id agent);
+
 @interface NSObject (SPAgentDo)
+/// Returns a proxy; the message sent to it will be performed on workQueue. Proxied methods that return
+/// an object return an SPTask of that object instead.
+/// Methods taking up to three objects and returning an object or void are called straight through a
+/// cached IMP; others go through NSInvocation.
 - (instancetype)sp_agentAsync;
-@end
\ No newline at end of file
+/// Like sp_agentAsync, for agents with a mailbox: the message goes in with 'priority'.
+- (instancetype)sp_agentAsyncWithPriority:(SPAgentPriority)priority;
+/// Calls 'work' with the receiver on its workQueue, and returns a task for what it returns.
+- (SPA_NS(Task)*)sp_agentPerform:(SPAgentPerformCallback)work;
+- (SPA_NS(Task)*)sp_agentPerform:(SPAgentPerformCallback)work priority:(SPAgentPriority)priority;
+/// On a proxy from sp_agentAsync to an agent with a mailbox, the task of the latest message sent
+/// through it that returns nothing: it fails if the mailbox turned the message away, and
+/// otherwise completes with nil once the message has run. nil for anything else.
+- (SPA_NS(Task)*)sp_agentLastTask;
+@end
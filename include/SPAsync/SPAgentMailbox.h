@@ -0,0 +1,82 @@
+//
+//  SPAgentMailbox.h
+//  SPAsync
+//
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+@class SPA_NS(Task);
+
+/** Domain of the errors that an SPAgentMailbox fails messages with. */
+extern NSString *const SPA_NS(AgentErrorDomain);
+typedef NS_ENUM(NSInteger, SPAgentErrorCode) {
+    /// The mailbox was full, and its overflow policy is SPAgentMailboxOverflowReject, or it's
+    /// SPAgentMailboxOverflowBackpressure and as many messages as it holds are already waiting.
+    SPAgentErrorMailboxFull = 1,
+    /// The message was dropped from a full mailbox to make room for a newer one.
+    SPAgentErrorMessageDropped = 2,
+};
+
+typedef NS_ENUM(NSInteger, SPAgentPriority) {
+    SPAgentPriorityLow,
+    SPAgentPriorityNormal,
+    SPAgentPriorityHigh,
+};
+
+/** What a mailbox does with a message when it already holds 'capacity' of them. */
+typedef NS_ENUM(NSInteger, SPAgentMailboxOverflow) {
+    /// The new message's task fails right away with SPAgentErrorMailboxFull.
+    SPAgentMailboxOverflowReject,
+    /// The oldest message of the lowest priority pending is dropped, its task failing with
+    /// SPAgentErrorMessageDropped.
+    SPAgentMailboxOverflowDropOldest,
+    /// The new message waits outside the mailbox until there's room, so the sender's task only
+    /// completes once the agent has caught up. Senders that wait for their tasks before sending
+    /// more are thus held back to the agent's pace. Only 'capacity' messages wait at a time;
+    /// beyond that, messages are rejected as with SPAgentMailboxOverflowReject.
+    SPAgentMailboxOverflowBackpressure,
+};
+
+typedef id(^SPAgentMessageCallback)(void);
+
+/** @class SPAgentMailbox
+    @abstract A bounded, prioritized queue of messages in front of an agent's work queue.
+    @discussion An agent that returns a mailbox from -[SPAgent mailbox] gets its sp_agentAsync and
+    sp_agentPerform: messages through it rather than straight on its workQueue. Messages run one at
+    a time on the mailbox's queue, highest priority first and otherwise in the order they were
+    sent, a few at a time so that other work on the queue gets a chance in between.
+
+    A message whose task is cancelled before it starts is skipped.
+
+    Messages with a selector registered with coalesceSelector: collapse: if one with the same
+    selector is already waiting, the new one takes its place (so its arguments win), and both
+    senders get a task for the one call that's made. Each sender's task is its own, so
+    cancelling it only gives up on the call for that sender; the call is skipped only if all of
+    them cancel before it starts.
+ */
+@interface SPA_NS(AgentMailbox) : NSObject
+- (instancetype)initWithQueue:(dispatch_queue_t)queue capacity:(NSUInteger)capacity overflow:(SPAgentMailboxOverflow)overflow;
+@property(nonatomic,readonly) dispatch_queue_t queue;
+@property(nonatomic,readonly) NSUInteger capacity;
+@property(nonatomic,readonly) SPAgentMailboxOverflow overflow;
+
+/** Makes messages with 'selector' collapse into the one that's already waiting, if any. */
+- (void)coalesceSelector:(SEL)selector;
+
+/** Queues 'work' and returns a task for what it returns. 'selector' is what coalescing goes by,
+    and may be NULL. */
+- (SPA_NS(Task)*)send:(SPAgentMessageCallback)work priority:(SPAgentPriority)priority selector:(SEL)selector;
+
+/// Messages waiting in the mailbox, of all priorities.
+@property(readonly) NSUInteger depth;
+- (NSUInteger)depthForPriority:(SPAgentPriority)priority;
+/// Messages held back outside the mailbox by SPAgentMailboxOverflowBackpressure.
+@property(readonly) NSUInteger waitingCount;
+/// Messages run per second, over about the last second.
+@property(readonly) double drainRate;
+@property(readonly) NSUInteger processedCount;
+@property(readonly) NSUInteger rejectedCount;
+@property(readonly) NSUInteger droppedCount;
+@property(readonly) NSUInteger coalescedCount;
+@end
@@ -1,3 +1,9 @@
 #import <SPAsync/SPTask.h>
+#import <SPAsync/SPExecutor.h>
+#import <SPAsync/SPTaskCache.h>
+#import <SPAsync/SPTaskScope.h>
+#import <SPAsync/SPStream.h>
+#import <SPAsync/SPTaskTrace.h>
+#import <SPAsync/SPAgentMailbox.h>
 #import <SPAsync/SPAgent.h>
 #import <SPAsync/SPAwait.h>
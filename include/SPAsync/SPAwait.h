@@ -31,7 +31,8 @@
             
             confirmation = SPAsyncAwait([_network read:1]);
             
-            // Returning will complete the SPTask, sending this value to all the callbacks registered with it
+            // Returning will complete the SPTask, sending this value to all the callbacks registered with it.
+            // If an awaited task fails instead, the method stops there, and its task fails with the same error.
             return @([confirmation bytes][0] == 0);
             
             // You must also clean up the async method body manually.
@@ -53,15 +54,14 @@
 /** @macro SPAsyncAwait
     @abstract Pauses the execution of the calling method, waiting for the value in
               'awaitable' to be available.
+    @discussion If 'awaitable' has already completed, execution just carries on with its value.
+                If it fails, the method stops, and its task fails with the same error.
  */
  
 #define SPAsyncAwait(awaitable) \
     ({ \
-        [awaitable addCallback:^(id value) { \
-            __weakAwaitCoroutine.lastAwaitedValue = value; \
-            [__weakAwaitCoroutine resumeAt:__LINE__]; \
-        } on:[__weakAwaitCoroutine queueFor:self]]; \
-        return [SPAwaitCoroutine awaitSentinel]; \
+        if(![__weakAwaitCoroutine await:(awaitable) for:self resumeAt:__LINE__]) \
+            return [SPAwaitCoroutine awaitSentinel]; \
         case __LINE__:; \
         __weakAwaitCoroutine.lastAwaitedValue; \
     })
@@ -93,6 +93,11 @@ typedef id(^SPAwaitCoroutineBody)(int resumeAt);
 - (void)resumeAt:(int)line;
 - (void)finish;
 
+/// YES if 'task' has already completed, with its value in lastAwaitedValue; otherwise arranges for
+/// the body to be resumed at 'line' once it does, and returns NO. The body is resumed on the
+/// queueFor: 'object', as worked out at the first await that had to wait.
+- (BOOL)await:(SPTask*)task for:(id)object resumeAt:(int)line;
+
 - (SPTask*)task;
 
 /// works out a suitable queue to continue running on
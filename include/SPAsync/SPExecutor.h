@@ -0,0 +1,50 @@
+//
+//  SPExecutor.h
+//  SPAsync
+//
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+/** @protocol SPExecutor
+    @abstract Anything that can run blocks asynchronously.
+    @discussion Everywhere SPTask takes a dispatch queue to run a callback on, there's also an
+    'onExecutor:' variant that takes one of these instead, so that you can route continuations
+    to a scheduler of your own. Callbacks for the same executor that become ready at the same
+    time are submitted together as one block, just like for queues.
+ */
+@protocol SPA_NS(Executor) <NSObject>
+/** Runs 'block' at some later point, on some thread. Must not run it before returning. */
+- (void)execute:(dispatch_block_t)block;
+@end
+
+/** @class SPDispatchExecutor
+    @abstract Adapts a dispatch queue to SPExecutor.
+    @discussion SPTask recognizes these and uses the queue directly, so passing a queue through
+    an SPDispatchExecutor costs nothing over passing the queue itself.
+ */
+@interface SPA_NS(DispatchExecutor) : NSObject <SPA_NS(Executor)>
++ (instancetype)executorWithQueue:(dispatch_queue_t)queue;
+- (instancetype)initWithQueue:(dispatch_queue_t)queue;
+@property(nonatomic,readonly) dispatch_queue_t queue;
+@end
+
+/** @class SPThreadPool
+    @abstract Fixed-size, work-stealing thread pool.
+    @discussion Each worker thread has its own deque of blocks, and a LIFO slot for the block
+    most recently submitted from that worker: a continuation scheduled from a block running on
+    the pool thus runs next on the same worker, while the data it works on is still in cache,
+    instead of at the back of a shared queue. Blocks submitted from outside the pool go to a
+    shared injection queue. Idle workers steal the oldest blocks from each other's deques, so
+    fork/join style work spreads out across the pool without a central point of contention.
+
+    A worker's LIFO slot isn't stealable, so a block that keeps its worker busy for a long
+    time also holds up whatever it scheduled last. Pools are meant to be long-lived: their
+    threads are never torn down.
+ */
+@interface SPA_NS(ThreadPool) : NSObject <SPA_NS(Executor)>
+/** A pool with one worker per active processor. */
++ (instancetype)sharedPool;
+- (instancetype)initWithThreadCount:(NSUInteger)threadCount;
+@property(nonatomic,readonly) NSUInteger threadCount;
+@end
@@ -0,0 +1,109 @@
+//
+//  SPStream.h
+//  SPAsync
+//
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+@class SPA_NS(StreamSubscription);
+
+typedef void(^SPStreamValueCallback)(id value);
+/// 'error' is nil if the stream finished normally.
+typedef void(^SPStreamFinishedCallback)(NSError *error);
+typedef id(^SPStreamMapCallback)(id value);
+typedef BOOL(^SPStreamFilterCallback)(id value);
+
+/** What a subscription does with a value when its buffer is full. */
+typedef NS_ENUM(NSInteger, SPStreamOverflow) {
+    /// Makes room by dropping the oldest buffered value, so the subscriber sees the latest ones.
+    SPStreamOverflowDropOldest,
+    /// Drops the new value, so the subscriber sees the earliest ones.
+    SPStreamOverflowDropNewest,
+};
+
+/** @class SPStream
+    @abstract A sequence of values over time, as opposed to SPTask's single value.
+    @discussion Streams are hot: values are delivered to whoever is subscribed when they're
+    sent, and are otherwise lost. Each subscription has its own bounded buffer between the
+    stream and the subscriber's queue, so a slow subscriber never makes anything grow without
+    bound: values that arrive while the buffer is full are dropped according to the
+    subscription's overflow policy, and counted in its droppedCount. Producers that would rather
+    not produce values that nobody has room for can check their source's demand first.
+
+    Values are delivered to a subscriber one at a time, in order, on the queue given when
+    subscribing, and a burst of values that arrive while the subscriber is busy is delivered in
+    one go. nil values are skipped.
+
+    Operators (map:, filter: and friends) return a new stream that stays subscribed to the
+    receiver for as long as it's alive.
+ */
+@interface SPA_NS(Stream) : NSObject
+
+/** Calls 'onValue' with every value sent from now on, and 'onFinished' once the stream ends
+    (which it may already have). Up to 64 values are buffered, dropping the oldest. */
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue finished:(SPStreamFinishedCallback)onFinished on:(dispatch_queue_t)queue;
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue on:(dispatch_queue_t)queue;
+
+/** Subscribes with a buffer of 'bufferLimit' values and the given overflow policy. If
+    'manualDemand' is set, values are only delivered as the subscriber asks for them with
+    -[SPStreamSubscription request:]; until then, they wait in the buffer. */
+- (SPA_NS(StreamSubscription)*)subscribe:(SPStreamValueCallback)onValue finished:(SPStreamFinishedCallback)onFinished on:(dispatch_queue_t)queue bufferLimit:(NSUInteger)bufferLimit overflow:(SPStreamOverflow)overflow manualDemand:(BOOL)manualDemand;
+@end
+
+@interface SPA_NS(Stream) (SPStreamOperators)
+/** A stream of 'mapper' applied to each value. Mapping to nil drops the value. */
+- (instancetype)map:(SPStreamMapCallback)mapper;
+/** A stream of only the values that 'predicate' returns YES for. */
+- (instancetype)filter:(SPStreamFilterCallback)predicate;
+/** A stream of arrays of 'count' consecutive values. Whatever is left over when the receiver
+    finishes is sent as a last, shorter array. */
+- (instancetype)buffer:(NSUInteger)count;
+/** A stream of at most one value per 'interval' seconds: the first value goes through right
+    away, and the latest of the values after it goes through once the interval is up. */
+- (instancetype)throttle:(NSTimeInterval)interval;
+/** A stream of the values that aren't followed by another within 'interval' seconds. */
+- (instancetype)debounce:(NSTimeInterval)interval;
+/** A stream of the latest value of each burst: the first value of a burst schedules a
+    delivery on 'queue', and whatever the latest value is when it runs goes through. A value
+    that changes thousands of times a second thus costs one delivery per run of 'queue'. */
+- (instancetype)coalesceOn:(dispatch_queue_t)queue;
+@end
+
+@interface SPA_NS(Stream) (SPStreamKVO)
+/** A stream of the values of 'keyPath' on 'object', starting with the current one. Changes are
+    coalesced as with coalesceOn: 'queue'. When the property is set, the new value is taken from
+    the change notification rather than by asking 'object' again; a nil value is sent as nil.
+    'object' is retained, and observed for as long as the stream is alive. */
++ (instancetype)streamWithKeyPath:(NSString*)keyPath ofObject:(id)object on:(dispatch_queue_t)queue;
+@end
+
+/** @class SPStreamSubscription
+    @abstract One subscriber's view of a stream.
+    @discussion The subscription keeps the stream alive until it's cancelled, or until the
+    stream finishes.
+ */
+@interface SPA_NS(StreamSubscription) : NSObject
+/** Stops delivery. Values still buffered are discarded, and the finished callback isn't called. */
+- (void)cancel;
+/** For subscriptions with manual demand: lets 'count' more values through. */
+- (void)request:(NSUInteger)count;
+/** Values lost to a full buffer. */
+@property(readonly) NSUInteger droppedCount;
+@end
+
+/** @class SPStreamSource
+    Sends values on a stream, like SPTaskCompletionSource does for a task.
+ */
+@interface SPA_NS(StreamSource) : NSObject
+@property(nonatomic,readonly) SPA_NS(Stream) *stream;
+/** Delivers 'value' to every current subscriber. Returns NO if any of them had to drop a value
+    to make room. */
+- (BOOL)send:(id)value;
+/** Ends the stream. Subscribers get everything sent before it, and then their finished callback. */
+- (void)finish;
+- (void)failWithError:(NSError*)error;
+/** How many more values can be sent right now without any subscriber dropping one: the least
+    room left among the subscribers. 0 if there are none. */
+@property(readonly) NSUInteger demand;
+@end
@@ -6,6 +6,7 @@
 
 #import <Foundation/Foundation.h>
 #import <SPAsync/SPAsyncNamespacing.h>
+#import <SPAsync/SPExecutor.h>
 
 #pragma mark Boring build time details (scroll down for actual interface)
 /*
@@ -14,6 +15,7 @@
     the macro `-DSPASYNC_NAMESPACE=LB` at build time in that project.
 */
 @class SPA_NS(Task);
+@protocol SPA_NS(CancellationToken);
 
 /*
     For backwards compatibility with ObjC before lightweight generics, these macros allow us to define
@@ -30,6 +32,30 @@
 
 #pragma mark - SPTask and friends!
 
+/** Domain of the errors that SPTask itself fails tasks with, as opposed to the errors of the
+    work that the tasks represent. */
+extern NSString *const SPA_NS(TaskErrorDomain);
+typedef NS_ENUM(NSInteger, SPTaskErrorCode) {
+    /// The task didn't complete before its timeout: or deadline:.
+    SPTaskErrorTimedOut = 1,
+    /// The task was cancelled before it completed. Only reported by waitWithTimeout:error:.
+    SPTaskErrorCancelled = 2,
+    /// Waiting for the task would never end, because what completes it has to run on the
+    /// waiting thread. Only reported by waitWithTimeout:error:.
+    SPTaskErrorWouldDeadlock = 3,
+    /// The task would have taken its SPTaskScope past one of its limits.
+    SPTaskErrorScopeLimitExceeded = 4,
+};
+
+/** @protocol SPCancellationToken
+    @abstract Something that long-running work can poll to find out whether it's still wanted.
+    @discussion Passed to the work blocks of performCancellableWork:onQueue: and friends. Checking
+    it is as cheap as an atomic load, so feel free to do so in tight loops.
+ */
+@protocol SPA_NS(CancellationToken) <NSObject>
+@property(getter=isCancelled,readonly) BOOL cancelled;
+@end
+
 /** @class SPTask
     @abstract Wraps any asynchronous operation that someone might want to know the result of in the future.
     
@@ -73,14 +99,22 @@ typedef void(^SPTaskFinally)(BOOL cancelled);
 typedef id(^SPTaskThenCallback)(SPA_GENERIC_TYPE(PromisedType) value);
 typedef id(^SPTaskWorkGeneratingCallback)(void);
 typedef SPA_NS(Task*)(^SPTaskTaskGeneratingCallback)(void);
+typedef id(^SPTaskCancellableWorkCallback)(id<SPA_NS(CancellationToken)> token);
+typedef SPA_NS(Task)*(^SPTaskCancellableTaskGeneratingCallback)(id<SPA_NS(CancellationToken)> token);
 typedef SPA_NS(Task)*(^SPTaskChainCallback)(SPA_GENERIC_TYPE(PromisedType) value);
 typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
+typedef id(^SPTaskMapCallback)(id item);
+typedef SPA_NS(Task)*(^SPTaskMapTaskCallback)(id item);
+typedef void(^SPTaskBoolCallback)(BOOL value);
+typedef void(^SPTaskIntegerCallback)(NSInteger value);
+typedef void(^SPTaskDoubleCallback)(double value);
 
 
 /** @method addCallback:on:
     Add a callback to be called async when this task finishes, including the queue to
     call it on. If the task has already finished, the callback will be called immediately
-    (but still asynchronously)
+    (but still asynchronously). Callbacks on the same queue are called in the order
+    they were added, before any finally callbacks on that queue.
     @return self, in case you want to add more call/errbacks on the same task */
 - (instancetype)addCallback:(SPTaskCallback)callback on:(dispatch_queue_t)queue;
 
@@ -106,15 +140,54 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
 	@discussion Like addFinallyCallback:on:, but defaulting to the main queue. */
 - (instancetype)addFinallyCallback:(SPTaskFinally)finally;
 
+/** @method addCallback:onExecutor:
+    @discussion Like addCallback:on:, but running the callback on an executor of your choice.
+    The same goes for the other onExecutor: variants below and elsewhere. */
+- (instancetype)addCallback:(SPTaskCallback)callback onExecutor:(id<SPA_NS(Executor)>)executor;
+- (instancetype)addErrorCallback:(SPTaskErrback)errback onExecutor:(id<SPA_NS(Executor)>)executor;
+- (instancetype)addFinallyCallback:(SPTaskFinally)finally onExecutor:(id<SPA_NS(Executor)>)executor;
+
 /** @method awaitAll:
-    @return A task that will complete when all the given tasks have completed.
+    @return A task that will complete when all the given tasks have completed, with an array
+            of their values (NSNull for nil values), in the same order as 'tasks'. If any task
+            fails, the returned task fails with that error and the tasks that haven't completed
+            yet are cancelled. If any task is cancelled, so is the returned task.
  */
 + (instancetype)awaitAll:(NSArray*)tasks;
 
+/** @method awaitAll:on:
+    @discussion Like awaitAll:, but keeping track of the tasks' results on 'queue'. awaitAll:
+    does its (very cheap) bookkeeping inline, on whichever thread each task completes on.
+ */
++ (instancetype)awaitAll:(NSArray*)tasks on:(dispatch_queue_t)queue;
+
+/** @method awaitAny:
+    @return A task that completes or fails like the first of the given tasks to complete or fail.
+            The other tasks are left running. If all of them are cancelled, so is the returned task.
+ */
++ (instancetype)awaitAny:(NSArray*)tasks;
++ (instancetype)awaitAny:(NSArray*)tasks on:(dispatch_queue_t)queue;
+
+/** @method awaitFirstSuccess:
+    @return A task that completes with the value of the first of the given tasks to complete,
+            cancelling the rest. Failures are ignored unless every task fails, in which case the
+            returned task fails with the error of the earliest task in 'tasks' that failed.
+ */
++ (instancetype)awaitFirstSuccess:(NSArray*)tasks;
++ (instancetype)awaitFirstSuccess:(NSArray*)tasks on:(dispatch_queue_t)queue;
+
+/** @method awaitAllSettled:
+    @return A task that completes when all the given tasks have completed or failed, with an
+            array holding each task's value (NSNull for nil values) or NSError, in the same order
+            as 'tasks'. It never fails. If any task is cancelled, so is the returned task.
+ */
++ (instancetype)awaitAllSettled:(NSArray*)tasks;
++ (instancetype)awaitAllSettled:(NSArray*)tasks on:(dispatch_queue_t)queue;
+
 @end
 
 
-@interface SPA_NS(Task) (SPTaskCancellation)
+@interface SPA_NS(Task) (SPTaskCancellation) <SPA_NS(CancellationToken)>
 /** @property cancelled
 	Whether someone has explicitly cancelled this task.
  */
@@ -145,6 +218,10 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
     returned SPTask represents this work-to-be-provided.
     @return A new task to be executed when 'self' completes, representing
             the work provided by 'worker'
+    @discussion Cancelling the returned task cancels the task 'chainer' returned. If that
+                is a task made by then:, chain: or recover: that no other chain: or recover:
+                has been given, the two are merged, so that a chain: that recursively chains
+                more work doesn't grow with every step. The same goes for recover:.
   */
 - (instancetype)chain:(SPTaskChainCallback)chainer on:(dispatch_queue_t)queue;
 
@@ -164,6 +241,150 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
     If it returns a new SPTask, its completion will determine the completion of the returned
     task. If it returns nil, the original error will be propagated. */
 - (instancetype)recover:(SPTaskRecoverCallback)recoverer on:(dispatch_queue_t)queue;
+
+- (instancetype)then:(SPTaskThenCallback)worker onExecutor:(id<SPA_NS(Executor)>)executor;
+- (instancetype)chain:(SPTaskChainCallback)chainer onExecutor:(id<SPA_NS(Executor)>)executor;
+- (instancetype)recover:(SPTaskRecoverCallback)recoverer onExecutor:(id<SPA_NS(Executor)>)executor;
+@end
+
+
+@interface SPA_NS(Task) (SPTaskTimeout)
+
+/** @method timeout:
+    @return A task that completes or fails like the receiver, unless 'timeout' seconds pass first.
+            In that case, it fails with SPTaskErrorTimedOut in SPTaskErrorDomain, and the receiver
+            is cancelled. Cancelling the returned task doesn't cancel the receiver.
+    @discussion Timeouts are kept on a timer wheel shared by all tasks, so arming one and having
+    it disarmed when the receiver completes in time costs next to nothing, and they don't take
+    up the main queue. Timers have millisecond resolution.
+ */
+- (instancetype)timeout:(NSTimeInterval)timeout;
+
+/** @method deadline:
+    @discussion Like timeout:, with the time limit given as a point in time. */
+- (instancetype)deadline:(NSDate*)deadline;
+@end
+
+
+@interface SPA_NS(Task) (SPTaskRetry)
+
+/** @method retry:attempts:backoff:jitter:
+    @return A task for the first successful outcome of up to 'attempts' tasks from 'work'.
+    @discussion 'work' is called once right away. Whenever the task it returns fails, it's
+    called again after a delay, which starts out at 'backoff' seconds and doubles with every
+    retry. Each delay is shortened by a random fraction of up to 'jitter' (0 to 1) of itself, so
+    that many clients failing at once don't all come back at once. If the last attempt fails,
+    so does the returned task, with its error. Retries are started from the global
+    default-priority queue, on the shared timer wheel.
+    
+    Cancelling the returned task cancels the attempt in progress, or the wait for the next one.
+ */
++ (instancetype)retry:(SPTaskTaskGeneratingCallback)work attempts:(NSUInteger)attempts backoff:(NSTimeInterval)backoff jitter:(double)jitter;
+
+/** @method hedge:after:maxCopies:
+    @return A task for the first success among up to 'maxCopies' concurrent tasks from 'work'.
+    @discussion 'work' is called once right away, and again every 'delay' seconds for as long as
+    none of the tasks it returned has succeeded, to cut the tail latency of a backend that's
+    sometimes slow. A copy that fails makes way for the next one at once. As soon as one copy
+    succeeds, the rest are cancelled. If they all fail, so does the returned task, with the
+    last error.
+    
+    Cancelling the returned task cancels every copy still running. Copies after the first are
+    started from the global default-priority queue.
+ */
++ (instancetype)hedge:(SPTaskTaskGeneratingCallback)work after:(NSTimeInterval)delay maxCopies:(NSUInteger)maxCopies;
+@end
+
+
+@interface SPA_NS(Task) (SPTaskInlineExecution)
+
+/** @method inlineQueue
+    @abstract Pseudo-queue for continuations that are cheap enough to run wherever the task completes.
+    @discussion Pass this as the queue to addCallback:on:, then:on:, chain:on: and friends to have
+    the callback called synchronously on the thread that completes the task (or, if the task has
+    already completed, on the thread that adds the callback), saving a dispatch_async per link.
+    Only use it for short, non-blocking work that doesn't care which thread it runs on.
+    
+    To keep long chains from overflowing the stack, only a limited number of continuations may
+    run nested inside each other on one thread. Past that limit, continuations are dispatched to
+    this queue like to any other queue, and run concurrently in the background.
+    
+    Separately from this, if a task completes from within a callback running on some queue, that
+    task's continuations for the same queue are run right away instead of being enqueued, under
+    the same nesting limit.
+ */
++ (dispatch_queue_t)inlineQueue;
+
+/** @method getCompletedValue:error:
+    @abstract Reads the outcome of a task that has already completed, without waiting for it.
+    @discussion For code that can skip registering a callback (and the suspension or dispatch
+    that comes with it) when the result is already there, like SPAsyncAwait.
+    @return YES, filling in 'value' or 'error', if the task has succeeded or failed; NO if it's
+            still pending or was cancelled.
+ */
+- (BOOL)getCompletedValue:(id*)value error:(NSError**)error;
+@end
+
+
+@interface SPA_GENERIC(SPA_NS(Task), PromisedType) (SPTaskWaiting)
+
+/** @method waitWithTimeout:error:
+    @abstract Blocks the calling thread until the task completes, for synchronous code that has to
+              call into asynchronous code.
+    @discussion The state is checked first and then polled for a short while, so a task that is
+    already complete or about to be costs no more than a few atomic loads and allocates nothing.
+    Only then does the thread go to sleep, to be woken directly by whichever thread resolves the
+    task, rather than through a callback dispatched to some queue.
+    
+    Never do this on a queue that the task's completion depends on. The one case that is caught
+    is waiting on the main thread for a task that a then:, chain: or recover: callback, or the
+    work of performWork:onQueue: or fetchWork:onQueue:, will complete from the main queue and has
+    yet to start: that fails right away with SPTaskErrorWouldDeadlock instead of hanging.
+    @param timeout  How long to wait at most. 0 just checks; INFINITY waits for as long as it takes.
+    @return The task's value, or nil with 'error' set to the task's error, or to SPTaskErrorTimedOut,
+            SPTaskErrorCancelled or SPTaskErrorWouldDeadlock in SPTaskErrorDomain.
+ */
+- (SPA_GENERIC_TYPE(PromisedType))waitWithTimeout:(NSTimeInterval)timeout error:(NSError**)error;
+@end
+
+
+@interface SPA_NS(Task) (SPTaskScalars)
+
+/** @method completedTaskWithBool:
+    @abstract Completed tasks for scalar results, stored unboxed.
+    @discussion Tasks completed with a scalar, here or with -[SPTaskCompletionSource completeWithBool:]
+    and friends, hand it to the typed callbacks below as is. Only callbacks that want an object
+    get an NSNumber, made the first time one is needed. Like completedTask:, these return a new
+    task each time.
+ */
++ (instancetype)completedTaskWithBool:(BOOL)value;
++ (instancetype)completedTaskWithInteger:(NSInteger)value;
++ (instancetype)completedTaskWithDouble:(double)value;
+
+/** @method addBoolCallback:on:
+    @abstract Like addCallback:on:, for a result that is a scalar.
+    @discussion Scalar results of another type are converted like C would. Object results are
+    converted with boolValue, integerValue or doubleValue, so nil is NO, 0 or 0.0.
+ */
+- (instancetype)addBoolCallback:(SPTaskBoolCallback)callback on:(dispatch_queue_t)queue;
+- (instancetype)addIntegerCallback:(SPTaskIntegerCallback)callback on:(dispatch_queue_t)queue;
+- (instancetype)addDoubleCallback:(SPTaskDoubleCallback)callback on:(dispatch_queue_t)queue;
+@end
+
+
+@interface SPA_NS(Task) (SPTaskDebugging)
+
+/** @property asyncCallStackSymbols
+    @abstract The then:, chain: and recover: calls that led to this task, most recent first.
+    @discussion Each task made by one of those remembers where it was called from, plus
+    everything its receiver remembered, of which the latest 32 calls are given here; so when a
+    task at the end of a long chain fails, this tells which calls the failure came through,
+    even though the stack it's reported on is just a dispatch worker's. Remembering a call
+    takes a small allocation, shared with the tasks later made from this one, which lives as
+    long as any of them do; symbolizing the calls happens here, and is slow. Empty for tasks
+    that weren't made by any of those methods.
+ */
+@property(nonatomic,readonly) NSArray *asyncCallStackSymbols;
 @end
 
 
@@ -171,16 +392,54 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
 
 /** @method performWork:onQueue:
     Convenience method to do work on a specified queue, completing the task with the value
-    returned from the block. */
+    returned from the block. If the task is cancelled before the block has started running,
+    it never will. */
 + (instancetype)performWork:(SPTaskWorkGeneratingCallback)work onQueue:(dispatch_queue_t)queue;
 /** @method fetchWork:onQueue:
     Like performWork:onQueue, but returning a task from the block that we'll wait on before
     completing the task. */
 + (instancetype)fetchWork:(SPTaskTaskGeneratingCallback)work onQueue:(dispatch_queue_t)queue;
 
++ (instancetype)performWork:(SPTaskWorkGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor;
++ (instancetype)fetchWork:(SPTaskTaskGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor;
+
+/** @method performCancellableWork:onQueue:
+    Like performWork:onQueue:, but the block gets a token that it can poll to stop early if
+    the task is cancelled while it's running. Whatever it returns after that is ignored. */
++ (instancetype)performCancellableWork:(SPTaskCancellableWorkCallback)work onQueue:(dispatch_queue_t)queue;
+/** @method fetchCancellableWork:onQueue:
+    Like fetchWork:onQueue:, with a cancellation token like performCancellableWork:onQueue:. */
++ (instancetype)fetchCancellableWork:(SPTaskCancellableTaskGeneratingCallback)work onQueue:(dispatch_queue_t)queue;
+
++ (instancetype)performCancellableWork:(SPTaskCancellableWorkCallback)work onExecutor:(id<SPA_NS(Executor)>)executor;
++ (instancetype)fetchCancellableWork:(SPTaskCancellableTaskGeneratingCallback)work onExecutor:(id<SPA_NS(Executor)>)executor;
+
+/** @method map:maxConcurrency:on:work:
+    Calls 'work' on 'queue' with each of 'items', with at most 'maxConcurrency' calls in flight
+    at once. Items are handed out in small chunks, so that mapping cheap work over a large
+    array doesn't flood the queue with one block per item.
+    @return A task that completes with an array of the values returned from 'work' (NSNull for
+            nil), in the same order as 'items'. If 'work' returns an NSError, the task fails
+            with that error and no more items are started. Cancelling the task also stops the map.
+ */
++ (SPA_NS(Task)*)map:(NSArray*)items maxConcurrency:(NSUInteger)maxConcurrency on:(dispatch_queue_t)queue work:(SPTaskMapCallback)work;
+
+/** @method mapTasks:maxConcurrency:work:
+    Like map:maxConcurrency:on:work:, but for asynchronous work: calls 'work' with each of
+    'items' to start a task for it, starting the next one whenever one of at most
+    'maxConcurrency' tasks in flight completes.
+    @return A task that completes with an array of the values of the started tasks, in the
+            same order as 'items'. If one of them fails, the returned task fails with that
+            error, no more tasks are started, and the ones in flight are cancelled. Cancelling
+            the returned task cancels the ones in flight.
+ */
++ (SPA_NS(Task)*)mapTasks:(NSArray*)items maxConcurrency:(NSUInteger)maxConcurrency work:(SPTaskMapTaskCallback)work;
+
 /** @method delay:completeValue:
     Create a task that will complete after the specified time interval and
-    with specified complete value.
+    with specified complete value. Cancelling the task cancels the timer.
+    NOTE: The task is completed from a private timer queue, not the main queue, so callbacks
+          on +[SPTask inlineQueue] will be called there.
     @return A new task delayed task.
   */
 + (instancetype)delay:(NSTimeInterval)delay completeValue:(SPA_GENERIC_TYPE(PromisedType))completeValue;
@@ -195,13 +454,16 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
 /** @method completedTask:
 	Convenience method for when an asynchronous caller happens to immediately have an
 	available value.
-	@return A new task with a completed value. */
+	@discussion The task is born completed: it costs one allocation, and callbacks added to it
+	are dispatched right away. It's always a new task, whatever the value, so it behaves like
+	any other: cancelling it marks it cancelled, and cancels the tasks derived from it.
+	@return A completed task with the given value. */
 + (instancetype)completedTask:(SPA_GENERIC_TYPE(PromisedType))completeValue;
 
 /** @method failedTask:
 	Convenience method for when an asynchronous caller happens to immediately knows it
 	will fail with a specific failure.
-	@return A new task with an associated error. */
+	@return A new task with an associated error, allocated already failed like completedTask:. */
 + (instancetype)failedTask:(NSError*)failure;
 
 @end
@@ -217,8 +479,17 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
     Signal successful completion of the task to all callbacks. Asserts
     if you try to complete or fail more than once.
     NOTE: If you pass an NSError, this call will forward to failWithError:
+    NOTE: Callbacks on +[SPTask inlineQueue] may be called before this method returns. So
+          may callbacks on the current queue, if you call this from within a task callback.
  */
 - (void)completeWithValue:(SPA_GENERIC_TYPE(PromisedType))value;
+/**
+    Like completeWithValue:, with a scalar that is kept unboxed for the task's typed callbacks
+    (see SPTaskScalars). Object callbacks get it as an NSNumber.
+*/
+- (void)completeWithBool:(BOOL)value;
+- (void)completeWithInteger:(NSInteger)value;
+- (void)completeWithDouble:(double)value;
 /**
     Signal failed completion of the task to all errbacks. Asserts if you
     try to complete or fail more than once.
@@ -232,7 +503,9 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
 */
 - (void)failWithError:(NSError*)error ignoreIfAlreadyCompleted:(BOOL)ignoreSubsequentValues;
 
-/** Signal completion for this source's task based on another task. */
+/** Signal completion for this source's task based on another task.
+    The other task is only followed, since others may be waiting for it too: cancelling this
+    source's task doesn't cancel it. If it's cancelled, so is this source's task. */
 - (void)completeWithTask:(SPA_GENERIC(SPA_NS(Task), PromisedType)*)task;
 
 /** Returns a block that when called calls completeWithValue:nil.
@@ -246,7 +519,8 @@ typedef SPA_NS(Task)*(^SPTaskRecoverCallback)(NSError *error);
 - (void(^)(SPA_GENERIC_TYPE(PromisedType)))resolver;
 
 /** If the task is cancelled, your registered handlers will be called. If you'd rather
-    poll, you can ask task.cancelled. */
+    poll, you can ask task.cancelled. Handlers are called synchronously on the cancelling
+    thread, and are discarded once the task completes or fails. */
 - (void)addCancellationCallback:(void(^)(void))cancellationCallback;
 @end
 
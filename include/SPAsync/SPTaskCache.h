@@ -0,0 +1,71 @@
+//
+//  SPTaskCache.h
+//  SPAsync
+//
+
+#import <SPAsync/SPTask.h>
+
+typedef SPA_NS(Task)*(^SPTaskCacheFetchCallback)(id key);
+typedef NSUInteger(^SPTaskCacheCostCallback)(id key, id value);
+
+/** @class SPTaskCache
+    @abstract Maps keys to the tasks that fetch them, so that everybody asking for the same
+              thing at the same time shares one fetch.
+    @discussion While the fetch for a key is in flight, every request for that key is coalesced
+    onto it. Each caller gets a task of its own, which completes or fails along with the fetch;
+    cancelling it only cancels the fetch once every caller waiting for it has cancelled.
+
+    Once the fetch succeeds, its value stays cached until it is evicted to stay within
+    countLimit and totalCostLimit (least recently used first), or until it's older than
+    timeToLive. Failures are forgotten right away, unless failureTimeToLive is set, in which
+    case they're handed out again until it runs out. Cancelled fetches are always forgotten.
+    Expired entries are dropped when they're next asked for, when they come up for eviction, or
+    by removeExpiredTasks.
+
+    All methods are thread safe.
+ */
+@interface SPA_NS(TaskCache) : NSObject
+
+/** Returns a task for the value of 'key'. If it's cached, the task has already completed (or
+    failed) with it. If a fetch for 'key' is in flight, the task follows that fetch. Otherwise,
+    'fetch' is called synchronously, before this method returns, to start one.
+
+    'fetch' must not ask the cache for 'key' itself; it would end up waiting for itself.
+    Returning nil from it completes the fetch with nil. */
+- (SPA_NS(Task)*)taskForKey:(id<NSCopying>)key fetch:(SPTaskCacheFetchCallback)fetch;
+
+/** Forgets the cached value or in-flight fetch for 'key'. Fetches in flight go on for
+    whoever is waiting for them, but the next request for 'key' starts a new one. */
+- (void)removeTaskForKey:(id)key;
+- (void)removeAllTasks;
+/** Drops every value and failure whose time to live has run out. */
+- (void)removeExpiredTasks;
+
+/** Maximum number of cached values and failures; 0 (the default) means no limit. In-flight
+    fetches don't count. */
+@property(nonatomic) NSUInteger countLimit;
+/** Maximum total cost of the cached values, as given by costCallback; 0 (the default) means
+    no limit. */
+@property(nonatomic) NSUInteger totalCostLimit;
+/** Called (with the cache locked, so keep it quick) for each value as it's cached, to tell its
+    cost, such as its size in bytes. Without one, values cost nothing. */
+@property(nonatomic,copy) SPTaskCacheCostCallback costCallback;
+/** How long a value stays cached, in seconds; 0 (the default) means until it's evicted. */
+@property(nonatomic) NSTimeInterval timeToLive;
+/** How long a failure stays cached, in seconds; 0 (the default) means failures aren't cached. */
+@property(nonatomic) NSTimeInterval failureTimeToLive;
+
+/** Number of cached values and failures. */
+@property(nonatomic,readonly) NSUInteger count;
+@property(nonatomic,readonly) NSUInteger totalCost;
+
+/** Requests answered from the cache. */
+@property(nonatomic,readonly) NSUInteger hitCount;
+/** Requests that started a fetch. */
+@property(nonatomic,readonly) NSUInteger missCount;
+/** Requests that joined a fetch already in flight. */
+@property(nonatomic,readonly) NSUInteger coalescedCount;
+/** Values and failures dropped to stay within countLimit and totalCostLimit. */
+@property(nonatomic,readonly) NSUInteger evictionCount;
+- (void)resetStatistics;
+@end
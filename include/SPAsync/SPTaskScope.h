@@ -0,0 +1,79 @@
+//
+//  SPTaskScope.h
+//  SPAsync
+//
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+@class SPA_NS(Task);
+
+typedef id(^SPTaskScopeCallback)(void);
+
+/** @class SPTaskScope
+    @abstract Keeps track of every task started on behalf of one piece of work, such as a
+              request, so that they can be cancelled, waited for and limited together.
+    @discussion Every task created while a scope is current on the thread (see run:) joins it.
+    The scope stays current for the callbacks of then:, chain: and recover:, and for the work of
+    performWork:, fetchWork: and their cancellable versions, when the task they produce is in
+    the scope; so whatever those start joins it too, on whatever queue they run. Other tasks can
+    be added with addTask:. A task is in at most one scope, and leaves it when it settles. A
+    task that chain: or recover: merges into the task it returned (see chain:on:) hands its
+    place over to that one, unless that is in a scope already.
+
+    A task that would take the scope past its taskLimit fails right away with
+    SPTaskErrorScopeLimitExceeded in SPTaskErrorDomain. It isn't cancelled: finally callbacks
+    get NO. Work queued for it doesn't start, and whoever was going to complete it may still
+    try to, which is ignored.
+
+    A callback added to a task past the scope's continuationLimit is turned away on its own;
+    the task, and the callbacks it already has, carry on as if nothing happened. The callback
+    gets what it would if the task had failed with SPTaskErrorScopeLimitExceeded: an error
+    callback is called with that error, an outcome callback with NO and that error, and a
+    finally callback with NO. Value callbacks (including the Bool, Integer and Double ones)
+    and cancellation callbacks are never called. The same goes for the tasks that then:,
+    chain:, recover: and friends return, which fail with that error instead of following the
+    task. Waiting with waitWithTimeout:error: doesn't count against the limit.
+
+    The scope keeps its outstanding tasks alive until they settle, and they keep the scope
+    alive, so a task that never settles stays around until the scope is cancelled.
+
+    All methods are thread safe.
+ */
+@interface SPA_NS(TaskScope) : NSObject
+/// A scope without limits.
+- (instancetype)init;
+/// 'taskLimit' caps the tasks outstanding in the scope at once, and 'continuationLimit' the
+/// callbacks waiting on them; 0 means no limit.
+- (instancetype)initWithTaskLimit:(NSUInteger)taskLimit continuationLimit:(NSUInteger)continuationLimit;
+@property(nonatomic,readonly) NSUInteger taskLimit;
+@property(nonatomic,readonly) NSUInteger continuationLimit;
+
+/** The scope that tasks created on this thread right now join, if any. */
++ (instancetype)currentScope;
+
+/** Calls 'block' synchronously with the receiver as the current scope, and returns what it
+    returns. Scopes nest; the one that was current before is current again afterwards. */
+- (id)run:(SPTaskScopeCallback)block;
+
+/** Adds 'task' to the scope, as if it had been created in it. Tasks that are already in a scope,
+    or already settled, are left alone. */
+- (void)addTask:(SPA_NS(Task)*)task;
+
+/** Cancels every task in the scope, and every task that joins it from now on. Each outstanding
+    task is cancelled once, without looking at the others. */
+- (void)cancel;
+@property(readonly,getter=isCancelled) BOOL cancelled;
+
+/** Returns a task that completes (with nil) once no task is outstanding in the scope. It
+    doesn't count as one of the scope's tasks itself. To block until then, wait for it with
+    -[SPTask waitWithTimeout:error:]. */
+- (SPA_NS(Task)*)drain;
+
+/// Tasks in the scope that haven't settled yet.
+@property(readonly) NSUInteger taskCount;
+/// Callbacks waiting on those tasks.
+@property(readonly) NSUInteger continuationCount;
+/// Tasks failed, and callbacks turned away, with SPTaskErrorScopeLimitExceeded so far.
+@property(readonly) NSUInteger rejectedCount;
+@end
@@ -0,0 +1,58 @@
+//
+//  SPTaskTrace.h
+//  SPAsync
+//
+
+#import <Foundation/Foundation.h>
+#import <SPAsync/SPAsyncNamespacing.h>
+
+/** @class SPTaskTrace
+    @abstract Records what tasks do, to find out where the time goes in a graph of tasks.
+    @discussion Tracing is always compiled in, but off until enabled; while it's off, each
+    place that would record something costs a single, well-predicted branch.
+
+    While it's on, SPTask records when each task is created, succeeds, fails or is cancelled;
+    when each batch of callbacks is put on its queue (or executor) and when it starts running
+    there, which gives how long it waited; and which tasks feed into which, from then:, chain:,
+    recover:, timeout:, completeWithTask: and the awaitAll: family. Each thread records into a
+    ring buffer of its own without taking any locks, keeping its latest 8192 events.
+
+    Export what was recorded with chromeTraceJSON (for chrome://tracing or Perfetto), or get
+    the gist with slowestChains: and worstQueues:.
+ */
+@interface SPA_NS(TaskTrace) : NSObject
++ (void)setEnabled:(BOOL)enabled;
++ (BOOL)isEnabled;
+/** Forgets everything recorded so far. */
++ (void)reset;
+
+/** Everything recorded so far, in the Chrome trace event format. Tasks and queue waits are
+    async events (in categories "task" and "queue"), and task edges instant events. */
++ (NSData*)chromeTraceJSON;
++ (BOOL)writeChromeTraceToURL:(NSURL*)url error:(NSError**)error;
+
+/** The 'limit' longest-running groups of tasks connected by edges, longest first, as
+    SPTaskTraceChain. */
++ (NSArray*)slowestChains:(NSUInteger)limit;
+/** The 'limit' queues and executors that callbacks waited longest for, by mean wait, as
+    SPTaskTraceQueueStatistics. */
++ (NSArray*)worstQueues:(NSUInteger)limit;
+@end
+
+/** A group of tasks connected by edges, and how long it took from the first of them being
+    created to the last of them resolving. */
+@interface SPA_NS(TaskTraceChain) : NSObject
+/// Address of the first task of the chain to be created.
+@property(nonatomic,readonly) NSString *rootTask;
+@property(nonatomic,readonly) NSUInteger taskCount;
+@property(nonatomic,readonly) NSTimeInterval duration;
+@end
+
+/** How long callbacks waited for a queue or executor to get to them. */
+@interface SPA_NS(TaskTraceQueueStatistics) : NSObject
+/// The queue's label, or the executor's class and address.
+@property(nonatomic,readonly) NSString *label;
+@property(nonatomic,readonly) NSUInteger count;
+@property(nonatomic,readonly) NSTimeInterval meanWait;
+@property(nonatomic,readonly) NSTimeInterval maxWait;
+@end